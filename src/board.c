@@ -4,6 +4,8 @@
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/crs.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/nvic.h>
 
 void board_initialize()
 {
@@ -39,3 +41,13 @@ void board_initialize()
   TIM2_CR1 = TIM_CR1_CEN;
   TIM2_EGR = TIM_EGR_UG;
 }
+
+void board_enable_interrupts(uint32_t tick_hz)
+{
+  systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+  systick_set_reload(48000000 / tick_hz - 1);
+  systick_interrupt_enable();
+  systick_counter_enable();
+  
+  nvic_enable_irq(NVIC_USB_IRQ);
+}
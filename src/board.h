@@ -7,4 +7,8 @@
 
 void board_initialize();
 
+/* Start the SysTick interrupt at the given rate and enable the USB
+ * interrupt. Called after the USB device has been initialized. */
+void board_enable_interrupts(uint32_t tick_hz);
+
 #endif
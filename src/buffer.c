@@ -2,58 +2,341 @@
 #include <assert.h>
 #include <stdio.h>
 #include <libopencm3/cm3/cortex.h>
+#include "systime.h"
 #include "debug.h"
 
-/* Smallest buffers are ordered first in the list. */
-static buffer_t *g_freelist;
+/* Buffers of equal size form a pool, and the free buffers of each pool
+ * are kept in a LIFO stack linked through the ptr field. Pools are ordered
+ * smallest first, so allocation takes the first non-empty pool that is
+ * large enough. The pool count is a small compile-time constant, which
+ * bounds the time spent with interrupts disabled.
+ *
+ * Each pool also tracks how many of its buffers every allocation class
+ * holds, so that reservations of one class can be kept out of reach of
+ * the others. */
+typedef struct {
+  uint16_t max_size;
+  uint8_t count;
+  uint8_t free_count;
+  uint8_t high_water;
+  uint8_t in_use[BUFFER_CLASS_COUNT];
+  uint8_t reserved[BUFFER_CLASS_COUNT];
+  buffer_t *free;
+} buffer_pool_t;
 
-buffer_t *buffer_allocate(size_t size)
+/* Per-buffer bookkeeping, indexed by buffer_t.index */
+typedef struct {
+  uint8_t pool;
+  uint8_t site;
+  uint8_t refcount;
+  uint16_t ext_size;
+  buffer_t *buffer;    /* Header at the start of the pool buffer */
+  systime_t alloc_time;
+  const uint8_t *ext;  /* External data attached by buffer_attach() */
+  const uint8_t *ext_at; /* Position in data[] where it is inserted */
+} buffer_info_t;
+
+static const uint8_t g_buffer_site_class[BUFFER_SITE_COUNT] = {
+  [BUFFER_SITE_USBNET_RX]       = BUFFER_CLASS_RX,
+  [BUFFER_SITE_RNDIS_RESPONSE]  = BUFFER_CLASS_CTRL,
+  [BUFFER_SITE_TCPIP_CTRL]      = BUFFER_CLASS_CTRL,
+  [BUFFER_SITE_TCPIP_TX]        = BUFFER_CLASS_TX,
+  [BUFFER_SITE_HTTP_CHUNK]      = BUFFER_CLASS_TX,
+};
+
+static buffer_pool_t g_buffer_pools[BUFFER_MAX_POOLS];
+static int g_buffer_pool_count;
+static buffer_info_t g_buffer_info[BUFFER_MAX_COUNT];
+static int g_buffer_count;
+static uint8_t g_buffer_class_in_use[BUFFER_CLASS_COUNT];
+static uint8_t g_buffer_class_limit[BUFFER_CLASS_COUNT] = {255, 255, 255};
+static buffer_site_stats_t g_buffer_site_stats[BUFFER_SITE_COUNT];
+
+void buffer_add_pool(void *storage, size_t size, size_t count)
 {
-  CM_ATOMIC_CONTEXT();
+  assert(g_buffer_pool_count < BUFFER_MAX_POOLS);
+  assert(g_buffer_count + count <= BUFFER_MAX_COUNT);
+  
+  int i = g_buffer_pool_count++;
+  while (i > 0 && g_buffer_pools[i - 1].max_size > size)
+  {
+    g_buffer_pools[i] = g_buffer_pools[i - 1];
+    i--;
+  }
+  
+  for (int j = 0; j < g_buffer_count; j++)
+  {
+    if (g_buffer_info[j].pool >= i)
+    {
+      g_buffer_info[j].pool++;
+    }
+  }
+  
+  memset(&g_buffer_pools[i], 0, sizeof(buffer_pool_t));
+  g_buffer_pools[i].max_size = size;
+  
+  uint8_t *p = storage;
+  for (size_t j = 0; j < count; j++)
+  {
+    buffer_t *buffer = (buffer_t*)p;
+    *(uint16_t*)&buffer->max_size = size;
+    buffer->index = g_buffer_count++;
+    g_buffer_info[buffer->index].pool = i;
+    g_buffer_info[buffer->index].site = BUFFER_SITE_COUNT;
+    g_buffer_info[buffer->index].buffer = buffer;
+    
+    buffer->ptr = g_buffer_pools[i].free;
+    g_buffer_pools[i].free = buffer;
+    g_buffer_pools[i].count++;
+    g_buffer_pools[i].free_count++;
+    p += sizeof(buffer_t) + size;
+  }
+}
+
+void buffer_reserve(buffer_class_t cls, size_t size, size_t count)
+{
+  for (int i = 0; i < g_buffer_pool_count; i++)
+  {
+    if (g_buffer_pools[i].max_size >= size)
+    {
+      g_buffer_pools[i].reserved[cls] = count;
+      return;
+    }
+  }
+  
+  warn("No buffer pool for reserving %d bytes", (int)size);
+}
+
+void buffer_set_limit(buffer_class_t cls, size_t count)
+{
+  g_buffer_class_limit[cls] = (count < 255) ? count : 255;
+}
+
+/* Number of free buffers in pool that are not reserved for other classes. */
+static unsigned pool_unreserved(const buffer_pool_t *pool, buffer_class_t cls)
+{
+  unsigned reserved = 0;
+  for (int i = 0; i < BUFFER_CLASS_COUNT; i++)
+  {
+    if (i != cls && pool->reserved[i] > pool->in_use[i])
+    {
+      reserved += pool->reserved[i] - pool->in_use[i];
+    }
+  }
+  
+  return (pool->free_count > reserved) ? pool->free_count - reserved : 0;
+}
 
+/* Check if pool has a free buffer that is not reserved for other classes. */
+static bool pool_available(const buffer_pool_t *pool, buffer_class_t cls)
+{
+  return pool_unreserved(pool, cls) > 0;
+}
+
+buffer_t *buffer_allocate(size_t size, buffer_site_t site)
+{
   buffer_t *result = NULL;
-  buffer_t **tailptr = &g_freelist;
-  while (*tailptr)
+  assert(site < BUFFER_SITE_COUNT);
+  buffer_class_t cls = g_buffer_site_class[site];
+  
   {
-    if ((*tailptr)->max_size >= size)
+    CM_ATOMIC_CONTEXT();
+    
+    if (g_buffer_class_in_use[cls] < g_buffer_class_limit[cls])
     {
-      result = *tailptr;
-      *tailptr = result->ptr;
-      result->ptr = NULL;
-      result->data_size = 0;
-      break;
+      for (int i = 0; i < g_buffer_pool_count; i++)
+      {
+        buffer_pool_t *pool = &g_buffer_pools[i];
+        if (pool->max_size >= size && pool_available(pool, cls))
+        {
+          result = pool->free;
+          pool->free = result->ptr;
+          pool->free_count--;
+          pool->in_use[cls]++;
+          g_buffer_class_in_use[cls]++;
+          
+          uint8_t in_use = pool->count - pool->free_count;
+          if (in_use > pool->high_water)
+          {
+            pool->high_water = in_use;
+          }
+          
+          g_buffer_info[result->index].site = site;
+          g_buffer_info[result->index].alloc_time = get_systime();
+          g_buffer_info[result->index].ext_size = 0;
+          g_buffer_info[result->index].refcount = 1;
+          result->ptr = NULL;
+          result->data_size = 0;
+          break;
+        }
+      }
     }
     
-    tailptr = (buffer_t**)&(*tailptr)->ptr;
+    if (!result && g_buffer_site_stats[site].failures < UINT16_MAX)
+    {
+      g_buffer_site_stats[site].failures++;
+    }
   }
   
   if (!result)
   {
-    warn("No buffers left, trying to allocate %d bytes", (int)size);
+    warn("No buffers left, trying to allocate %d bytes for site %d", (int)size, site);
   }
 
   return result;
 }
 
+size_t buffer_available(size_t size, buffer_class_t cls)
+{
+  CM_ATOMIC_CONTEXT();
+  
+  if (g_buffer_class_in_use[cls] >= g_buffer_class_limit[cls])
+  {
+    return 0;
+  }
+  
+  size_t count = 0;
+  for (int i = 0; i < g_buffer_pool_count; i++)
+  {
+    if (g_buffer_pools[i].max_size >= size)
+    {
+      count += pool_unreserved(&g_buffer_pools[i], cls);
+    }
+  }
+  
+  size_t limit = g_buffer_class_limit[cls] - g_buffer_class_in_use[cls];
+  return (count < limit) ? count : limit;
+}
+
+buffer_t *buffer_retain(buffer_t *buffer)
+{
+  CM_ATOMIC_CONTEXT();
+  
+  buffer_info_t *info = &g_buffer_info[buffer->index];
+  assert(info->refcount > 0 && info->refcount < UINT8_MAX);
+  info->refcount++;
+  return buffer;
+}
+
+size_t buffer_get_refcount(const buffer_t *buffer)
+{
+  return g_buffer_info[buffer->index].refcount;
+}
+
+buffer_class_t buffer_get_class(const buffer_t *buffer)
+{
+  /* The site is BUFFER_SITE_COUNT once the buffer has been released */
+  const buffer_info_t *info = &g_buffer_info[buffer->index];
+  assert(info->site < BUFFER_SITE_COUNT);
+  return g_buffer_site_class[info->site];
+}
+
 void buffer_release(buffer_t *buffer)
 {
   CM_ATOMIC_CONTEXT();
 
+  buffer_info_t *info = &g_buffer_info[buffer->index];
+  buffer_pool_t *pool = &g_buffer_pools[info->pool];
+  assert(info->site < BUFFER_SITE_COUNT);
+  assert(info->refcount > 0);
+  
+  if (--info->refcount > 0)
+  {
+    return;
+  }
+  
+  /* The caller may have passed a slice, return the whole buffer */
+  buffer = info->buffer;
+  
+  buffer_class_t cls = g_buffer_site_class[info->site];
+  pool->in_use[cls]--;
+  g_buffer_class_in_use[cls]--;
+  
+  systime_t hold_time = get_systime() - info->alloc_time;
+  if (hold_time > g_buffer_site_stats[info->site].max_hold_time)
+  {
+    g_buffer_site_stats[info->site].max_hold_time = hold_time;
+  }
+  info->site = BUFFER_SITE_COUNT;
+  
   buffer->data_size = 0;
+  buffer->ptr = pool->free;
+  pool->free = buffer;
+  pool->free_count++;
+}
+
+void buffer_attach(buffer_t *buf, const void *ext, size_t size)
+{
+  buffer_info_t *info = &g_buffer_info[buf->index];
+  assert(info->ext_size == 0);
+  info->ext = ext;
+  info->ext_at = &buf->data[buf->data_size];
+  info->ext_size = size;
+}
+
+size_t buffer_get_ext(const buffer_t *buf, size_t *offset, const uint8_t **ext)
+{
+  const buffer_info_t *info = &g_buffer_info[buf->index];
+  if (info->ext_size)
+  {
+    *offset = info->ext_at - buf->data;
+    *ext = info->ext;
+  }
+  return info->ext_size;
+}
+
+size_t buffer_frame_size(const buffer_t *buf)
+{
+  return buf->data_size + g_buffer_info[buf->index].ext_size;
+}
+
+const uint8_t *buffer_gather(const buffer_t *buf, size_t pos, size_t len, uint8_t *scratch)
+{
+  size_t offset;
+  const uint8_t *ext;
+  size_t ext_size = buffer_get_ext(buf, &offset, &ext);
   
-  buffer_t **tailptr = &g_freelist;
-  while (*tailptr)
+  if (ext_size == 0 || pos + len <= offset)
   {
-    if ((*tailptr)->max_size >= buffer->max_size)
-    {
-      break;
-    }
+    return &buf->data[pos];
+  }
+  else if (pos >= offset + ext_size)
+  {
+    return &buf->data[pos - ext_size];
+  }
+  else if (pos >= offset && pos + len <= offset + ext_size)
+  {
+    return &ext[pos - offset];
+  }
+  
+  /* Range crosses the boundary of external data, copy it together */
+  for (size_t i = 0; i < len; i++, pos++)
+  {
+    if (pos < offset)
+      scratch[i] = buf->data[pos];
+    else if (pos < offset + ext_size)
+      scratch[i] = ext[pos - offset];
+    else
+      scratch[i] = buf->data[pos - ext_size];
+  }
+  
+  return scratch;
+}
 
-    tailptr = (buffer_t**)&(*tailptr)->ptr;
+void buffer_get_stats(buffer_stats_t *stats)
+{
+  CM_ATOMIC_CONTEXT();
+  
+  stats->pool_count = g_buffer_pool_count;
+  for (int i = 0; i < g_buffer_pool_count; i++)
+  {
+    stats->pools[i].max_size = g_buffer_pools[i].max_size;
+    stats->pools[i].count = g_buffer_pools[i].count;
+    stats->pools[i].in_use = g_buffer_pools[i].count - g_buffer_pools[i].free_count;
+    stats->pools[i].high_water = g_buffer_pools[i].high_water;
   }
   
-  buffer->ptr = *tailptr;
-  *tailptr = buffer;
+  memcpy(stats->sites, g_buffer_site_stats, sizeof(g_buffer_site_stats));
 }
 
 bool buffer_printf(buffer_t* buf, const char* fmt, ...)
@@ -128,11 +411,52 @@ size_t bufferlist_size(const buffer_t *list)
   return size;
 }
 
+void bufferqueue_push(bufferqueue_t *queue, buffer_t *element)
+{
+  assert(element != queue->tail);
+  element->ptr = NULL;
+  
+  if (queue->tail)
+  {
+    queue->tail->ptr = element;
+  }
+  else
+  {
+    queue->head = element;
+  }
+  
+  queue->tail = element;
+  queue->size++;
+  
+  if (queue->size > queue->peak)
+  {
+    queue->peak = queue->size;
+  }
+}
+
+buffer_t *bufferqueue_pop(bufferqueue_t *queue)
+{
+  buffer_t *result = queue->head;
+  if (result)
+  {
+    queue->head = result->ptr;
+    if (!queue->head)
+    {
+      queue->tail = NULL;
+    }
+    
+    queue->size--;
+    result->ptr = NULL;
+  }
+  return result;
+}
+
 buffer_t* buffer_slice(buffer_t* buf, size_t prefix, size_t suffix)
 {
   assert(prefix >= sizeof(buffer_t));
   buffer_t *inner = (buffer_t*)&buf->data[prefix - sizeof(buffer_t)];
   inner->ptr = NULL;
+  inner->index = buf->index;
   *(uint16_t*)&inner->max_size = buf->max_size - prefix - suffix;
   
   if (buf->data_size >= prefix + suffix)
@@ -9,22 +9,115 @@ typedef struct {
   void *ptr; /* Free field to use by buffer owner. */
   const uint16_t max_size;
   uint16_t data_size;
+  uint8_t index; /* Buffer number in the allocator, do not modify. */
   uint8_t data[];
 } __attribute__((packed)) buffer_t;
 
 typedef void *(buffer_callback_t)();
 
-/* Allocate a buffer with atleast the given size.
- * Returns NULL if all buffers are in use.
+/* Maximum number of distinct buffer sizes */
+#define BUFFER_MAX_POOLS 4
+
+/* Maximum total number of buffers in all pools, at most 255. The host
+ * allocator benchmark raises it. */
+#ifndef BUFFER_MAX_COUNT
+#define BUFFER_MAX_COUNT 8
+#endif
+
+/* Allocation classes, used for reserving buffers so that one kind of
+ * traffic cannot starve the others. */
+typedef enum {
+  BUFFER_CLASS_RX = 0, /* Frames received from the host */
+  BUFFER_CLASS_CTRL,   /* ACKs, neighbor and router adverts, RNDIS responses */
+  BUFFER_CLASS_TX,     /* Outgoing data segments */
+  BUFFER_CLASS_COUNT
+} buffer_class_t;
+
+/* Allocation sites, used for statistics. Each site belongs to one class. */
+typedef enum {
+  BUFFER_SITE_USBNET_RX = 0,   /* class RX */
+  BUFFER_SITE_RNDIS_RESPONSE,  /* class CTRL */
+  BUFFER_SITE_TCPIP_CTRL,      /* class CTRL */
+  BUFFER_SITE_TCPIP_TX,        /* class TX */
+  BUFFER_SITE_HTTP_CHUNK,      /* class TX */
+  BUFFER_SITE_COUNT
+} buffer_site_t;
+
+/* Allocator statistics, see buffer_get_stats() */
+typedef struct {
+  uint16_t max_size;
+  uint8_t count;
+  uint8_t in_use;
+  uint8_t high_water;
+} __attribute__((packed)) buffer_pool_stats_t;
+
+typedef struct {
+  uint16_t failures;      /* Number of failed allocations */
+  uint32_t max_hold_time; /* Longest time a buffer was held, in microseconds */
+} __attribute__((packed)) buffer_site_stats_t;
+
+typedef struct {
+  uint8_t pool_count;
+  buffer_pool_stats_t pools[BUFFER_MAX_POOLS];
+  buffer_site_stats_t sites[BUFFER_SITE_COUNT];
+} buffer_stats_t;
+
+/* Add count buffers of the given data size to the allocator.
+ * Storage must be an array of count elements, each consisting of a buffer_t
+ * header followed by size bytes of data.
+ * Called once for each buffer size during initialization.
+ */
+void buffer_add_pool(void *storage, size_t size, size_t count);
+
+/* Guarantee that count buffers of the pool serving the given size are
+ * only allocated by the given class.
+ */
+void buffer_reserve(buffer_class_t cls, size_t size, size_t count);
+
+/* Limit the total number of buffers the class can hold at once. */
+void buffer_set_limit(buffer_class_t cls, size_t count);
+
+/* Allocate a buffer with atleast the given size. The site determines the
+ * allocation class and is recorded for statistics.
+ * Returns the smallest free buffer that fits, or NULL if all buffers
+ * available to the class are in use.
+ * Runs in constant time with respect to the number of buffers.
  * Safe to call from IRQs.
  */
-buffer_t *buffer_allocate(size_t size);
+buffer_t *buffer_allocate(size_t size, buffer_site_t site);
 
-/* Release a previously allocated buffer.
+/* Return the number of buffers of atleast the given size that the class
+ * could allocate right now.
+ * Safe to call from IRQs.
+ */
+size_t buffer_available(size_t size, buffer_class_t cls);
+
+/* Add a reference to a buffer. A newly allocated buffer has one
+ * reference, and each buffer_release() drops one. The buffer returns to
+ * the pool when the last reference is dropped. Works on slices also.
+ * Note that the ptr field is shared, so a buffer can still be in only
+ * one list or queue at a time.
+ * Safe to call from IRQs.
+ */
+buffer_t *buffer_retain(buffer_t *buffer);
+
+/* Return the current number of references to buffer. */
+size_t buffer_get_refcount(const buffer_t *buffer);
+
+/* Return the class the buffer was allocated for. */
+buffer_class_t buffer_get_class(const buffer_t *buffer);
+
+/* Drop a reference to a buffer, and release it if it was the last one.
+ * The buffer can also be a slice of the allocated buffer.
  * Safe to call from IRQs.
  */
 void buffer_release(buffer_t *buffer);
 
+/* Take a consistent snapshot of allocator statistics.
+ * Safe to call from IRQs.
+ */
+void buffer_get_stats(buffer_stats_t *stats);
+
 /* Append the printf result to buffer and return true.
  * If the text doesn't fit fully in buffer, leaves buffer as is and returns false.
  */
@@ -35,11 +128,56 @@ bool buffer_printf(buffer_t *buf, const char *fmt, ...);
  */
 bool buffer_append(buffer_t *buf, void *data, size_t size);
 
+/* Attach read-only external data, such as a region of flash, to the end of
+ * the current buffer contents. The data is not copied, but becomes part of
+ * the frame when it is transmitted: the frame consists of the data[] bytes
+ * before the attach point, then the external data, then any bytes appended
+ * to data[] later. The external data must stay valid until the buffer
+ * is released. Only one attachment per buffer is supported.
+ */
+void buffer_attach(buffer_t *buf, const void *ext, size_t size);
+
+/* Return the size of attached external data, or 0 if none. If there is
+ * some, also returns its position relative to buf->data and its contents.
+ */
+size_t buffer_get_ext(const buffer_t *buf, size_t *offset, const uint8_t **ext);
+
+/* Return the total frame size, including any external data. */
+size_t buffer_frame_size(const buffer_t *buf);
+
+/* Return pointer to len bytes of the frame starting at pos. If the range
+ * is not contiguous in memory, it is copied to scratch.
+ */
+const uint8_t *buffer_gather(const buffer_t *buf, size_t pos, size_t len, uint8_t *scratch);
+
 /* Linked lists of multiple buffers, uses the ptr pointer. */
 void bufferlist_append(buffer_t **list, buffer_t *element);
 buffer_t *bufferlist_popfront(buffer_t **list);
 size_t bufferlist_size(const buffer_t *list);
 
+/* FIFO queue of buffers, uses the ptr pointer. All operations are
+ * constant time. The queue itself is not locked, callers that share it
+ * with IRQs must disable interrupts around the calls. */
+typedef struct {
+  buffer_t *head;
+  buffer_t *tail;
+  uint8_t size;
+  uint8_t peak; /* Largest size seen */
+} bufferqueue_t;
+
+void bufferqueue_push(bufferqueue_t *queue, buffer_t *element);
+buffer_t *bufferqueue_pop(bufferqueue_t *queue);
+
+static inline buffer_t *bufferqueue_peek(const bufferqueue_t *queue)
+{
+  return queue->head;
+}
+
+static inline size_t bufferqueue_size(const bufferqueue_t *queue)
+{
+  return queue->size;
+}
+
 /* Slicing of buffers for passing only part of it to lower levels. */
 buffer_t *buffer_slice(buffer_t *buf, size_t prefix, size_t suffix);
 buffer_t *buffer_unslice(buffer_t *buf, size_t prefix, size_t suffix);
@@ -0,0 +1,148 @@
+#include "capture.h"
+
+#if CAPTURE_ENABLE
+
+#include "network_std.h"
+#include "systime.h"
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+
+/* Frame seq is stored at index seq % CAPTURE_ENTRIES. New frames are
+ * copied to the slot of the next sequence number, which only advances
+ * when the frame is kept. That slot is always being reused, so the ring
+ * holds CAPTURE_ENTRIES - 1 complete frames. */
+typedef struct {
+  systime_t time;
+  uint16_t length;
+  uint8_t data[CAPTURE_SNAPLEN];
+} capture_entry_t;
+
+static capture_entry_t g_capture_ring[CAPTURE_ENTRIES];
+static uint32_t g_capture_seq;
+static uint16_t g_capture_exclude_ports[CAPTURE_EXCLUDE_PORTS];
+
+#define TCP_PORTS_OFFSET (sizeof(ethernet_header_t) + sizeof(ipv6_header_t))
+
+static bool capture_port_excluded(uint16_t port)
+{
+  if (port == 0)
+  {
+    return false;
+  }
+  
+  for (int i = 0; i < CAPTURE_EXCLUDE_PORTS; i++)
+  {
+    if (g_capture_exclude_ports[i] == port)
+    {
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+static bool capture_is_excluded(const capture_entry_t *entry, size_t len)
+{
+  if (len < TCP_PORTS_OFFSET + 4)
+  {
+    return false;
+  }
+  
+  const ethernet_header_t *eth = (const void*)entry->data;
+  const ipv6_header_t *ip = (const void*)&entry->data[sizeof(ethernet_header_t)];
+  const tcp_header_t *tcp = (const void*)&entry->data[TCP_PORTS_OFFSET];
+  
+  return buint16_to_uint16(eth->ethertype) == ETHERTYPE_IPV6 &&
+         ip->next_header == 6 &&
+         (capture_port_excluded(buint16_to_uint16(tcp->source_port)) ||
+          capture_port_excluded(buint16_to_uint16(tcp->dest_port)));
+}
+
+void capture_frame(const buffer_t *frame)
+{
+  capture_entry_t *entry = &g_capture_ring[g_capture_seq % CAPTURE_ENTRIES];
+  size_t size = buffer_frame_size(frame);
+  size_t len = (size < CAPTURE_SNAPLEN) ? size : CAPTURE_SNAPLEN;
+  
+  const uint8_t *data = buffer_gather(frame, 0, len, entry->data);
+  if (data != entry->data) memcpy(entry->data, data, len);
+  
+  if (!capture_is_excluded(entry, len))
+  {
+    entry->time = get_systime();
+    entry->length = size;
+    g_capture_seq++;
+  }
+}
+
+/* Free entries are 0, which is never a port of a TCP connection */
+bool capture_exclude_port(uint16_t port)
+{
+  CM_ATOMIC_CONTEXT();
+  
+  for (int i = 0; i < CAPTURE_EXCLUDE_PORTS; i++)
+  {
+    if (g_capture_exclude_ports[i] == 0)
+    {
+      g_capture_exclude_ports[i] = port;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+void capture_include_port(uint16_t port)
+{
+  CM_ATOMIC_CONTEXT();
+  
+  for (int i = 0; i < CAPTURE_EXCLUDE_PORTS; i++)
+  {
+    if (g_capture_exclude_ports[i] == port)
+    {
+      g_capture_exclude_ports[i] = 0;
+      return;
+    }
+  }
+}
+
+uint32_t capture_first_seq()
+{
+  CM_ATOMIC_CONTEXT();
+  return (g_capture_seq >= CAPTURE_ENTRIES) ? g_capture_seq - (CAPTURE_ENTRIES - 1) : 0;
+}
+
+uint32_t capture_next_seq()
+{
+  CM_ATOMIC_CONTEXT();
+  return g_capture_seq;
+}
+
+bool capture_pcap_header(buffer_t *buf)
+{
+  /* Microsecond timestamps, Ethernet link type */
+  uint32_t header[6] = {0xA1B2C3D4, 0x00040002, 0, 0, CAPTURE_SNAPLEN, 1};
+  return buffer_append(buf, header, sizeof(header));
+}
+
+bool capture_pcap_record(buffer_t *buf, uint32_t seq)
+{
+  CM_ATOMIC_CONTEXT();
+  
+  if (seq >= g_capture_seq || g_capture_seq - seq >= CAPTURE_ENTRIES)
+  {
+    return false;
+  }
+  
+  const capture_entry_t *entry = &g_capture_ring[seq % CAPTURE_ENTRIES];
+  size_t len = (entry->length < CAPTURE_SNAPLEN) ? entry->length : CAPTURE_SNAPLEN;
+  uint32_t header[4] = {
+    entry->time / SYSTIME_FREQ, entry->time % SYSTIME_FREQ, len, entry->length
+  };
+  
+  buffer_append(buf, header, sizeof(header));
+  buffer_append(buf, (void*)entry->data, len);
+  return true;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* Packet capture ring. usbnet records the start of every frame it
+ * transmits or hands to tcpip, with a timestamp, and the ring can be
+ * downloaded as a pcap file from /api/capture.pcap.
+ *
+ * Disabled by default because of the RAM it takes. When disabled, the
+ * hooks compile to nothing. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "buffer.h"
+
+#ifndef CAPTURE_ENABLE
+#define CAPTURE_ENABLE 0
+#endif
+
+/* Number of frames kept, oldest are overwritten first */
+#ifndef CAPTURE_ENTRIES
+#define CAPTURE_ENTRIES 8
+#endif
+
+/* Bytes kept of each frame, enough for Ethernet, IPv6 and TCP headers */
+#ifndef CAPTURE_SNAPLEN
+#define CAPTURE_SNAPLEN 74
+#endif
+
+/* Size of the pcap file header and the largest pcap record */
+#define CAPTURE_PCAP_HEADER_SIZE 24
+#define CAPTURE_PCAP_RECORD_MAX (16 + CAPTURE_SNAPLEN)
+
+#if CAPTURE_ENABLE
+
+/* Record a frame. Call with interrupts disabled. */
+void capture_frame(const buffer_t *frame);
+
+/* Number of TCP ports that can be excluded at the same time */
+#ifndef CAPTURE_EXCLUDE_PORTS
+#define CAPTURE_EXCLUDE_PORTS 2
+#endif
+
+/* Don't record TCP frames to or from the given port until
+ * capture_include_port() is called for it. Used by each download so that
+ * it does not capture itself. Returns false if the set is full. */
+bool capture_exclude_port(uint16_t port);
+void capture_include_port(uint16_t port);
+
+/* Sequence numbers of the oldest frame still in the ring and of the next
+ * frame to be recorded */
+uint32_t capture_first_seq();
+uint32_t capture_next_seq();
+
+/* Append the pcap file header to buf */
+bool capture_pcap_header(buffer_t *buf);
+
+/* Append the pcap record of frame seq to buf, which must have room for
+ * CAPTURE_PCAP_RECORD_MAX bytes. Returns false if the frame has already
+ * been overwritten. */
+bool capture_pcap_record(buffer_t *buf, uint32_t seq);
+
+#else
+
+static inline void capture_frame(const buffer_t *frame) {}
+
+#endif
+
+#endif
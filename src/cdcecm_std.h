@@ -15,6 +15,9 @@
 #define USB_CDC_TYPE_ENFD     0x0F
 #define USB_CDC_TYPE_NCM      0x1A
 
+/* Data interface protocol for NCM, Table 4-2 */
+#define USB_CDC_NCM_DATA_PROTOCOL_NTB 0x01
+
 /* Class-specific notification codes */
 #define USB_CDC_NOTIFY_NETWORK_CONNECTION       0x00
 #define USB_CDC_NOTIFY_CONNECTION_SPEED_CHANGE  0x2A
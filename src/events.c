@@ -0,0 +1,30 @@
+#include "events.h"
+#include <libopencm3/cm3/cortex.h>
+
+static volatile uint32_t g_events;
+
+void events_signal(uint32_t events)
+{
+  CM_ATOMIC_CONTEXT();
+  g_events |= events;
+}
+
+uint32_t events_wait()
+{
+  /* Interrupts are disabled while checking the flags, so that an event
+   * cannot be signaled between the check and WFI. WFI still wakes up on
+   * the pending interrupt, which then runs when interrupts are enabled. */
+  cm_disable_interrupts();
+  
+  while (!g_events)
+  {
+    __asm__ volatile ("wfi");
+    cm_enable_interrupts();
+    cm_disable_interrupts();
+  }
+  
+  uint32_t events = g_events;
+  g_events = 0;
+  cm_enable_interrupts();
+  return events;
+}
@@ -0,0 +1,27 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+/* Event flags that wake up the main loop. Interrupt handlers and other
+ * code signal events, and the main loop sleeps in events_wait() until
+ * there is something to do. */
+
+#include <stdint.h>
+
+#define EVENT_USBNET_RX (1 << 0) /* Received frames are queued */
+#define EVENT_USBNET_TX (1 << 1) /* A transmitted frame completed */
+#define EVENT_TIMER     (1 << 2) /* Periodic tick for timeouts */
+#define EVENT_TCPIP     (1 << 3) /* tcpip has more work to do */
+
+/* Rate of EVENT_TIMER */
+#define EVENTS_TICK_HZ 100
+
+/* Set event flags.
+ * Safe to call from IRQs.
+ */
+void events_signal(uint32_t events);
+
+/* Sleep until atleast one event has been signaled, then return and clear
+ * the pending events. */
+uint32_t events_wait();
+
+#endif
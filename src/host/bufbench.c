@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "buffer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_CYCLES 1
+#endif
+
+/* Measures the cost of buffer_allocate() and buffer_release() on the host,
+ * as the number of buffers in the allocator grows:
+ *
+ * daq4-bufbench [-n pairs]
+ *
+ * The buffers are split evenly over BUFFER_MAX_POOLS pools of growing
+ * size, and the largest size is requested so that every pool is looked at.
+ * Each pool size is measured twice: with all other buffers free, and with
+ * all but one buffer of the largest pool held. The allocator has no reset,
+ * so every pool size is set up in a child process of its own.
+ */
+
+#define BENCH_BUFFER_SIZE 768
+
+/* buffer.c reads the microsecond counter for hold time statistics */
+uint32_t host_systime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static uint64_t get_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t get_cycles()
+{
+#ifdef BENCH_HAVE_CYCLES
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-n pairs]\n", name);
+  exit(1);
+}
+
+/* Time pairs allocations and releases of the largest buffer size */
+static void bench_pairs(unsigned pairs, double *cycles, double *ns)
+{
+  uint64_t start_cycles = get_cycles();
+  uint64_t start_ns = get_ns();
+  
+  for (unsigned i = 0; i < pairs; i++)
+  {
+    buffer_t *buf = buffer_allocate(BENCH_BUFFER_SIZE, BUFFER_SITE_TCPIP_TX);
+    if (!buf)
+    {
+      fprintf(stderr, "Allocation failed\n");
+      exit(1);
+    }
+    buffer_release(buf);
+  }
+  
+  *cycles = (get_cycles() - start_cycles) / (double)pairs;
+  *ns = (get_ns() - start_ns) / (double)pairs;
+}
+
+static void bench_count(unsigned count, unsigned pairs)
+{
+  static uint8_t storage[BUFFER_MAX_COUNT * (sizeof(buffer_t) + BENCH_BUFFER_SIZE)];
+  uint8_t *p = storage;
+  unsigned pools = (count < BUFFER_MAX_POOLS) ? count : BUFFER_MAX_POOLS;
+  unsigned largest = 0;
+  
+  for (unsigned i = 0; i < pools; i++)
+  {
+    size_t size = BENCH_BUFFER_SIZE >> (pools - 1 - i);
+    size_t n = count / pools + (i < count % pools);
+    buffer_add_pool(p, size, n);
+    p += n * (sizeof(buffer_t) + size);
+    largest = n;
+  }
+  
+  double free_cycles, free_ns;
+  bench_pairs(pairs, &free_cycles, &free_ns);
+  
+  /* Hold everything except one buffer of the largest pool */
+  for (unsigned i = 1; i < count; i++)
+  {
+    size_t size = (i < largest) ? BENCH_BUFFER_SIZE : 1;
+    if (!buffer_allocate(size, BUFFER_SITE_TCPIP_CTRL))
+    {
+      fprintf(stderr, "Allocation failed\n");
+      exit(1);
+    }
+  }
+  
+  double held_cycles, held_ns;
+  bench_pairs(pairs, &held_cycles, &held_ns);
+  
+  printf("%7u %12.1f %12.1f %12.1f %12.1f\n", count,
+         free_cycles, free_ns, held_cycles, held_ns);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned pairs = 1000000;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': pairs = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  
+  if (pairs == 0)
+  {
+    usage(argv[0]);
+  }
+  
+#ifndef BENCH_HAVE_CYCLES
+  printf("No cycle counter on this platform, cycles are shown as 0\n");
+#endif
+  printf("Cost of one buffer_allocate() and buffer_release() pair\n");
+  printf("%7s %12s %12s %12s %12s\n", "buffers",
+         "free cycles", "free ns", "held cycles", "held ns");
+  fflush(stdout);
+  
+  for (unsigned count = 1; count <= BUFFER_MAX_COUNT; count *= 2)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      bench_count(count, pairs);
+      exit(0);
+    }
+    
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || status != 0)
+    {
+      return 1;
+    }
+  }
+  
+  return 0;
+}
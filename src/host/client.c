@@ -0,0 +1,243 @@
+#include "client.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Addresses of daq4-host, as set by vlink_init(), and of this client */
+static const uint8_t g_device_mac[6] = {0xDE, 0xD4, 0x00, 0x00, 0x01, 0xCC};
+static const uint8_t g_device_ip[16] = {0xFD, 0xDE, 0xD4, 0x00, 0x00, 0x01, [15] = 0x01};
+static const uint8_t g_client_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint8_t g_client_ip[16] = {0xFD, 0xDE, 0xD4, 0x00, 0x00, 0x01, [15] = 0x02};
+
+static int g_client_socket = -1;
+static struct sockaddr_un g_client_server = {.sun_family = AF_UNIX};
+static struct sockaddr_un g_client_addr = {.sun_family = AF_UNIX};
+static uint8_t g_client_frame[CLIENT_MAX_FRAME];
+
+static uint16_t get16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+  return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+bool client_open(const char *socket_path)
+{
+  if (strlen(socket_path) >= sizeof(g_client_server.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return false;
+  }
+  
+  strcpy(g_client_server.sun_path, socket_path);
+  snprintf(g_client_addr.sun_path, sizeof(g_client_addr.sun_path),
+           "/tmp/daq4-client-%d.sock", (int)getpid());
+  
+  g_client_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (g_client_socket < 0 ||
+      bind(g_client_socket, (struct sockaddr*)&g_client_addr, sizeof(g_client_addr)) != 0)
+  {
+    fprintf(stderr, "Cannot bind socket %s\n", g_client_addr.sun_path);
+    return false;
+  }
+  
+  return true;
+}
+
+void client_close()
+{
+  if (g_client_socket >= 0)
+  {
+    close(g_client_socket);
+    unlink(g_client_addr.sun_path);
+    g_client_socket = -1;
+  }
+}
+
+uint64_t client_time_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void client_send_at(const client_conn_t *conn, uint32_t sequence, uint8_t flags,
+                    const void *data, size_t len)
+{
+  uint8_t frame[CLIENT_MAX_FRAME] = {};
+  uint8_t *ip = &frame[14];
+  uint8_t *tcp = &frame[54];
+  
+  if (len > CLIENT_MSS)
+  {
+    len = CLIENT_MSS;
+  }
+  
+  memcpy(&frame[0], g_device_mac, 6);
+  memcpy(&frame[6], g_client_mac, 6);
+  put16(&frame[12], 0x86DD);
+  
+  ip[0] = 0x60;
+  put16(&ip[4], 20 + len);
+  ip[6] = 6;
+  ip[7] = 64;
+  memcpy(&ip[8], g_client_ip, 16);
+  memcpy(&ip[24], g_device_ip, 16);
+  
+  put16(&tcp[0], conn->port);
+  put16(&tcp[2], conn->remote_port);
+  put32(&tcp[4], sequence);
+  put32(&tcp[8], (flags & CLIENT_ACK) ? conn->rx_sequence : 0);
+  tcp[12] = 5 << 4;
+  tcp[13] = flags;
+  put16(&tcp[14], conn->rx_window ? conn->rx_window : 65535);
+  if (len)
+  {
+    memcpy(&tcp[20], data, len);
+  }
+  
+  /* Pseudo header of RFC 8200 section 8.1, and the segment */
+  uint32_t sum = 20 + len + 6;
+  for (int i = 8; i < 40; i += 2)
+  {
+    sum += get16(&ip[i]);
+  }
+  
+  for (size_t i = 0; i < 20 + len; i += 2)
+  {
+    sum += (tcp[i] << 8) | tcp[i + 1];
+  }
+  
+  while (sum >> 16)
+  {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  
+  put16(&tcp[16], ~sum);
+  sendto(g_client_socket, frame, CLIENT_HEADER_SIZE + len, 0,
+         (struct sockaddr*)&g_client_server, sizeof(g_client_server));
+}
+
+bool client_receive(client_segment_t *seg, int timeout_ms)
+{
+  uint8_t *frame = g_client_frame;
+  uint64_t deadline = client_time_us() + timeout_ms * 1000ULL;
+  struct pollfd pfd = {.fd = g_client_socket, .events = POLLIN};
+  
+  for (;;)
+  {
+    uint64_t now = client_time_us();
+    int wait_ms = (now < deadline) ? (int)((deadline - now + 999) / 1000) : 0;
+    if (poll(&pfd, 1, wait_ms) <= 0)
+    {
+      return false;
+    }
+    
+    ssize_t len = recv(g_client_socket, frame, CLIENT_MAX_FRAME, 0);
+    if (len < CLIENT_HEADER_SIZE || get16(&frame[12]) != 0x86DD || frame[20] != 6)
+    {
+      continue;
+    }
+    
+    size_t header_len = 54 + (frame[66] >> 4) * 4;
+    size_t frame_len = 54 + get16(&frame[18]);
+    if (header_len > frame_len || frame_len > (size_t)len)
+    {
+      continue;
+    }
+    
+    seg->port = get16(&frame[56]);
+    seg->sequence = get32(&frame[58]);
+    seg->ack = get32(&frame[62]);
+    seg->flags = frame[67];
+    seg->window = get16(&frame[68]);
+    seg->data = &frame[header_len];
+    seg->length = frame_len - header_len;
+    return true;
+  }
+}
+
+/* Find the MSS option of a SYN-ACK, RFC 9293 section 3.7.1 */
+static uint16_t client_parse_mss()
+{
+  const uint8_t *p = &g_client_frame[74];
+  const uint8_t *end = &g_client_frame[54 + (g_client_frame[66] >> 4) * 4];
+  
+  while (p < end && *p != 0)
+  {
+    if (*p == 1)
+    {
+      p++;
+    }
+    else if (p + 1 >= end || p[1] < 2 || p + p[1] > end)
+    {
+      break;
+    }
+    else if (p[0] == 2 && p[1] == 4)
+    {
+      return get16(&p[2]);
+    }
+    else
+    {
+      p += p[1];
+    }
+  }
+  
+  return 536;
+}
+
+bool client_connect(client_conn_t *conn, uint16_t remote_port)
+{
+  conn->remote_port = remote_port;
+  
+  for (int attempt = 0; attempt < 5; attempt++)
+  {
+    client_send(conn, CLIENT_SYN, NULL, 0);
+    
+    client_segment_t seg;
+    uint64_t deadline = client_time_us() + 1000000;
+    while (client_time_us() < deadline && client_receive(&seg, 200))
+    {
+      if (seg.port != conn->port)
+      {
+        continue;
+      }
+      
+      if ((seg.flags & (CLIENT_SYN | CLIENT_ACK)) != (CLIENT_SYN | CLIENT_ACK) ||
+          seg.ack != conn->tx_sequence + 1)
+      {
+        fprintf(stderr, "Connection to port %d refused\n", remote_port);
+        return false;
+      }
+      
+      conn->tx_sequence++;
+      conn->rx_sequence = seg.sequence + 1;
+      conn->window = seg.window;
+      conn->mss = client_parse_mss();
+      client_send(conn, CLIENT_ACK, NULL, 0);
+      return true;
+    }
+  }
+  
+  fprintf(stderr, "No SYN-ACK from port %d\n", remote_port);
+  return false;
+}
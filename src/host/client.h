@@ -0,0 +1,72 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+/* Minimal TCP client for the host benchmarks. It exchanges raw Ethernet
+ * frames with daq4-host over its UNIX datagram socket, so the benchmarks
+ * control exactly which segments are sent, and when.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define CLIENT_MAX_FRAME 1514
+#define CLIENT_HEADER_SIZE (14 + 40 + 20)
+#define CLIENT_MSS (CLIENT_MAX_FRAME - CLIENT_HEADER_SIZE)
+
+#define CLIENT_FIN 0x01
+#define CLIENT_SYN 0x02
+#define CLIENT_RST 0x04
+#define CLIENT_PSH 0x08
+#define CLIENT_ACK 0x10
+
+typedef struct {
+  uint16_t port;        /* Local port, set by the caller */
+  uint16_t remote_port;
+  uint32_t tx_sequence; /* Next sequence number to send */
+  uint32_t rx_sequence; /* Next sequence number expected */
+  uint16_t window;      /* Latest window of the device */
+  uint16_t mss;         /* From the MSS option of the SYN-ACK */
+  uint16_t rx_window;   /* Window to advertise, or 0 for 65535 */
+} client_conn_t;
+
+/* A received segment. The data stays valid until the next
+ * client_receive(). */
+typedef struct {
+  uint16_t port;        /* Destination, the local port */
+  uint8_t flags;
+  uint32_t sequence;
+  uint32_t ack;
+  uint16_t window;
+  const uint8_t *data;
+  size_t length;
+} client_segment_t;
+
+/* Bind a socket of our own and send to daq4-host at socket_path */
+bool client_open(const char *socket_path);
+
+void client_close();
+
+/* Monotonic time in microseconds */
+uint64_t client_time_us();
+
+/* Send a segment with the given sequence number and flags, acknowledging
+ * conn->rx_sequence. */
+void client_send_at(const client_conn_t *conn, uint32_t sequence, uint8_t flags,
+                    const void *data, size_t len);
+
+static inline void client_send(const client_conn_t *conn, uint8_t flags,
+                               const void *data, size_t len)
+{
+  client_send_at(conn, conn->tx_sequence, flags, data, len);
+}
+
+/* Wait for a TCP segment to any local port. Returns false if none
+ * arrived within the timeout. */
+bool client_receive(client_segment_t *seg, int timeout_ms);
+
+/* Open a connection from conn->port to remote_port. Segments to other
+ * ports that arrive meanwhile are discarded. */
+bool client_connect(client_conn_t *conn, uint16_t remote_port);
+
+#endif
@@ -0,0 +1,67 @@
+#include "echo.h"
+#include <string.h>
+
+static const uint8_t g_device_mac[6] = {0xDE, 0xD4, 0x00, 0x00, 0x01, 0xCC};
+static const uint8_t g_device_ip[16] = {0xFD, 0xDE, 0xD4, 0x00, 0x00, 0x01, [15] = 0x01};
+static const uint8_t g_pc_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint8_t g_pc_ip[16] = {0xFD, 0xDE, 0xD4, 0x00, 0x00, 0x01, [15] = 0x02};
+
+static void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+size_t echo_frame(uint8_t *frame, size_t payload_len, bool reply, uint16_t sequence)
+{
+  uint8_t *ip = &frame[14];
+  uint8_t *icmp = &frame[54];
+  size_t icmp_len = 8 + payload_len;
+  
+  memcpy(&frame[0], reply ? g_pc_mac : g_device_mac, 6);
+  memcpy(&frame[6], reply ? g_device_mac : g_pc_mac, 6);
+  put16(&frame[12], 0x86DD);
+  
+  memset(ip, 0, 40);
+  ip[0] = 0x60;
+  put16(&ip[4], icmp_len);
+  ip[6] = 58;
+  ip[7] = 64;
+  memcpy(&ip[8], reply ? g_device_ip : g_pc_ip, 16);
+  memcpy(&ip[24], reply ? g_pc_ip : g_device_ip, 16);
+  
+  memset(icmp, 0, icmp_len);
+  icmp[0] = reply ? 129 : 128;
+  put16(&icmp[4], 0xD4);
+  put16(&icmp[6], sequence);
+  for (size_t i = 0; i < payload_len; i++)
+  {
+    icmp[8 + i] = i;
+  }
+  
+  /* Pseudo header of RFC 8200 section 8.1, and the message */
+  uint32_t sum = icmp_len + 58;
+  for (int i = 8; i < 40; i += 2)
+  {
+    sum += (ip[i] << 8) | ip[i + 1];
+  }
+  
+  for (size_t i = 0; i < icmp_len; i += 2)
+  {
+    sum += (icmp[i] << 8) | ((i + 1 < icmp_len) ? icmp[i + 1] : 0);
+  }
+  
+  while (sum >> 16)
+  {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  
+  put16(&icmp[2], ~sum);
+  return 54 + icmp_len;
+}
+
+bool echo_is_reply(const uint8_t *frame, size_t len)
+{
+  return len >= 62 && frame[12] == 0x86 && frame[13] == 0xDD && frame[20] == 58 &&
+         frame[54] == 129;
+}
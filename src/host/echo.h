@@ -0,0 +1,22 @@
+#ifndef HOST_ECHO_H
+#define HOST_ECHO_H
+
+/* ICMPv6 echo frames between the PC and the device of usbnet_init(&driver,
+ * 0xD4000001), for the programs that drive the simulated USB device */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Offset of the sequence number in an echo frame */
+#define ECHO_SEQUENCE_OFFSET 60
+
+/* Write an Ethernet frame with an echo request from the PC, or the reply
+ * of the device to it, and payload_len bytes of data. Returns its length.
+ */
+size_t echo_frame(uint8_t *frame, size_t payload_len, bool reply, uint16_t sequence);
+
+/* True for an Ethernet frame with an echo reply */
+bool echo_is_reply(const uint8_t *frame, size_t len);
+
+#endif
@@ -0,0 +1,54 @@
+#include "events.h"
+#include "systime.h"
+#include "hostlink.h"
+#include <poll.h>
+#include <libopencm3/stm32/memorymap.h>
+#include <time.h>
+
+/* Host version of the event loop. The link is serviced here, in place of
+ * the USB interrupt, and the sleep in WFI becomes a poll() on the
+ * link socket that also ends at the next timer tick. */
+
+static uint32_t g_events;
+static systime_t g_next_tick;
+
+const uint8_t g_host_flash[32768];
+
+uint32_t host_systime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * SYSTIME_FREQ + ts.tv_nsec / 1000);
+}
+
+void events_signal(uint32_t events)
+{
+  g_events |= events;
+}
+
+uint32_t events_wait()
+{
+  while (!g_events)
+  {
+    int fd = hostlink_service();
+    if (g_events)
+      break;
+    
+    systime_t now = get_systime();
+    int32_t until_tick = g_next_tick - now;
+    if (until_tick <= 0 || until_tick > SYSTIME_FREQ / EVENTS_TICK_HZ)
+    {
+      /* Tick is due, or not yet set up */
+      g_next_tick = now + SYSTIME_FREQ / EVENTS_TICK_HZ;
+      events_signal(EVENT_TIMER);
+      break;
+    }
+    
+    struct pollfd pfd = {fd, POLLIN, 0};
+    poll(&pfd, (fd >= 0) ? 1 : 0, until_tick / 1000 + 1);
+  }
+  
+  uint32_t events = g_events;
+  g_events = 0;
+  return events;
+}
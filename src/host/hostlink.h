@@ -0,0 +1,11 @@
+#ifndef HOSTLINK_H
+#define HOSTLINK_H
+
+/* Simulated interrupt of the link that a host program runs the stack on,
+ * defined by the program: vlink_service() in daq4-host and the simulated
+ * USB device in daq4-usbhost. Called from events_wait().
+ * Returns a file descriptor that becomes readable on new input, or -1.
+ */
+int hostlink_service();
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "client.h"
+
+/* Counts the frames the stack sends per HTTP response, against daq4-host
+ * running with a socket:
+ *
+ * daq4-host -s /tmp/daq4.sock &
+ * daq4-httpbench -s /tmp/daq4.sock [-u url] [-n requests]
+ *
+ * Each request is made on a new connection, which is reset once no frame
+ * has arrived for BENCH_IDLE_TIMEOUT. The client acknowledges every data
+ * segment at once, so pure ACKs from the stack are the ones it sends for
+ * the request and for window updates.
+ */
+
+#define BENCH_IDLE_TIMEOUT 100 /* Milliseconds */
+
+typedef struct {
+  unsigned responses;
+  unsigned frames;
+  unsigned data_frames;
+  unsigned pure_acks;
+  unsigned long bytes;
+} bench_stats_t;
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s -s socket_path [-u url] [-n requests]\n", name);
+  exit(1);
+}
+
+/* Make one request and count the frames of its response */
+static bool bench_request(uint16_t port, const char *url, bench_stats_t *stats)
+{
+  client_conn_t conn = {.port = port, .tx_sequence = 1000};
+  client_segment_t seg;
+  
+  if (!client_connect(&conn, 80))
+  {
+    return false;
+  }
+  
+  char request[256];
+  int request_len = snprintf(request, sizeof(request),
+                             "GET %s HTTP/1.1\r\nHost: daq4\r\n\r\n", url);
+  client_send(&conn, CLIENT_PSH | CLIENT_ACK, request, request_len);
+  conn.tx_sequence += request_len;
+  
+  while (client_receive(&seg, BENCH_IDLE_TIMEOUT))
+  {
+    if (seg.port != conn.port)
+    {
+      continue;
+    }
+    
+    stats->frames++;
+    if (seg.length)
+    {
+      stats->data_frames++;
+    }
+    else if (seg.flags == CLIENT_ACK)
+    {
+      stats->pure_acks++;
+    }
+    
+    if (seg.length && seg.sequence == conn.rx_sequence)
+    {
+      conn.rx_sequence += seg.length;
+      stats->bytes += seg.length;
+      client_send(&conn, CLIENT_ACK, NULL, 0);
+    }
+    
+    if (seg.flags & (CLIENT_FIN | CLIENT_RST))
+    {
+      break;
+    }
+  }
+  
+  client_send(&conn, CLIENT_RST, NULL, 0);
+  stats->responses++;
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *socket_path = NULL;
+  const char *url = "/";
+  unsigned count = 10;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "s:u:n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 's': socket_path = optarg; break;
+      case 'u': url = optarg; break;
+      case 'n': count = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  
+  if (!socket_path || strlen(url) > 200 || !client_open(socket_path))
+  {
+    usage(argv[0]);
+  }
+  
+  bench_stats_t stats = {};
+  bool ok = true;
+  for (unsigned i = 0; i < count && ok; i++)
+  {
+    ok = bench_request(40000 + i, url, &stats);
+  }
+  
+  client_close();
+  
+  if (stats.responses)
+  {
+    printf("%s: %u responses, %.2f frames per response "
+           "(%.2f data, %.2f pure ACK), %.0f bytes per response\n",
+           url, stats.responses, stats.frames / (double)stats.responses,
+           stats.data_frames / (double)stats.responses,
+           stats.pure_acks / (double)stats.responses,
+           stats.bytes / (double)stats.responses);
+  }
+  
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+#ifndef HOST_CORTEX_H
+#define HOST_CORTEX_H
+
+/* The host build is single threaded and its simulated interrupts only run
+ * inside events_wait(), so atomic sections need no locking. */
+
+static inline void cm_disable_interrupts(void) {}
+static inline void cm_enable_interrupts(void) {}
+
+#define CM_ATOMIC_CONTEXT() do {} while (0)
+
+#endif
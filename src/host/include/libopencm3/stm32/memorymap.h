@@ -0,0 +1,10 @@
+#ifndef HOST_MEMORYMAP_H
+#define HOST_MEMORYMAP_H
+
+#include <stdint.h>
+
+/* The host has no flash, /api/firmware.bin serves this array instead */
+extern const uint8_t g_host_flash[32768];
+#define FLASH_BASE ((uintptr_t)g_host_flash)
+
+#endif
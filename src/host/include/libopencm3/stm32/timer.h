@@ -0,0 +1,10 @@
+#ifndef HOST_TIMER_H
+#define HOST_TIMER_H
+
+#include <stdint.h>
+
+/* systime.h reads the free-running microsecond counter from TIM2 */
+uint32_t host_systime();
+#define TIM2_CNT host_systime()
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef HOST_CDC_H
+#define HOST_CDC_H
+
+/* The CDC definitions of libopencm3 that the USB descriptors use */
+
+#include <stdint.h>
+
+#define CS_INTERFACE 0x24
+#define USB_CDC_TYPE_HEADER 0x00
+#define USB_CDC_TYPE_UNION 0x06
+#define USB_CDC_SUBCLASS_ACM 0x02
+
+struct usb_cdc_header_descriptor {
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  uint16_t bcdCDC;
+} __attribute__((packed));
+
+struct usb_cdc_union_descriptor {
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  uint8_t bControlInterface;
+  uint8_t bSubordinateInterface0;
+} __attribute__((packed));
+
+struct usb_cdc_notification {
+  uint8_t bmRequestType;
+  uint8_t bNotification;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} __attribute__((packed));
+
+#endif
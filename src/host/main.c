@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "vlink.h"
+#include "hostlink.h"
+#include "events.h"
+#include "tcpip.h"
+#include "tcpip_diagnostics.h"
+#include "http.h"
+#include "http_index.h"
+
+/* Runs the network stack on the host against the virtual link:
+ *
+ * daq4-host -r input.pcap [-w output.pcap]
+ *   Replays the frames of input.pcap and exits when they are processed.
+ *
+ * daq4-host -s /tmp/daq4.sock [-w output.pcap]
+ *   Serves a client that sends Ethernet frames as datagrams to the socket.
+ *
+ * Options:
+ *   -l percent  Drop this share of frames in each direction
+ *   -o percent  Deliver this share of received frames out of order
+ *   -t seconds  Exit after this time and print the statistics
+ *
+ * For example, goodput under loss is measured by "daq4-tcpbench -m goodput"
+ * against "-s path -l 2 -t 10", see src/host/tcpbench.c.
+ */
+
+int hostlink_service()
+{
+  return vlink_service();
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s (-r input.pcap | -s socket_path) [-w output.pcap] "
+                  "[-l loss_percent] [-o reorder_percent] [-t seconds]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *input = NULL;
+  const char *output = NULL;
+  const char *socket_path = NULL;
+  unsigned loss = 0;
+  unsigned reorder = 0;
+  unsigned seconds = 0;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "r:w:s:l:o:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r': input = optarg; break;
+      case 'w': output = optarg; break;
+      case 's': socket_path = optarg; break;
+      case 'l': loss = atoi(optarg); break;
+      case 'o': reorder = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  
+  if (!input == !socket_path)
+  {
+    usage(argv[0]);
+  }
+  
+  vlink_init(0xD4000001);
+  vlink_set_loss(loss);
+  vlink_set_reorder(reorder);
+  
+  if ((input && !vlink_open_pcap_input(input)) ||
+      (socket_path && !vlink_open_socket(socket_path)) ||
+      (output && !vlink_open_pcap_output(output)))
+  {
+    return 1;
+  }
+  
+  tcpip_init();
+  http_init();
+  
+  http_index_init();
+  tcpip_diagnostics_init();
+  
+  systime_t start = get_systime();
+  
+  while (socket_path || !vlink_is_idle())
+  {
+    if (seconds && get_systime() - start >= seconds * SYSTIME_FREQ)
+    {
+      break;
+    }
+    
+    events_wait();
+    tcpip_poll();
+    usbnet_poll();
+  }
+  
+  systime_t elapsed = get_systime() - start;
+  vlink_stats_t stats;
+  vlink_get_stats(&stats);
+  
+  printf("rx %u frames %llu bytes, tx %u frames %llu bytes, %u us\n",
+         (unsigned)stats.rx_frames, (unsigned long long)stats.rx_bytes,
+         (unsigned)stats.tx_frames, (unsigned long long)stats.tx_bytes,
+         (unsigned)elapsed);
+  
+  if (loss)
+  {
+    printf("dropped rx %u frames, tx %u frames\n",
+           (unsigned)stats.rx_dropped, (unsigned)stats.tx_dropped);
+  }
+  
+  if (reorder)
+  {
+    printf("reordered rx %u frames\n", (unsigned)stats.rx_reordered);
+  }
+  
+  if (elapsed > 0)
+  {
+    printf("%.0f frames/s\n", stats.rx_frames * (double)SYSTIME_FREQ / elapsed);
+  }
+  
+  return 0;
+}
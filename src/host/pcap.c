@@ -0,0 +1,116 @@
+#include "pcap.h"
+#include <sys/time.h>
+#include "debug.h"
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_SNAPLEN 65535
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} pcap_header_t;
+
+typedef struct {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} pcap_record_t;
+
+static uint32_t swap32(uint32_t x)
+{
+  return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+bool pcap_open_read(pcap_file_t *pcap, const char *path, uint32_t linktype)
+{
+  pcap_header_t hdr;
+  pcap->file = fopen(path, "rb");
+  if (!pcap->file)
+  {
+    warn("Cannot open %s", path);
+    return false;
+  }
+  
+  if (fread(&hdr, sizeof(hdr), 1, pcap->file) != 1 ||
+      (hdr.magic != PCAP_MAGIC && hdr.magic != swap32(PCAP_MAGIC)))
+  {
+    warn("%s is not a pcap file", path);
+    pcap_close(pcap);
+    return false;
+  }
+  
+  pcap->swapped = (hdr.magic != PCAP_MAGIC);
+  uint32_t file_linktype = pcap->swapped ? swap32(hdr.linktype) : hdr.linktype;
+  if (file_linktype != linktype)
+  {
+    warn("%s has link type %u, expected %u", path, (unsigned)file_linktype, (unsigned)linktype);
+    pcap_close(pcap);
+    return false;
+  }
+  
+  return true;
+}
+
+bool pcap_open_write(pcap_file_t *pcap, const char *path, uint32_t linktype)
+{
+  pcap_header_t hdr = {PCAP_MAGIC, 2, 4, 0, 0, PCAP_SNAPLEN, linktype};
+  pcap->swapped = false;
+  pcap->file = fopen(path, "wb");
+  if (!pcap->file)
+  {
+    warn("Cannot create %s", path);
+    return false;
+  }
+  
+  fwrite(&hdr, sizeof(hdr), 1, pcap->file);
+  return true;
+}
+
+size_t pcap_read(pcap_file_t *pcap, uint8_t *buf, size_t max_len)
+{
+  pcap_record_t rec;
+  
+  while (pcap->file && fread(&rec, sizeof(rec), 1, pcap->file) == 1)
+  {
+    size_t len = pcap->swapped ? swap32(rec.incl_len) : rec.incl_len;
+    size_t keep = (len < max_len) ? len : max_len;
+    
+    if (fread(buf, 1, keep, pcap->file) != keep ||
+        fseek(pcap->file, len - keep, SEEK_CUR) != 0)
+    {
+      break;
+    }
+    
+    if (keep > 0)
+    {
+      return keep;
+    }
+  }
+  
+  return 0;
+}
+
+void pcap_write(pcap_file_t *pcap, const uint8_t *data, size_t len)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  
+  pcap_record_t rec = {tv.tv_sec, tv.tv_usec, len, len};
+  fwrite(&rec, sizeof(rec), 1, pcap->file);
+  fwrite(data, 1, len, pcap->file);
+}
+
+void pcap_close(pcap_file_t *pcap)
+{
+  if (pcap->file)
+  {
+    fclose(pcap->file);
+    pcap->file = NULL;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef HOST_PCAP_H
+#define HOST_PCAP_H
+
+/* Minimal reader and writer for classic pcap files */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED 220 /* Linux usbmon, 64-byte header */
+
+typedef struct {
+  FILE *file;
+  bool swapped; /* File was written with the other byte order */
+} pcap_file_t;
+
+/* Open a file for reading, which must have the given link type */
+bool pcap_open_read(pcap_file_t *pcap, const char *path, uint32_t linktype);
+bool pcap_open_write(pcap_file_t *pcap, const char *path, uint32_t linktype);
+
+/* Read the next record to buf, truncated to max_len.
+ * Returns the length, or 0 at the end of the file.
+ */
+size_t pcap_read(pcap_file_t *pcap, uint8_t *buf, size_t max_len);
+
+/* Append a record with the current time as the timestamp */
+void pcap_write(pcap_file_t *pcap, const uint8_t *data, size_t len);
+
+void pcap_close(pcap_file_t *pcap);
+
+#endif
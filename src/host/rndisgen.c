@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stddef.h>
+#include "usbmon.h"
+#include "pcap.h"
+#include "usbnet.h"
+#include "usbnet_descriptors.h"
+#include "rndis_std.h"
+#include "cdcecm_std.h"
+#include "echo.h"
+
+/* Writes a usbmon capture for daq4-usbhost that brings up RNDIS, sends
+ * commands that are too short for their fields, and then sends ping
+ * requests in aggregated and malformed packet messages:
+ *
+ * daq4-rndisgen [-n] output.pcap
+ *
+ * Each data transfer has one of the cases below followed by valid
+ * messages. The transmit count queried at the end must equal the number
+ * of valid messages before the first one that ends the transfer. The
+ * completions of control requests in the capture are the expected
+ * responses, which daq4-usbhost compares with the replies.
+ *
+ * With -n the capture brings up CDC NCM instead and sends the pings in
+ * NTBs with different layouts. Each NTB is followed by the completions of
+ * NTBs with the expected replies, and daq4-usbhost checks that as many
+ * replies arrive.
+ */
+
+#define GEN_PAYLOAD 16
+#define GEN_CONTROL_BUFFER 1025
+
+static pcap_file_t g_gen_pcap;
+static uint64_t g_gen_next_id = 1;
+static uint32_t g_gen_request_id = 1;
+static uint16_t g_gen_ping_sequence = 1;
+static uint16_t g_gen_ntb_sequence;
+
+static void gen_record(uint64_t id, uint8_t type, uint8_t xfer_type, uint8_t ep,
+                       const struct usb_setup_data *setup, const void *data, size_t len,
+                       uint32_t xfer_flags)
+{
+  static uint8_t record[sizeof(usbmon_header_t) + 65536];
+  usbmon_header_t hdr = {
+    .id = id, .type = type, .xfer_type = xfer_type, .epnum = ep, .devnum = 1, .busnum = 1,
+    .flag_setup = setup ? 0 : '-', .flag_data = len ? 0 : '<',
+    .length = len, .len_cap = len, .xfer_flags = xfer_flags,
+  };
+  
+  if (setup)
+  {
+    memcpy(hdr.setup, setup, sizeof(hdr.setup));
+    hdr.length = setup->wLength;
+  }
+  
+  memcpy(record, &hdr, sizeof(hdr));
+  if (len)
+  {
+    memcpy(record + sizeof(hdr), data, len);
+  }
+  
+  pcap_write(&g_gen_pcap, record, sizeof(hdr) + len);
+}
+
+static void gen_control_out(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                            const void *data, uint16_t len)
+{
+  struct usb_setup_data setup = {type, request, value, index, len};
+  uint64_t id = g_gen_next_id++;
+  gen_record(id, 'S', USBMON_XFER_CONTROL, 0x00, &setup, data, len, 0);
+  gen_record(id, 'C', USBMON_XFER_CONTROL, 0x00, NULL, NULL, 0, 0);
+}
+
+/* Request with a data stage from the device, and its expected reply */
+static void gen_control_in(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                           uint16_t len, const void *expected, uint16_t expected_len)
+{
+  struct usb_setup_data setup = {type, request, value, index, len};
+  uint64_t id = g_gen_next_id++;
+  gen_record(id, 'S', USBMON_XFER_CONTROL, 0x80, &setup, NULL, 0, 0);
+  gen_record(id, 'C', USBMON_XFER_CONTROL, 0x80, NULL, expected, expected_len, 0);
+}
+
+static void gen_rndis_command(const void *msg, size_t len, const void *response,
+                              size_t response_len)
+{
+  gen_control_out(0x21, RNDIS_SEND_ENCAPSULATED_COMMAND, 0, RNDIS_INTERFACE, msg, len);
+  gen_control_in(0xA1, RNDIS_GET_ENCAPSULATED_RESPONSE, 0, RNDIS_INTERFACE,
+                 GEN_CONTROL_BUFFER, response, response_len);
+}
+
+static void gen_bulk_out(uint8_t ep, const void *data, size_t len)
+{
+  uint64_t id = g_gen_next_id++;
+  gen_record(id, 'S', USBMON_XFER_BULK, ep, NULL, data, len, USBMON_URB_ZERO_PACKET);
+  gen_record(id, 'C', USBMON_XFER_BULK, ep, NULL, NULL, 0, 0);
+}
+
+/* Completion of a bulk IN transfer that the device should send */
+static void gen_bulk_in(uint8_t ep, const void *data, size_t len)
+{
+  uint64_t id = g_gen_next_id++;
+  gen_record(id, 'S', USBMON_XFER_BULK, ep, NULL, NULL, 0, 0);
+  gen_record(id, 'C', USBMON_XFER_BULK, ep, NULL, data, len, 0);
+}
+
+/*******************
+ * Frame building *
+ *******************/
+
+/* Ethernet frame with the next ping request, returns its length */
+static size_t gen_ping(uint8_t *frame, size_t payload_len)
+{
+  return echo_frame(frame, payload_len, false, g_gen_ping_sequence++);
+}
+
+/* Packet message with a ping, returns its length */
+static size_t gen_packet_msg(uint8_t *buf, size_t payload_len)
+{
+  struct rndis_packet_msg *hdr = (void*)buf;
+  size_t frame_len = gen_ping(buf + sizeof(*hdr), payload_len);
+  
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->MessageType = RNDIS_MSG_PACKET;
+  hdr->MessageLength = sizeof(*hdr) + frame_len;
+  hdr->DataOffset = sizeof(*hdr) - 8;
+  hdr->DataLength = frame_len;
+  return hdr->MessageLength;
+}
+
+/* NTB with count pings, or with the replies to them. The NDP comes
+ * right after the NTH if ndp_first, otherwise the first datagram does and
+ * the NDP is at the end. Returns its length. */
+static size_t gen_ntb(uint8_t *buf, int count, bool ndp_first, bool reply, uint16_t sequence)
+{
+  struct usb_cdc_ncm_nth16 *nth = (void*)buf;
+  struct usb_cdc_ncm_ndp16_pointer pointers[USBNET_MAX_TRANSFER_FRAMES + 1] = {};
+  size_t ndp_len = sizeof(struct usb_cdc_ncm_ndp16_header) +
+                   (count + 1) * sizeof(struct usb_cdc_ncm_ndp16_pointer);
+  size_t pos = sizeof(*nth);
+  size_t ndp_pos = pos;
+  
+  if (ndp_first)
+  {
+    pos += ndp_len;
+  }
+  
+  for (int i = 0; i < count; i++)
+  {
+    pos = (pos + 3) & ~3;
+    pointers[i].wDatagramIndex = pos;
+    pointers[i].wDatagramLength = echo_frame(buf + pos, GEN_PAYLOAD, reply, sequence + i);
+    pos += pointers[i].wDatagramLength;
+  }
+  
+  if (!ndp_first)
+  {
+    pos = (pos + 3) & ~3;
+    ndp_pos = pos;
+    pos += ndp_len;
+  }
+  
+  struct usb_cdc_ncm_ndp16 *ndp = (void*)(buf + ndp_pos);
+  ndp->hdr = (struct usb_cdc_ncm_ndp16_header){USB_CDC_NCM_NDP16_SIGNATURE_NOCRC, ndp_len};
+  memcpy(ndp->datagrams, pointers, (count + 1) * sizeof(pointers[0]));
+  
+  *nth = (struct usb_cdc_ncm_nth16){
+    USB_CDC_NCM_NTH16_SIGNATURE, sizeof(*nth), g_gen_ntb_sequence++, pos, ndp_pos
+  };
+  return pos;
+}
+
+/***************
+ * Scenario *
+ ***************/
+
+static void gen_init()
+{
+  gen_control_out(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, NULL, 0);
+  
+  struct rndis_initialize_msg init = {
+    {RNDIS_MSG_INIT, sizeof(init), g_gen_request_id},
+    RNDIS_MAJOR_VERSION, RNDIS_MINOR_VERSION, 512
+  };
+  struct rndis_initialize_cmplt init_cmplt = {
+    {RNDIS_MSG_INIT_C, sizeof(init_cmplt), g_gen_request_id++, RNDIS_STATUS_SUCCESS},
+    RNDIS_MAJOR_VERSION, RNDIS_MINOR_VERSION, RNDIS_DF_CONNECTIONLESS, RNDIS_MEDIUM_802_3,
+    USBNET_MAX_TRANSFER_FRAMES, USBNET_RX_TRANSFER_MAX, 2
+  };
+  gen_rndis_command(&init, sizeof(init), &init_cmplt, sizeof(init_cmplt));
+  
+  struct {
+    struct rndis_set_msg msg;
+    uint32_t filter;
+  } __attribute__((packed)) set = {
+    {{RNDIS_MSG_SET, sizeof(set), g_gen_request_id},
+     RNDIS_OID_GEN_CURRENT_PACKET_FILTER, 4, sizeof(struct rndis_set_msg) - 8},
+    0x0F
+  };
+  struct rndis_response_header set_cmplt = {
+    RNDIS_MSG_SET_C, sizeof(set_cmplt), g_gen_request_id++, RNDIS_STATUS_SUCCESS
+  };
+  gen_rndis_command(&set, sizeof(set), &set_cmplt, sizeof(set_cmplt));
+}
+
+/* Commands that end before their fields or information buffer, which
+ * are answered with an error status and change nothing */
+static void gen_invalid_commands()
+{
+  struct rndis_initialize_msg init = {
+    {RNDIS_MSG_INIT, sizeof(init), g_gen_request_id},
+    RNDIS_MAJOR_VERSION, RNDIS_MINOR_VERSION, 512
+  };
+  struct rndis_initialize_cmplt init_cmplt = {
+    {RNDIS_MSG_INIT_C, sizeof(init_cmplt), g_gen_request_id++, RNDIS_STATUS_INVALID_LENGTH}
+  };
+  gen_rndis_command(&init, sizeof(struct rndis_command_header), &init_cmplt, sizeof(init_cmplt));
+  
+  struct rndis_query_msg query = {
+    {RNDIS_MSG_QUERY, sizeof(query), g_gen_request_id},
+    RNDIS_OID_GEN_XMIT_OK, 0, 0
+  };
+  struct rndis_query_cmplt query_cmplt = {
+    {RNDIS_MSG_QUERY_C, sizeof(query_cmplt), g_gen_request_id++, RNDIS_STATUS_INVALID_LENGTH}
+  };
+  gen_rndis_command(&query, 16, &query_cmplt, sizeof(query_cmplt));
+  
+  /* Information buffer past the end of the message */
+  struct {
+    struct rndis_set_msg msg;
+    uint32_t filter;
+  } __attribute__((packed)) set = {
+    {{RNDIS_MSG_SET, sizeof(set), g_gen_request_id},
+     RNDIS_OID_GEN_CURRENT_PACKET_FILTER, 64, sizeof(struct rndis_set_msg) - 8},
+    0
+  };
+  struct rndis_response_header set_cmplt = {
+    RNDIS_MSG_SET_C, sizeof(set_cmplt), g_gen_request_id++, RNDIS_STATUS_INVALID_DATA
+  };
+  gen_rndis_command(&set, sizeof(set), &set_cmplt, sizeof(set_cmplt));
+  
+  /* Packet filter shorter than its 4 bytes */
+  set.msg.hdr.RequestID = set_cmplt.RequestID = g_gen_request_id++;
+  set.msg.InformationBufferLength = 2;
+  set_cmplt.Status = RNDIS_STATUS_INVALID_LENGTH;
+  gen_rndis_command(&set, sizeof(set) - 2, &set_cmplt, sizeof(set_cmplt));
+}
+
+/* Data transfers, returns the number of pings that should be received */
+static uint32_t gen_transfers()
+{
+  uint8_t buf[USBNET_RX_TRANSFER_MAX];
+  struct rndis_packet_msg *hdr = (void*)buf;
+  uint32_t expected = 0;
+  size_t len;
+  
+  /* Three aggregated messages */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  len += gen_packet_msg(buf + len, GEN_PAYLOAD);
+  len += gen_packet_msg(buf + len, GEN_PAYLOAD);
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  expected += 3;
+  
+  /* MessageLength that wraps pos + MessageLength around on 32 bits */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  len += gen_packet_msg(buf + len, GEN_PAYLOAD);
+  ((struct rndis_packet_msg*)(buf + len / 2))->MessageLength = 0xFFFFFFF8;
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  expected += 1;
+  
+  /* Valid message after the bad transfer */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  expected += 1;
+  
+  /* DataOffset beyond the message skips it, the next is still parsed */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  hdr->DataOffset = 0xFFFFFFF0;
+  len += gen_packet_msg(buf + len, GEN_PAYLOAD);
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  expected += 1;
+  
+  /* DataLength beyond the message */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  hdr->DataLength = 0xFFFFFFF8;
+  len += gen_packet_msg(buf + len, GEN_PAYLOAD);
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  expected += 1;
+  
+  /* MessageLength shorter than the header ends the transfer */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  hdr->MessageLength = 8;
+  len += gen_packet_msg(buf + len, GEN_PAYLOAD);
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  
+  /* MessageLength past the end of the transfer */
+  len = gen_packet_msg(buf, GEN_PAYLOAD);
+  hdr->MessageLength = len + 1;
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  
+  /* 128-byte message, padded with one byte like Linux does instead of
+   * a zero-length packet */
+  len = gen_packet_msg(buf, 128 - sizeof(struct rndis_packet_msg) - 62);
+  buf[len++] = 0;
+  gen_bulk_out(RNDIS_OUT_EP, buf, len);
+  expected += 1;
+  
+  return expected;
+}
+
+static void gen_query_xmit_ok(uint32_t expected)
+{
+  struct rndis_query_msg query = {
+    {RNDIS_MSG_QUERY, sizeof(query), g_gen_request_id},
+    RNDIS_OID_GEN_XMIT_OK, 0, 0
+  };
+  struct {
+    struct rndis_query_cmplt cmplt;
+    uint32_t value;
+  } __attribute__((packed)) query_cmplt = {
+    {{RNDIS_MSG_QUERY_C, sizeof(query_cmplt), g_gen_request_id++, RNDIS_STATUS_SUCCESS},
+     4, 16},
+    expected
+  };
+  gen_rndis_command(&query, sizeof(query), &query_cmplt, sizeof(query_cmplt));
+}
+
+static void gen_ncm_init()
+{
+  gen_control_out(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, NULL, 0);
+  gen_control_out(0x01, USB_REQ_SET_INTERFACE, 1, CDCECM_INTERFACE + 1, NULL, 0);
+}
+
+/* Send an NTB of pings, and expect an NTB with the replies */
+static void gen_ncm_pings(int count, bool ndp_first)
+{
+  uint8_t buf[USBNET_RX_TRANSFER_MAX];
+  uint16_t sequence = g_gen_ping_sequence;
+  g_gen_ping_sequence += count;
+  
+  gen_bulk_out(CDCECM_OUT_EP, buf, gen_ntb(buf, count, ndp_first, false, sequence));
+  gen_bulk_in(CDCECM_IN_EP, buf, gen_ntb(buf, count, true, true, sequence));
+}
+
+/* NTBs with the first datagram right after the NTH, which leaves no room
+ * for a slice header before it, and with the NDP first. Returns the
+ * number of pings. */
+static uint32_t gen_ncm_transfers()
+{
+  gen_ncm_pings(1, false);
+  gen_ncm_pings(2, true);
+  gen_ncm_pings(3, false);
+  return 6;
+}
+
+int main(int argc, char *argv[])
+{
+  bool ncm = (argc == 3 && strcmp(argv[1], "-n") == 0);
+  if (argc != 2 && !ncm)
+  {
+    fprintf(stderr, "Usage: %s [-n] output.pcap\n", argv[0]);
+    return 1;
+  }
+  
+  const char *output = argv[argc - 1];
+  if (!pcap_open_write(&g_gen_pcap, output, PCAP_LINKTYPE_USB_LINUX_MMAPPED))
+  {
+    return 1;
+  }
+  
+  if (ncm)
+  {
+    gen_ncm_init();
+    uint32_t expected = gen_ncm_transfers();
+    pcap_close(&g_gen_pcap);
+    printf("%s: %u pings in NTBs\n", output, (unsigned)expected);
+    return 0;
+  }
+  
+  gen_init();
+  gen_invalid_commands();
+  uint32_t expected = gen_transfers();
+  gen_query_xmit_ok(expected);
+  
+  pcap_close(&g_gen_pcap);
+  printf("%s: %u valid packet messages\n", output, (unsigned)expected);
+  return 0;
+}
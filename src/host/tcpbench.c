@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "client.h"
+
+/* TCP benchmarks against daq4-host running with a socket:
+ *
+ * daq4-host -s /tmp/daq4.sock -t 15 &
+ * daq4-tcpbench -s /tmp/daq4.sock -m mode [-t seconds]
+ *
+ * Modes:
+ *   bidir   Download from chargen and upload to discard at the same time,
+ *           and print the throughput of both directions every second.
+ *           Fails if either direction stalls for a whole second.
+ *   acklat  Download from chargen, and meanwhile send two full segments to
+ *           discard every BENCH_PROBE_INTERVAL. Two segments are ACKed at
+ *           once instead of after TCPIP_ACK_DELAY, so this prints how long
+ *           the ACKs take while bulk data fills the transmit queue.
+ *   goodput Download from chargen and print the bytes received in order
+ *           per second. Meant for daq4-host -l percent, to see how the
+ *           stack recovers from lost segments.
+ *   reorder Upload to echo in pairs of segments, each pair sent in reverse
+ *           order, and check the echoed data. Nothing is resent, so this
+ *           fails unless the stack queues the early segment of every pair.
+ *           Each gap must also bring a duplicate ACK.
+ *   smallwin Download from chargen while advertising a window of
+ *           BENCH_SMALL_WINDOW, smaller than the MSS. Fails if the device
+ *           sends beyond the window, or if the download stalls for a
+ *           whole second because it waits for a full segment to fit.
+ *
+ * Downloads are checked against the RFC 864 pattern that chargen sends,
+ * and a mode fails if any byte differs.
+ * The client acknowledges every segment it receives in order, and resends
+ * from the oldest unacknowledged byte when an upload makes no progress for
+ * BENCH_RTO.
+ */
+
+#define BENCH_RTO 200000      /* Microseconds */
+#define BENCH_INTERVAL 1000000 /* Microseconds */
+#define BENCH_TICK 10         /* Milliseconds */
+#define BENCH_PROBE_INTERVAL 20000 /* Microseconds */
+#define BENCH_SMALL_WINDOW 300 /* Bytes */
+
+#define BENCH_PORT_ECHO 7
+#define BENCH_PORT_DISCARD 9
+#define BENCH_PORT_CHARGEN 19
+
+/* Sequence number comparison, RFC 1982 */
+static bool seq_before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+/* Generator of the chargen pattern, as in tcpip_diagnostics.c */
+typedef struct {
+  int char_phase;
+  int line_phase;
+  int linepos;
+} bench_chargen_t;
+
+/* Receiving side of a download */
+typedef struct {
+  client_conn_t conn;
+  bench_chargen_t expected;
+  unsigned long bytes;
+  unsigned long corrupt;
+  unsigned out_of_order;
+  uint64_t last_data;
+} bench_download_t;
+
+/* Sending side of an upload */
+typedef struct {
+  client_conn_t conn;
+  uint32_t acked;       /* Oldest unacknowledged sequence number */
+  uint32_t start;       /* Initial sequence number */
+  unsigned long bytes;
+  unsigned retransmits;
+  uint64_t last_progress;
+} bench_upload_t;
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s -s socket_path -m (bidir|acklat|goodput|reorder|smallwin) [-t seconds]\n", name);
+  exit(1);
+}
+
+/* RFC 864: lines of 72 characters + CRLF, each starting one character
+ * later in the printable ASCII set */
+static uint8_t chargen_next(bench_chargen_t *gen)
+{
+  uint8_t c;
+  gen->linepos++;
+  if (gen->linepos <= 72)
+  {
+    c = ' ' + gen->char_phase++;
+    if (gen->char_phase == 95) gen->char_phase = 0;
+  }
+  else if (gen->linepos == 73)
+  {
+    c = '\r';
+  }
+  else
+  {
+    c = '\n';
+    gen->linepos = 0;
+    gen->char_phase = gen->line_phase++;
+    if (gen->line_phase == 95) gen->line_phase = 0;
+  }
+  
+  return c;
+}
+
+static bool download_open(bench_download_t *down, uint16_t port, uint16_t remote_port,
+                          uint16_t window)
+{
+  *down = (bench_download_t){
+    .conn = {.port = port, .tx_sequence = 1000, .rx_window = window},
+    .expected = {.char_phase = 1, .line_phase = 2},
+  };
+  down->last_data = client_time_us();
+  return client_connect(&down->conn, remote_port);
+}
+
+/* Take the data that continues the stream, and acknowledge */
+static void download_segment(bench_download_t *down, const client_segment_t *seg)
+{
+  if (!seg->length)
+  {
+    return;
+  }
+  
+  if (seg->sequence == down->conn.rx_sequence)
+  {
+    for (size_t i = 0; i < seg->length; i++)
+    {
+      down->corrupt += (seg->data[i] != chargen_next(&down->expected));
+    }
+    
+    down->conn.rx_sequence += seg->length;
+    down->bytes += seg->length;
+    down->last_data = client_time_us();
+  }
+  else if (seq_before(down->conn.rx_sequence, seg->sequence))
+  {
+    down->out_of_order++;
+  }
+  
+  client_send(&down->conn, CLIENT_ACK, NULL, 0);
+}
+
+/* Repeat the ACK if the stream has stalled, in case it was lost */
+static void download_poll(bench_download_t *down)
+{
+  uint64_t now = client_time_us();
+  if (now - down->last_data > BENCH_RTO)
+  {
+    client_send(&down->conn, CLIENT_ACK, NULL, 0);
+    down->last_data = now;
+  }
+}
+
+static bool upload_open(bench_upload_t *up, uint16_t port, uint16_t remote_port)
+{
+  *up = (bench_upload_t){.conn = {.port = port, .tx_sequence = 5000}};
+  if (!client_connect(&up->conn, remote_port))
+  {
+    return false;
+  }
+  
+  up->acked = up->start = up->conn.tx_sequence;
+  up->last_progress = client_time_us();
+  return true;
+}
+
+/* The byte at sequence number seq, so that the receiver can verify it */
+static uint8_t upload_byte(const bench_upload_t *up, uint32_t seq)
+{
+  uint32_t pos = seq - up->start;
+  return (uint8_t)(pos + pos / 251);
+}
+
+static void upload_segment(bench_upload_t *up, uint32_t seq, size_t len)
+{
+  uint8_t data[CLIENT_MSS];
+  for (size_t i = 0; i < len; i++)
+  {
+    data[i] = upload_byte(up, seq + i);
+  }
+  
+  client_send_at(&up->conn, seq, CLIENT_PSH | CLIENT_ACK, data, len);
+}
+
+/* Length of the next segment, limited by the MSS and the window */
+static size_t upload_next_length(const bench_upload_t *up)
+{
+  uint32_t in_flight = up->conn.tx_sequence - up->acked;
+  size_t len = up->conn.mss;
+  
+  if (in_flight >= up->conn.window)
+  {
+    return 0;
+  }
+  
+  if (len > up->conn.window - in_flight)
+  {
+    len = up->conn.window - in_flight;
+  }
+  
+  return len;
+}
+
+/* Send new segments while the window allows */
+static void upload_fill(bench_upload_t *up)
+{
+  size_t len;
+  while ((len = upload_next_length(up)) > 0)
+  {
+    upload_segment(up, up->conn.tx_sequence, len);
+    up->conn.tx_sequence += len;
+  }
+}
+
+static void upload_ack(bench_upload_t *up, const client_segment_t *seg)
+{
+  if (!(seg->flags & CLIENT_ACK))
+  {
+    return;
+  }
+  
+  up->conn.window = seg->window;
+  if (seq_before(up->acked, seg->ack) && !seq_before(up->conn.tx_sequence, seg->ack))
+  {
+    up->bytes += seg->ack - up->acked;
+    up->acked = seg->ack;
+    up->last_progress = client_time_us();
+  }
+  
+  if (seg->length && seg->sequence == up->conn.rx_sequence)
+  {
+    up->conn.rx_sequence += seg->length;
+    client_send(&up->conn, CLIENT_ACK, NULL, 0);
+  }
+}
+
+/* Go back to the oldest unacknowledged byte if nothing was acknowledged
+ * within BENCH_RTO */
+static void upload_poll(bench_upload_t *up)
+{
+  uint64_t now = client_time_us();
+  if (up->acked != up->conn.tx_sequence && now - up->last_progress > BENCH_RTO)
+  {
+    up->conn.tx_sequence = up->acked;
+    up->retransmits++;
+    up->last_progress = now;
+  }
+}
+
+static bool bench_bidir(unsigned seconds)
+{
+  bench_download_t down;
+  bench_upload_t up;
+  
+  if (!download_open(&down, 40000, BENCH_PORT_CHARGEN, 0) ||
+      !upload_open(&up, 40001, BENCH_PORT_DISCARD))
+  {
+    return false;
+  }
+  
+  uint64_t start = client_time_us();
+  uint64_t interval_start = start;
+  unsigned long down_prev = 0, up_prev = 0;
+  double down_min = -1, up_min = -1;
+  
+  printf("%5s %12s %12s\n", "time", "down kB/s", "up kB/s");
+  
+  while (client_time_us() - start < seconds * 1000000ULL)
+  {
+    upload_fill(&up);
+    
+    /* Take everything that has arrived before sending more, so that the
+     * socket does not overflow and drop the download */
+    client_segment_t seg;
+    int timeout = BENCH_TICK;
+    while (client_receive(&seg, timeout))
+    {
+      if (seg.port == down.conn.port)
+      {
+        download_segment(&down, &seg);
+      }
+      else if (seg.port == up.conn.port)
+      {
+        upload_ack(&up, &seg);
+      }
+      
+      timeout = 0;
+    }
+    
+    download_poll(&down);
+    upload_poll(&up);
+    
+    uint64_t now = client_time_us();
+    if (now - interval_start >= BENCH_INTERVAL)
+    {
+      double elapsed = (now - interval_start) / 1e6;
+      double down_rate = (down.bytes - down_prev) / elapsed / 1000;
+      double up_rate = (up.bytes - up_prev) / elapsed / 1000;
+      printf("%5.1f %12.1f %12.1f\n", (now - start) / 1e6, down_rate, up_rate);
+      
+      down_min = (down_min < 0 || down_rate < down_min) ? down_rate : down_min;
+      up_min = (up_min < 0 || up_rate < up_min) ? up_rate : up_min;
+      down_prev = down.bytes;
+      up_prev = up.bytes;
+      interval_start = now;
+    }
+  }
+  
+  client_send(&down.conn, CLIENT_RST, NULL, 0);
+  client_send(&up.conn, CLIENT_RST, NULL, 0);
+  
+  double elapsed = (client_time_us() - start) / 1e6;
+  printf("down %lu bytes, %.1f kB/s, slowest second %.1f kB/s, %u out of order, %lu corrupt\n",
+         down.bytes, down.bytes / elapsed / 1000, down_min, down.out_of_order, down.corrupt);
+  printf("up %lu bytes, %.1f kB/s, slowest second %.1f kB/s, %u retransmits\n",
+         up.bytes, up.bytes / elapsed / 1000, up_min, up.retransmits);
+  
+  return down_min > 0 && up_min > 0 && down.corrupt == 0;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static bool bench_acklat(unsigned seconds)
+{
+  bench_download_t down;
+  client_conn_t probe = {.port = 40001, .tx_sequence = 5000};
+  
+  if (!download_open(&down, 40000, BENCH_PORT_CHARGEN, 0) ||
+      !client_connect(&probe, BENCH_PORT_DISCARD))
+  {
+    return false;
+  }
+  
+  size_t max_samples = seconds * (1000000 / BENCH_PROBE_INTERVAL) + 1;
+  uint32_t *samples = malloc(max_samples * sizeof(uint32_t));
+  size_t count = 0;
+  unsigned resent = 0;
+  bool waiting = false;
+  bool retried = false;
+  uint8_t data[CLIENT_MSS] = {};
+  size_t len = (probe.mss < CLIENT_MSS) ? probe.mss : CLIENT_MSS;
+  
+  uint64_t start = client_time_us();
+  uint64_t probe_time = start;
+  
+  while (client_time_us() - start < seconds * 1000000ULL)
+  {
+    uint64_t now = client_time_us();
+    if (!waiting && now >= probe_time)
+    {
+      client_send(&probe, CLIENT_ACK, data, len);
+      client_send_at(&probe, probe.tx_sequence + len, CLIENT_PSH | CLIENT_ACK, data, len);
+      probe.tx_sequence += 2 * len;
+      probe_time = now;
+      waiting = true;
+      retried = false;
+    }
+    else if (waiting && now - probe_time > BENCH_RTO)
+    {
+      client_send_at(&probe, probe.tx_sequence - 2 * len, CLIENT_ACK, data, len);
+      client_send_at(&probe, probe.tx_sequence - len, CLIENT_PSH | CLIENT_ACK, data, len);
+      probe_time = now;
+      retried = true;
+      resent++;
+    }
+    
+    client_segment_t seg;
+    int timeout = BENCH_TICK;
+    while (client_receive(&seg, timeout))
+    {
+      if (seg.port == down.conn.port)
+      {
+        download_segment(&down, &seg);
+      }
+      else if (seg.port == probe.port && waiting && (seg.flags & CLIENT_ACK) &&
+               !seq_before(seg.ack, probe.tx_sequence))
+      {
+        now = client_time_us();
+        if (!retried && count < max_samples)
+        {
+          samples[count++] = now - probe_time;
+        }
+        
+        probe_time = now + BENCH_PROBE_INTERVAL;
+        waiting = false;
+        break;
+      }
+      
+      timeout = 0;
+    }
+    
+    download_poll(&down);
+  }
+  
+  client_send(&down.conn, CLIENT_RST, NULL, 0);
+  client_send(&probe, CLIENT_RST, NULL, 0);
+  
+  double elapsed = (client_time_us() - start) / 1e6;
+  printf("down %lu bytes, %.1f kB/s, %lu corrupt\n",
+         down.bytes, down.bytes / elapsed / 1000, down.corrupt);
+  
+  if (count)
+  {
+    qsort(samples, count, sizeof(uint32_t), compare_u32);
+    printf("%u ACKs, %u probes resent, latency us: min %u, median %u, "
+           "99%% %u, max %u\n", (unsigned)count, resent, (unsigned)samples[0],
+           (unsigned)samples[count / 2], (unsigned)samples[count * 99 / 100],
+           (unsigned)samples[count - 1]);
+  }
+  
+  free(samples);
+  return count > 0 && down.bytes > 0 && down.corrupt == 0;
+}
+
+static bool bench_goodput(unsigned seconds)
+{
+  bench_download_t down;
+  
+  if (!download_open(&down, 40000, BENCH_PORT_CHARGEN, 0))
+  {
+    return false;
+  }
+  
+  uint64_t start = client_time_us();
+  uint64_t interval_start = start;
+  unsigned long prev = 0;
+  unsigned stalls = 0;
+  
+  printf("%5s %12s %12s\n", "time", "kB/s", "out of order");
+  
+  while (client_time_us() - start < seconds * 1000000ULL)
+  {
+    client_segment_t seg;
+    int timeout = BENCH_TICK;
+    while (client_receive(&seg, timeout))
+    {
+      if (seg.port == down.conn.port)
+      {
+        download_segment(&down, &seg);
+      }
+      
+      timeout = 0;
+    }
+    
+    download_poll(&down);
+    
+    uint64_t now = client_time_us();
+    if (now - interval_start >= BENCH_INTERVAL)
+    {
+      double rate = (down.bytes - prev) / ((now - interval_start) / 1e6) / 1000;
+      printf("%5.1f %12.1f %12u\n", (now - start) / 1e6, rate, down.out_of_order);
+      stalls += (down.bytes == prev);
+      prev = down.bytes;
+      interval_start = now;
+    }
+  }
+  
+  client_send(&down.conn, CLIENT_RST, NULL, 0);
+  
+  double elapsed = (client_time_us() - start) / 1e6;
+  printf("goodput %lu bytes, %.1f kB/s, %u seconds without progress, "
+         "%u out of order, %lu corrupt\n", down.bytes, down.bytes / elapsed / 1000,
+         stalls, down.out_of_order, down.corrupt);
+  
+  return down.bytes > 0 && down.corrupt == 0;
+}
+
+/* Upload pairs of segments to echo with the second one sent first. The
+ * client never resends, so a pair only completes if the device kept the
+ * early segment until the gap was filled. */
+static bool bench_reorder(unsigned seconds)
+{
+  bench_upload_t up;
+  
+  if (!upload_open(&up, 40000, BENCH_PORT_ECHO))
+  {
+    return false;
+  }
+  
+  uint32_t echo_start = up.conn.rx_sequence;
+  unsigned pairs = 0, dup_acks = 0;
+  unsigned long corrupt = 0;
+  bool stalled = false;
+  
+  uint64_t start = client_time_us();
+  while (!stalled && client_time_us() - start < seconds * 1000000ULL)
+  {
+    uint32_t seq = up.conn.tx_sequence;
+    size_t len = up.conn.mss;
+    upload_segment(&up, seq + len, len);
+    upload_segment(&up, seq, len);
+    up.conn.tx_sequence += 2 * len;
+    
+    /* Wait until the pair is acknowledged and echoed back */
+    uint64_t sent = client_time_us();
+    while (up.acked != up.conn.tx_sequence ||
+           up.conn.rx_sequence - echo_start != up.conn.tx_sequence - up.start)
+    {
+      if (client_time_us() - sent > BENCH_INTERVAL)
+      {
+        stalled = true;
+        break;
+      }
+      
+      client_segment_t seg;
+      if (!client_receive(&seg, BENCH_TICK) || seg.port != up.conn.port)
+      {
+        continue;
+      }
+      
+      if (!seg.length && (seg.flags & CLIENT_ACK) && seg.ack == seq)
+      {
+        dup_acks++;
+      }
+      
+      if (seg.length && seg.sequence == up.conn.rx_sequence)
+      {
+        for (size_t i = 0; i < seg.length; i++)
+        {
+          uint32_t pos = up.conn.rx_sequence - echo_start + i;
+          corrupt += (seg.data[i] != upload_byte(&up, up.start + pos));
+        }
+      }
+      
+      upload_ack(&up, &seg);
+    }
+    
+    pairs += !stalled;
+  }
+  
+  client_send(&up.conn, CLIENT_RST, NULL, 0);
+  
+  printf("reorder %u pairs echoed, %u duplicate ACKs, %lu corrupt%s\n",
+         pairs, dup_acks, corrupt, stalled ? ", stalled" : "");
+  
+  return pairs > 0 && !stalled && dup_acks >= pairs && corrupt == 0;
+}
+
+/* A peer whose window never holds a full segment must still get data,
+ * RFC 1122 section 4.2.3.4 */
+static bool bench_smallwin(unsigned seconds)
+{
+  bench_download_t down;
+  
+  if (!download_open(&down, 40000, BENCH_PORT_CHARGEN, BENCH_SMALL_WINDOW))
+  {
+    return false;
+  }
+  
+  uint64_t start = client_time_us();
+  uint64_t interval_start = start;
+  unsigned long prev = 0;
+  unsigned stalls = 0, beyond_window = 0;
+  size_t max_segment = 0;
+  
+  printf("%5s %12s %12s\n", "time", "kB/s", "max segment");
+  
+  while (client_time_us() - start < seconds * 1000000ULL)
+  {
+    client_segment_t seg;
+    int timeout = BENCH_TICK;
+    while (client_receive(&seg, timeout))
+    {
+      if (seg.port == down.conn.port)
+      {
+        /* The client acknowledges everything, so the window is always
+         * BENCH_SMALL_WINDOW from the next expected byte */
+        if (seg.sequence + seg.length - down.conn.rx_sequence > BENCH_SMALL_WINDOW &&
+            seq_before(down.conn.rx_sequence, seg.sequence + seg.length))
+        {
+          beyond_window++;
+        }
+        
+        if (seg.length > max_segment) max_segment = seg.length;
+        download_segment(&down, &seg);
+      }
+      
+      timeout = 0;
+    }
+    
+    download_poll(&down);
+    
+    uint64_t now = client_time_us();
+    if (now - interval_start >= BENCH_INTERVAL)
+    {
+      double rate = (down.bytes - prev) / ((now - interval_start) / 1e6) / 1000;
+      printf("%5.1f %12.1f %12u\n", (now - start) / 1e6, rate, (unsigned)max_segment);
+      stalls += (down.bytes == prev);
+      prev = down.bytes;
+      interval_start = now;
+    }
+  }
+  
+  client_send(&down.conn, CLIENT_RST, NULL, 0);
+  
+  double elapsed = (client_time_us() - start) / 1e6;
+  printf("smallwin %lu bytes, %.1f kB/s, %u seconds without progress, "
+         "%u segments beyond the window, %lu corrupt\n", down.bytes,
+         down.bytes / elapsed / 1000, stalls, beyond_window, down.corrupt);
+  
+  return down.bytes > 0 && stalls == 0 && beyond_window == 0 && down.corrupt == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *socket_path = NULL;
+  const char *mode = NULL;
+  unsigned seconds = 5;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "s:m:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 's': socket_path = optarg; break;
+      case 'm': mode = optarg; break;
+      case 't': seconds = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  
+  if (!socket_path || !mode || !client_open(socket_path))
+  {
+    usage(argv[0]);
+  }
+  
+  bool ok = false;
+  if (strcmp(mode, "bidir") == 0)
+  {
+    ok = bench_bidir(seconds);
+  }
+  else if (strcmp(mode, "acklat") == 0)
+  {
+    ok = bench_acklat(seconds);
+  }
+  else if (strcmp(mode, "goodput") == 0)
+  {
+    ok = bench_goodput(seconds);
+  }
+  else if (strcmp(mode, "reorder") == 0)
+  {
+    ok = bench_reorder(seconds);
+  }
+  else if (strcmp(mode, "smallwin") == 0)
+  {
+    ok = bench_smallwin(seconds);
+  }
+  else
+  {
+    client_close();
+    usage(argv[0]);
+  }
+  
+  client_close();
+  return ok ? 0 : 1;
+}
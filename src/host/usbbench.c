@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "usbsim.h"
+#include "usbnet.h"
+#include "usbnet_descriptors.h"
+#include "cdcecm_std.h"
+#include "echo.h"
+#include "hostlink.h"
+#include "events.h"
+#include "systime.h"
+#include "tcpip.h"
+
+/* Frame rate of the CDC data interface of usbnet.c on the simulated
+ * device controller of usbsim.c:
+ *
+ * daq4-usbbench [-t seconds] [-p payload] [-r rate] [-b]
+ * daq4-usbbench-ecm [-t seconds] [-p payload] [-r rate] [-b]
+ *
+ * daq4-usbbench is built with CDC NCM and sends its pings in NTBs of up
+ * to USBNET_MAX_TRANSFER_FRAMES, as many as fit in dwNtbOutMaxSize, and
+ * daq4-usbbench-ecm with CDC ECM, one frame per transfer. At most
+ * USBBENCH_IN_FLIGHT pings wait for their replies at a time. Prints the
+ * frames and bytes per second in each direction, and the USB packets per
+ * frame, which NCM aggregation lowers for small frames. With -r the
+ * pings are sent at that many per second instead of as fast as the
+ * window allows.
+ *
+ * The main loop sleeps in events_wait() like src/main.c does, and the
+ * endpoint callbacks run from hostlink_service() in place of the USB
+ * interrupt. With -b it instead polls the stack all the time like the
+ * busy loop that main.c had before. Both print the main loop passes per
+ * frame and the time from sending a ping to reading its reply, which
+ * compare best at a rate that leaves the stack mostly idle.
+ */
+
+#define USBBENCH_IN_FLIGHT 8
+#define USBBENCH_MAX_TRANSFER 2048
+#define USBBENCH_INTERVAL SYSTIME_FREQ
+
+/* Send times of the pings in flight, indexed by the low bits of the
+ * sequence number */
+#define USBBENCH_SENT_TIMES 64
+
+typedef struct {
+  unsigned frames;
+  unsigned long bytes;   /* Ethernet frames */
+  unsigned long packets; /* USB packets, including ZLPs */
+} usbbench_dir_t;
+
+typedef struct {
+  usbbench_dir_t out;
+  usbbench_dir_t in;
+  unsigned invalid;
+  unsigned long loops;       /* Main loop passes */
+  uint64_t latency_sum;      /* Microseconds */
+  systime_t latency_max;
+} usbbench_stats_t;
+
+static usbbench_stats_t g_usbbench_stats;
+static size_t g_usbbench_payload = 16;
+static uint16_t g_usbbench_sequence;
+static unsigned g_usbbench_in_flight;
+static systime_t g_usbbench_sent[USBBENCH_SENT_TIMES];
+
+/* With -r, a timerfd that expires once per ping, and the number of pings
+ * that may have been sent so far */
+static int g_usbbench_timer = -1;
+static unsigned long g_usbbench_allowed;
+
+/* OUT transfer being sent */
+static uint8_t g_usbbench_out[USBBENCH_MAX_TRANSFER];
+static size_t g_usbbench_out_len;
+static size_t g_usbbench_out_pos;
+static bool g_usbbench_out_zlp;
+
+/* IN transfer being received */
+static uint8_t g_usbbench_in[USBBENCH_MAX_TRANSFER];
+static size_t g_usbbench_in_len;
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-t seconds] [-p payload] [-r rate] [-b]\n", name);
+  exit(1);
+}
+
+static uint16_t usbbench_new_ping(uint8_t *frame)
+{
+  g_usbbench_sent[g_usbbench_sequence % USBBENCH_SENT_TIMES] = get_systime();
+  return echo_frame(frame, g_usbbench_payload, false, g_usbbench_sequence++);
+}
+
+static void usbbench_count_reply(usbbench_dir_t *dir, const uint8_t *frame, size_t len)
+{
+  if (echo_is_reply(frame, len))
+  {
+    uint16_t sequence = (frame[ECHO_SEQUENCE_OFFSET] << 8) | frame[ECHO_SEQUENCE_OFFSET + 1];
+    systime_t latency = get_systime() - g_usbbench_sent[sequence % USBBENCH_SENT_TIMES];
+    g_usbbench_stats.latency_sum += latency;
+    if (latency > g_usbbench_stats.latency_max)
+    {
+      g_usbbench_stats.latency_max = latency;
+    }
+    
+    dir->frames++;
+    dir->bytes += len;
+    g_usbbench_in_flight--;
+  }
+}
+
+#if USBNET_CDC_NCM
+
+/* Size of an NTB with the NDP after the NTH and count pings aligned to
+ * 4 bytes */
+static size_t usbbench_ntb_size(unsigned count)
+{
+  size_t frame_len = (62 + g_usbbench_payload + 3) & ~3;
+  size_t ndp_len = sizeof(struct usb_cdc_ncm_ndp16_header) +
+                   (count + 1) * sizeof(struct usb_cdc_ncm_ndp16_pointer);
+  return ((sizeof(struct usb_cdc_ncm_nth16) + ndp_len + 3) & ~3) + count * frame_len;
+}
+
+/* Pack as many pings into one NTB as the window, wNtbOutMaxDatagrams and
+ * dwNtbOutMaxSize allow */
+static size_t usbbench_prepare_out(unsigned max_frames)
+{
+  struct usb_cdc_ncm_nth16 *nth = (void*)g_usbbench_out;
+  struct usb_cdc_ncm_ndp16 *ndp = (void*)&g_usbbench_out[sizeof(*nth)];
+  unsigned count = (max_frames < USBNET_MAX_TRANSFER_FRAMES) ? max_frames : USBNET_MAX_TRANSFER_FRAMES;
+  while (count > 1 && usbbench_ntb_size(count) > USBNET_RX_TRANSFER_MAX)
+  {
+    count--;
+  }
+  
+  size_t ndp_len = sizeof(ndp->hdr) + (count + 1) * sizeof(ndp->datagrams[0]);
+  size_t pos = sizeof(*nth) + ndp_len;
+  
+  for (unsigned i = 0; i < count; i++)
+  {
+    pos = (pos + 3) & ~3;
+    size_t len = usbbench_new_ping(&g_usbbench_out[pos]);
+    ndp->datagrams[i] = (struct usb_cdc_ncm_ndp16_pointer){pos, len};
+    g_usbbench_stats.out.bytes += len;
+    pos += len;
+  }
+  
+  ndp->datagrams[count] = (struct usb_cdc_ncm_ndp16_pointer){0, 0};
+  ndp->hdr = (struct usb_cdc_ncm_ndp16_header){USB_CDC_NCM_NDP16_SIGNATURE_NOCRC, ndp_len};
+  *nth = (struct usb_cdc_ncm_nth16){
+    USB_CDC_NCM_NTH16_SIGNATURE, sizeof(*nth), g_usbbench_sequence, pos, sizeof(*nth)
+  };
+  
+  g_usbbench_stats.out.frames += count;
+  g_usbbench_in_flight += count;
+  return pos;
+}
+
+static void usbbench_in_transfer(const uint8_t *data, size_t len)
+{
+  const struct usb_cdc_ncm_nth16 *nth = (const void*)data;
+  if (len < sizeof(*nth) || nth->dwSignature != USB_CDC_NCM_NTH16_SIGNATURE ||
+      nth->wNdpIndex + sizeof(struct usb_cdc_ncm_ndp16_header) > len)
+  {
+    g_usbbench_stats.invalid++;
+    return;
+  }
+  
+  const struct usb_cdc_ncm_ndp16 *ndp = (const void*)&data[nth->wNdpIndex];
+  size_t ndp_end = nth->wNdpIndex + ndp->hdr.wLength;
+  if (ndp->hdr.dwSignature != USB_CDC_NCM_NDP16_SIGNATURE_NOCRC || ndp_end > len)
+  {
+    g_usbbench_stats.invalid++;
+    return;
+  }
+  
+  for (const struct usb_cdc_ncm_ndp16_pointer *p = ndp->datagrams;
+       (const uint8_t*)(p + 1) <= &data[ndp_end] && p->wDatagramIndex != 0; p++)
+  {
+    if (p->wDatagramIndex + p->wDatagramLength > len)
+    {
+      g_usbbench_stats.invalid++;
+      return;
+    }
+    
+    usbbench_count_reply(&g_usbbench_stats.in, &data[p->wDatagramIndex], p->wDatagramLength);
+  }
+}
+
+#else
+
+/* One ping per transfer */
+static size_t usbbench_prepare_out(unsigned max_frames)
+{
+  size_t len = usbbench_new_ping(g_usbbench_out);
+  g_usbbench_stats.out.frames++;
+  g_usbbench_stats.out.bytes += len;
+  g_usbbench_in_flight++;
+  return len;
+}
+
+static void usbbench_in_transfer(const uint8_t *data, size_t len)
+{
+  usbbench_count_reply(&g_usbbench_stats.in, data, len);
+}
+
+#endif
+
+/* Send packets of the current OUT transfer while the endpoint takes them,
+ * and start the next one while the window has room */
+static void usbbench_write_out()
+{
+  size_t packet = usbsim_packet_size(CDCECM_OUT_EP);
+  
+  while (true)
+  {
+    if (g_usbbench_out_pos == g_usbbench_out_len && !g_usbbench_out_zlp)
+    {
+      unsigned window = USBBENCH_IN_FLIGHT - g_usbbench_in_flight;
+      if (g_usbbench_timer >= 0 && g_usbbench_allowed - g_usbbench_stats.out.frames < window)
+      {
+        window = g_usbbench_allowed - g_usbbench_stats.out.frames;
+      }
+      
+      if (window == 0)
+      {
+        return;
+      }
+      
+      g_usbbench_out_len = usbbench_prepare_out(window);
+      g_usbbench_out_pos = 0;
+      g_usbbench_out_zlp = (g_usbbench_out_len % packet) == 0;
+    }
+    
+    size_t len = g_usbbench_out_len - g_usbbench_out_pos;
+    len = (len < packet) ? len : packet;
+    if (!usbsim_out_packet(CDCECM_OUT_EP, &g_usbbench_out[g_usbbench_out_pos], len))
+    {
+      return;
+    }
+    
+    g_usbbench_stats.out.packets++;
+    g_usbbench_out_pos += len;
+    if (len < packet)
+    {
+      g_usbbench_out_zlp = false;
+    }
+  }
+}
+
+/* Read the IN endpoints like the PC polls them. Bulk transfers end with
+ * a short packet. */
+static void usbbench_read_in()
+{
+  uint8_t packet[64];
+  size_t packet_size = usbsim_packet_size(CDCECM_IN_EP);
+  int len;
+  
+  while (usbsim_in_packet(CDCECM_IRQ_EP, packet) >= 0)
+  {
+  }
+  
+  while ((len = usbsim_in_packet(CDCECM_IN_EP, packet)) >= 0)
+  {
+    g_usbbench_stats.in.packets++;
+    if (g_usbbench_in_len + len <= sizeof(g_usbbench_in))
+    {
+      memcpy(&g_usbbench_in[g_usbbench_in_len], packet, len);
+    }
+    
+    g_usbbench_in_len += len;
+    if (len == packet_size)
+    {
+      continue;
+    }
+    
+    if (g_usbbench_in_len > sizeof(g_usbbench_in))
+    {
+      g_usbbench_stats.invalid++;
+    }
+    else if (g_usbbench_in_len > 0)
+    {
+      usbbench_in_transfer(g_usbbench_in, g_usbbench_in_len);
+    }
+    
+    g_usbbench_in_len = 0;
+  }
+}
+
+int hostlink_service()
+{
+  uint64_t expirations;
+  if (g_usbbench_timer >= 0 && read(g_usbbench_timer, &expirations, sizeof(expirations)) > 0)
+  {
+    g_usbbench_allowed += expirations;
+  }
+  
+  usbbench_read_in();
+  usbbench_write_out();
+  usbbench_read_in();
+  return g_usbbench_timer;
+}
+
+static void usbbench_print(const char *name, const usbbench_dir_t *dir, double elapsed)
+{
+  printf("%-3s %10.0f frames/s %10.1f kB/s %6.2f USB packets per frame\n", name,
+         dir->frames / elapsed, dir->bytes / elapsed / 1000,
+         dir->frames ? (double)dir->packets / dir->frames : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned seconds = 5;
+  unsigned rate = 0;
+  bool busy = false;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "t:p:r:b")) != -1)
+  {
+    switch (opt)
+    {
+      case 't': seconds = atoi(optarg); break;
+      case 'p': g_usbbench_payload = atoi(optarg); break;
+      case 'r': rate = atoi(optarg); break;
+      case 'b': busy = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  
+  /* Echo frames have 62 bytes of headers */
+  if (g_usbbench_payload > USBNET_MAX_FRAME_SIZE - 62)
+  {
+    usage(argv[0]);
+  }
+  
+#if USBNET_CDC_NCM
+  if (usbbench_ntb_size(1) > USBNET_RX_TRANSFER_MAX)
+  {
+    usage(argv[0]);
+  }
+#endif
+  
+  if (rate > 0)
+  {
+    long interval = 1000000000L / rate;
+    struct itimerspec spec = {{interval / 1000000000L, interval % 1000000000L}};
+    spec.it_value = spec.it_interval;
+    g_usbbench_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (g_usbbench_timer < 0 || timerfd_settime(g_usbbench_timer, 0, &spec, NULL) < 0)
+    {
+      perror("timerfd");
+      return 1;
+    }
+  }
+  
+  usbnet_init(&st_usbfs_v2_usb_driver, 0xD4000001);
+  tcpip_init();
+  
+  struct usb_setup_data config = {0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0};
+  struct usb_setup_data altset = {0x01, USB_REQ_SET_INTERFACE, 1, CDCECM_INTERFACE + 1, 0};
+  usbsim_control(&config, NULL);
+  usbsim_control(&altset, NULL);
+  
+  systime_t start = get_systime();
+  systime_t interval_start = start;
+  usbbench_stats_t prev = {};
+  
+  printf("%5s %12s %12s\n", "time", "out frames/s", "in frames/s");
+  
+  while (get_systime() - start < seconds * SYSTIME_FREQ)
+  {
+    if (busy)
+    {
+      hostlink_service();
+    }
+    else
+    {
+      events_wait();
+    }
+    
+    tcpip_poll();
+    usbnet_poll();
+    g_usbbench_stats.loops++;
+    
+    systime_t now = get_systime();
+    if (now - interval_start >= USBBENCH_INTERVAL)
+    {
+      double elapsed = (double)(now - interval_start) / SYSTIME_FREQ;
+      printf("%5.1f %12.0f %12.0f\n", (double)(now - start) / SYSTIME_FREQ,
+             (g_usbbench_stats.out.frames - prev.out.frames) / elapsed,
+             (g_usbbench_stats.in.frames - prev.in.frames) / elapsed);
+      prev = g_usbbench_stats;
+      interval_start = now;
+    }
+  }
+  
+  double elapsed = (double)(get_systime() - start) / SYSTIME_FREQ;
+  usbbench_stats_t *stats = &g_usbbench_stats;
+  printf("%s, %u byte pings, %s:\n", USBNET_CDC_NCM ? "NCM" : "ECM", (unsigned)(g_usbbench_payload),
+         busy ? "busy loop" : "event loop");
+  usbbench_print("out", &stats->out, elapsed);
+  usbbench_print("in", &stats->in, elapsed);
+  
+  if (stats->in.frames > 0)
+  {
+    printf("%.2f main loop passes per frame, latency %.1f us average, %u us max\n",
+           (double)stats->loops / stats->in.frames,
+           (double)stats->latency_sum / stats->in.frames, (unsigned)stats->latency_max);
+  }
+  
+  if (stats->invalid)
+  {
+    printf("%u invalid IN transfers\n", stats->invalid);
+  }
+  
+  return (stats->in.frames > 0 && !stats->invalid) ? 0 : 1;
+}
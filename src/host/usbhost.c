@@ -0,0 +1,625 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "usbsim.h"
+#include "usbnet.h"
+#include "usbnet_descriptors.h"
+#include "rndis_std.h"
+#include "cdcecm_std.h"
+#include "echo.h"
+#include "pcap.h"
+#include "usbmon.h"
+#include "hostlink.h"
+#include "events.h"
+#include "systime.h"
+#include "tcpip.h"
+#include "tcpip_diagnostics.h"
+#include "http.h"
+#include "http_index.h"
+
+/* Replays the host side of a USB capture against usbnet.c, which runs on
+ * the simulated device controller of usbsim.c:
+ *
+ * daq4-usbhost -r input.pcap [-w output.pcap] [-t seconds]
+ *
+ * The input is a Linux usbmon capture, link type 220. The control
+ * requests and bulk OUT transfers that the PC submitted are replayed in
+ * order, and the IN endpoints are read all the time like the PC would.
+ * Completions in the input are only used for checking. The output has the
+ * replayed transfers and the completions of the simulated device.
+ *
+ * The replay fails if:
+ *   - an RNDIS response does not answer the oldest command waiting for one
+ *   - a response differs from its completion in the input, if there is one
+ *   - an RNDIS IN transfer is not a sequence of valid packet messages, or
+ *     is longer than the MaxTransferSize of the initialize message
+ *   - an NCM IN transfer is not a valid NTB, or the NTBs carry a different
+ *     number of ping replies than the bulk IN completions in the input
+ *   - the input has not been replayed within the time limit
+ */
+
+#define USBHOST_MAX_RECORD 65536
+#define USBHOST_MAX_CONTROL 1024
+#define USBHOST_MAX_IN_TRANSFER 16384
+#define USBHOST_PENDING_COMMANDS 8
+#define USBHOST_CONTROL_HISTORY 8
+
+/* Time to let the stack finish after the last input record, microseconds */
+#define USBHOST_SETTLE_TIME 100000
+
+/* Input record being replayed */
+typedef struct {
+  usbmon_header_t hdr;
+  uint8_t data[USBHOST_MAX_RECORD];
+  size_t len;
+  size_t pos;  /* Bytes of a bulk OUT transfer sent so far */
+  bool done;   /* Bulk OUT transfer has been sent fully */
+} usbhost_record_t;
+
+/* IN transfer being received from the simulated device */
+typedef struct {
+  uint8_t ep;
+  uint8_t xfer_type;
+  size_t len;
+  bool overflow;
+  uint8_t data[USBHOST_MAX_IN_TRANSFER];
+} usbhost_in_transfer_t;
+
+/* Replies to control IN requests, for comparing with the input */
+typedef struct {
+  uint64_t id;
+  int len;
+  uint8_t data[USBHOST_MAX_CONTROL];
+} usbhost_control_reply_t;
+
+typedef struct {
+  unsigned control_requests;
+  unsigned control_stalls;
+  unsigned out_transfers;
+  unsigned rndis_commands;
+  unsigned rndis_responses;
+  unsigned rndis_in_transfers;
+  unsigned rndis_in_messages;
+  unsigned rndis_max_messages;
+  unsigned ncm_in_transfers;
+  unsigned ncm_in_datagrams;
+  unsigned ncm_in_replies;
+  unsigned ncm_expected_replies;
+  unsigned compared;
+  unsigned errors;
+} usbhost_stats_t;
+
+static pcap_file_t g_usbhost_input;
+static pcap_file_t g_usbhost_output;
+static usbhost_record_t g_usbhost_record;
+static bool g_usbhost_record_valid;
+static bool g_usbhost_input_done;
+static systime_t g_usbhost_input_end;
+static uint64_t g_usbhost_next_id = 1;
+
+static usbhost_in_transfer_t g_usbhost_in[] = {
+  {.ep = RNDIS_IN_EP, .xfer_type = USBMON_XFER_BULK},
+  {.ep = RNDIS_IRQ_EP, .xfer_type = USBMON_XFER_INTERRUPT},
+  {.ep = CDCECM_IN_EP, .xfer_type = USBMON_XFER_BULK},
+  {.ep = CDCECM_IRQ_EP, .xfer_type = USBMON_XFER_INTERRUPT},
+};
+
+static uint32_t g_usbhost_pending[USBHOST_PENDING_COMMANDS];
+static int g_usbhost_pending_count;
+static uint32_t g_usbhost_max_transfer = USBHOST_MAX_IN_TRANSFER;
+static usbhost_control_reply_t g_usbhost_replies[USBHOST_CONTROL_HISTORY];
+static int g_usbhost_reply_next;
+static usbhost_stats_t g_usbhost_stats;
+
+#define usbhost_error(fmt, ...) do { \
+    printf("[ERROR] " fmt "\n", ##__VA_ARGS__); \
+    g_usbhost_stats.errors++; \
+  } while (0)
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s -r input.pcap [-w output.pcap] [-t seconds]\n", name);
+  exit(1);
+}
+
+/* Append a record to the output capture */
+static void usbhost_write(const usbmon_header_t *hdr, const uint8_t *data, size_t len)
+{
+  static uint8_t record[sizeof(usbmon_header_t) + USBHOST_MAX_RECORD];
+  
+  if (!g_usbhost_output.file)
+  {
+    return;
+  }
+  
+  usbmon_header_t out = *hdr;
+  out.len_cap = len;
+  out.flag_data = len ? 0 : '<';
+  memcpy(record, &out, sizeof(out));
+  memcpy(record + sizeof(out), data, len);
+  pcap_write(&g_usbhost_output, record, sizeof(out) + len);
+}
+
+static void usbhost_write_completion(const usbmon_header_t *submit, int32_t status,
+                                     const uint8_t *data, size_t len)
+{
+  usbmon_header_t hdr = *submit;
+  hdr.type = 'C';
+  hdr.flag_setup = '-';
+  hdr.status = status;
+  hdr.length = len;
+  usbhost_write(&hdr, data, len);
+}
+
+/********************
+ * RNDIS messages *
+ ********************/
+
+/* Remember the command so that its response can be checked */
+static void usbhost_rndis_command(const uint8_t *data, size_t len)
+{
+  const struct rndis_command_header *hdr = (const void*)data;
+  if (len < sizeof(*hdr))
+  {
+    return;
+  }
+  
+  g_usbhost_stats.rndis_commands++;
+  
+  if (hdr->MessageType == RNDIS_MSG_INIT && len >= sizeof(struct rndis_initialize_msg))
+  {
+    const struct rndis_initialize_msg *init = (const void*)data;
+    g_usbhost_max_transfer = init->MaxTransferSize;
+  }
+  
+  if (hdr->MessageType == RNDIS_MSG_HALT)
+  {
+    return;
+  }
+  
+  if (g_usbhost_pending_count == USBHOST_PENDING_COMMANDS)
+  {
+    usbhost_error("More than %d RNDIS commands without a response", USBHOST_PENDING_COMMANDS);
+    return;
+  }
+  
+  g_usbhost_pending[g_usbhost_pending_count++] = hdr->RequestID;
+}
+
+static void usbhost_rndis_response(const uint8_t *data, size_t len)
+{
+  const struct rndis_response_header *hdr = (const void*)data;
+  if (len == 0)
+  {
+    return;
+  }
+  
+  g_usbhost_stats.rndis_responses++;
+  
+  if (len < sizeof(*hdr) || hdr->MessageLength != len)
+  {
+    usbhost_error("RNDIS response of %u bytes has MessageLength %u",
+                  (unsigned)len, (unsigned)(len >= 8 ? hdr->MessageLength : 0));
+  }
+  else if (g_usbhost_pending_count == 0 || hdr->RequestID != g_usbhost_pending[0])
+  {
+    usbhost_error("RNDIS response to request %u is not the one expected",
+                  (unsigned)hdr->RequestID);
+  }
+  
+  if (g_usbhost_pending_count > 0)
+  {
+    g_usbhost_pending_count--;
+    memmove(g_usbhost_pending, g_usbhost_pending + 1,
+            g_usbhost_pending_count * sizeof(g_usbhost_pending[0]));
+  }
+}
+
+/* Check that an IN transfer consists of packet messages */
+static void usbhost_rndis_in_transfer(const uint8_t *data, size_t len)
+{
+  size_t min_header = offsetof(struct rndis_packet_msg, Padding);
+  size_t pos = 0;
+  unsigned count = 0;
+  
+  if (len > g_usbhost_max_transfer)
+  {
+    usbhost_error("RNDIS IN transfer of %u bytes, MaxTransferSize is %u",
+                  (unsigned)len, (unsigned)g_usbhost_max_transfer);
+  }
+  
+  while (pos < len)
+  {
+    const struct rndis_packet_msg *hdr = (const void*)&data[pos];
+    if (len - pos < min_header || hdr->MessageType != RNDIS_MSG_PACKET ||
+        hdr->MessageLength < min_header || hdr->MessageLength > len - pos ||
+        hdr->DataOffset > hdr->MessageLength - 8 ||
+        hdr->DataLength > hdr->MessageLength - 8 - hdr->DataOffset)
+    {
+      usbhost_error("Invalid RNDIS packet message at offset %u of IN transfer", (unsigned)pos);
+      return;
+    }
+    
+    pos += hdr->MessageLength;
+    count++;
+  }
+  
+  g_usbhost_stats.rndis_in_transfers++;
+  g_usbhost_stats.rndis_in_messages += count;
+  if (count > g_usbhost_stats.rndis_max_messages)
+  {
+    g_usbhost_stats.rndis_max_messages = count;
+  }
+}
+
+/*****************
+ * NCM transfers *
+ *****************/
+
+/* Number of datagrams in an NTB, or -1 if it is not valid. The echo
+ * replies among them are added to replies. */
+static int usbhost_ncm_datagrams(const uint8_t *data, size_t len, unsigned *replies)
+{
+  const struct usb_cdc_ncm_nth16 *nth = (const void*)data;
+  if (len < sizeof(*nth) || nth->dwSignature != USB_CDC_NCM_NTH16_SIGNATURE ||
+      nth->wBlockLength > len || nth->wNdpIndex < sizeof(*nth) ||
+      nth->wNdpIndex + sizeof(struct usb_cdc_ncm_ndp16_header) > nth->wBlockLength)
+  {
+    return -1;
+  }
+  
+  const struct usb_cdc_ncm_ndp16 *ndp = (const void*)&data[nth->wNdpIndex];
+  size_t ndp_end = nth->wNdpIndex + ndp->hdr.wLength;
+  if (ndp->hdr.dwSignature != USB_CDC_NCM_NDP16_SIGNATURE_NOCRC || ndp_end > nth->wBlockLength)
+  {
+    return -1;
+  }
+  
+  int count = 0;
+  for (const struct usb_cdc_ncm_ndp16_pointer *p = ndp->datagrams;
+       (const uint8_t*)(p + 1) <= &data[ndp_end] && p->wDatagramIndex != 0; p++)
+  {
+    if (p->wDatagramIndex + p->wDatagramLength > nth->wBlockLength)
+    {
+      return -1;
+    }
+    
+    *replies += echo_is_reply(&data[p->wDatagramIndex], p->wDatagramLength);
+    count++;
+  }
+  
+  return count;
+}
+
+static void usbhost_ncm_in_transfer(const uint8_t *data, size_t len)
+{
+  int count = usbhost_ncm_datagrams(data, len, &g_usbhost_stats.ncm_in_replies);
+  if (count < 0)
+  {
+    usbhost_error("Invalid NTB in NCM IN transfer of %u bytes", (unsigned)len);
+    return;
+  }
+  
+  g_usbhost_stats.ncm_in_transfers++;
+  g_usbhost_stats.ncm_in_datagrams += count;
+}
+
+/*********************
+ * Transfer replay *
+ *********************/
+
+static void usbhost_control(usbhost_record_t *rec)
+{
+  struct usb_setup_data setup;
+  memcpy(&setup, rec->hdr.setup, sizeof(setup));
+  bool in = (setup.bmRequestType & USB_REQ_TYPE_IN) != 0;
+  
+  uint8_t data[USBHOST_MAX_CONTROL] = {};
+  if (setup.wLength > sizeof(data))
+  {
+    setup.wLength = sizeof(data);
+  }
+  
+  if (!in)
+  {
+    memcpy(data, rec->data, (rec->len < setup.wLength) ? rec->len : setup.wLength);
+  }
+  
+  bool rndis = (setup.wIndex == RNDIS_INTERFACE &&
+                (setup.bmRequestType & USB_REQ_TYPE_TYPE) == USB_REQ_TYPE_CLASS);
+  if (rndis && !in && setup.bRequest == RNDIS_SEND_ENCAPSULATED_COMMAND)
+  {
+    usbhost_rndis_command(data, setup.wLength);
+  }
+  
+  int len = usbsim_control(&setup, data);
+  g_usbhost_stats.control_requests++;
+  if (len < 0)
+  {
+    g_usbhost_stats.control_stalls++;
+  }
+  
+  if (rndis && in && setup.bRequest == RNDIS_GET_ENCAPSULATED_RESPONSE && len > 0)
+  {
+    usbhost_rndis_response(data, len);
+  }
+  
+  if (in)
+  {
+    usbhost_control_reply_t *reply = &g_usbhost_replies[g_usbhost_reply_next];
+    g_usbhost_reply_next = (g_usbhost_reply_next + 1) % USBHOST_CONTROL_HISTORY;
+    reply->id = rec->hdr.id;
+    reply->len = len;
+    memcpy(reply->data, data, (len > 0) ? len : 0);
+  }
+  
+  usbhost_write(&rec->hdr, in ? NULL : data, in ? 0 : setup.wLength);
+  usbhost_write_completion(&rec->hdr, (len < 0) ? USBMON_EPIPE : 0,
+                           in ? data : NULL, (in && len > 0) ? len : 0);
+}
+
+/* Compare the completion of a control IN request in the input with what
+ * the simulated device replied */
+static void usbhost_compare(usbhost_record_t *rec)
+{
+  for (int i = 0; i < USBHOST_CONTROL_HISTORY; i++)
+  {
+    usbhost_control_reply_t *reply = &g_usbhost_replies[i];
+    if (reply->id != rec->hdr.id || reply->id == 0)
+    {
+      continue;
+    }
+    
+    g_usbhost_stats.compared++;
+    if (reply->len != (int)rec->len || memcmp(reply->data, rec->data, rec->len) != 0)
+    {
+      usbhost_error("Control IN request %llu: replied %d bytes, input has %u bytes%s",
+                    (unsigned long long)reply->id, reply->len, (unsigned)rec->len,
+                    (reply->len == (int)rec->len) ? " with different contents" : "");
+    }
+    
+    reply->id = 0;
+    return;
+  }
+}
+
+/* Send the packets of a bulk OUT transfer while the endpoint takes them.
+ * Returns true once the whole transfer has been sent. */
+static bool usbhost_bulk_out(usbhost_record_t *rec)
+{
+  size_t packet = usbsim_packet_size(rec->hdr.epnum);
+  if (!packet)
+  {
+    usbhost_error("Bulk OUT transfer to endpoint %02x that is not set up", rec->hdr.epnum);
+    return true;
+  }
+  
+  while (!rec->done)
+  {
+    size_t len = rec->len - rec->pos;
+    len = (len < packet) ? len : packet;
+    if (!usbsim_out_packet(rec->hdr.epnum, &rec->data[rec->pos], len))
+    {
+      return false;
+    }
+    
+    rec->pos += len;
+    if (len < packet ||
+        (rec->pos == rec->len && !(rec->hdr.xfer_flags & USBMON_URB_ZERO_PACKET)))
+    {
+      rec->done = true;
+    }
+  }
+  
+  g_usbhost_stats.out_transfers++;
+  usbhost_write(&rec->hdr, rec->data, rec->len);
+  usbhost_write_completion(&rec->hdr, 0, NULL, 0);
+  return true;
+}
+
+/* Read the next input record. Returns false at the end of the input. */
+static bool usbhost_read_record(usbhost_record_t *rec)
+{
+  static uint8_t record[sizeof(usbmon_header_t) + USBHOST_MAX_RECORD];
+  size_t len;
+  
+  while ((len = pcap_read(&g_usbhost_input, record, sizeof(record))) > 0)
+  {
+    if (len < sizeof(usbmon_header_t))
+    {
+      continue;
+    }
+    
+    memcpy(&rec->hdr, record, sizeof(usbmon_header_t));
+    rec->len = len - sizeof(usbmon_header_t);
+    if (rec->hdr.flag_data != 0 || rec->len > rec->hdr.len_cap)
+    {
+      rec->len = (rec->hdr.flag_data == 0) ? rec->hdr.len_cap : 0;
+    }
+    
+    memcpy(rec->data, record + sizeof(usbmon_header_t), rec->len);
+    rec->pos = 0;
+    rec->done = false;
+    return true;
+  }
+  
+  return false;
+}
+
+/* Replay input records until one has to wait for the device */
+static void usbhost_replay()
+{
+  usbhost_record_t *rec = &g_usbhost_record;
+  
+  while (!g_usbhost_input_done)
+  {
+    if (!g_usbhost_record_valid && !(g_usbhost_record_valid = usbhost_read_record(rec)))
+    {
+      g_usbhost_input_done = true;
+      g_usbhost_input_end = get_systime();
+      return;
+    }
+    
+    usbmon_header_t *hdr = &rec->hdr;
+    if (hdr->type == 'S' && hdr->xfer_type == USBMON_XFER_CONTROL && hdr->flag_setup == 0)
+    {
+      usbhost_control(rec);
+    }
+    else if (hdr->type == 'S' && hdr->xfer_type == USBMON_XFER_BULK && !(hdr->epnum & 0x80))
+    {
+      if (!usbhost_bulk_out(rec))
+      {
+        return;
+      }
+    }
+    else if (hdr->type == 'C' && hdr->xfer_type == USBMON_XFER_CONTROL &&
+             (hdr->epnum & 0x80) && rec->len > 0)
+    {
+      usbhost_compare(rec);
+    }
+    else if (USBNET_CDC_NCM && hdr->type == 'C' && hdr->xfer_type == USBMON_XFER_BULK &&
+             hdr->epnum == CDCECM_IN_EP && rec->len > 0)
+    {
+      usbhost_ncm_datagrams(rec->data, rec->len, &g_usbhost_stats.ncm_expected_replies);
+    }
+    
+    g_usbhost_record_valid = false;
+  }
+}
+
+/* Read the IN endpoints like the PC polls them. Interrupt transfers are
+ * one packet each, bulk transfers end with a short packet. */
+static void usbhost_read_in()
+{
+  uint8_t packet[64];
+  
+  for (int i = 0; i < sizeof(g_usbhost_in) / sizeof(g_usbhost_in[0]); i++)
+  {
+    usbhost_in_transfer_t *in = &g_usbhost_in[i];
+    size_t packet_size = usbsim_packet_size(in->ep);
+    int len;
+    
+    while ((len = usbsim_in_packet(in->ep, packet)) >= 0)
+    {
+      if (in->len + len <= sizeof(in->data))
+      {
+        memcpy(&in->data[in->len], packet, len);
+        in->len += len;
+      }
+      else
+      {
+        in->overflow = true;
+      }
+      
+      if (in->xfer_type == USBMON_XFER_BULK && len == packet_size)
+      {
+        continue;
+      }
+      
+      usbmon_header_t hdr = {
+        .id = g_usbhost_next_id++, .type = 'C', .xfer_type = in->xfer_type,
+        .epnum = in->ep, .flag_setup = '-', .length = in->len,
+      };
+      usbhost_write(&hdr, in->data, in->len);
+      
+      if (in->overflow)
+      {
+        usbhost_error("IN transfer on endpoint %02x longer than %u bytes",
+                      in->ep, (unsigned)sizeof(in->data));
+      }
+      else if (in->ep == RNDIS_IN_EP)
+      {
+        usbhost_rndis_in_transfer(in->data, in->len);
+      }
+      else if (USBNET_CDC_NCM && in->ep == CDCECM_IN_EP && in->len > 0)
+      {
+        usbhost_ncm_in_transfer(in->data, in->len);
+      }
+      
+      in->len = 0;
+      in->overflow = false;
+    }
+  }
+}
+
+int hostlink_service()
+{
+  usbhost_read_in();
+  usbhost_replay();
+  usbhost_read_in();
+  return -1;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *input = NULL;
+  const char *output = NULL;
+  unsigned seconds = 10;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "r:w:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r': input = optarg; break;
+      case 'w': output = optarg; break;
+      case 't': seconds = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  
+  if (!input)
+  {
+    usage(argv[0]);
+  }
+  
+  if (!pcap_open_read(&g_usbhost_input, input, PCAP_LINKTYPE_USB_LINUX_MMAPPED) ||
+      (output && !pcap_open_write(&g_usbhost_output, output, PCAP_LINKTYPE_USB_LINUX_MMAPPED)))
+  {
+    return 1;
+  }
+  
+  usbnet_init(&st_usbfs_v2_usb_driver, 0xD4000001);
+  tcpip_init();
+  http_init();
+  
+  http_index_init();
+  tcpip_diagnostics_init();
+  
+  systime_t start = get_systime();
+  
+  while (!g_usbhost_input_done || usbnet_get_tx_queue_size() > 0 ||
+         get_systime() - g_usbhost_input_end < USBHOST_SETTLE_TIME)
+  {
+    if (get_systime() - start >= seconds * SYSTIME_FREQ)
+    {
+      usbhost_error("Replay did not finish in %u seconds", seconds);
+      break;
+    }
+    
+    events_wait();
+    tcpip_poll();
+    usbnet_poll();
+  }
+  
+  pcap_close(&g_usbhost_output);
+  
+  usbhost_stats_t *stats = &g_usbhost_stats;
+  if (stats->ncm_in_replies != stats->ncm_expected_replies)
+  {
+    usbhost_error("NCM IN transfers carried %u ping replies, input has %u",
+                  stats->ncm_in_replies, stats->ncm_expected_replies);
+  }
+  
+  printf("%u control requests, %u stalled, %u bulk OUT transfers\n",
+         stats->control_requests, stats->control_stalls, stats->out_transfers);
+  printf("RNDIS: %u commands, %u responses, %u compared with the input\n",
+         stats->rndis_commands, stats->rndis_responses, stats->compared);
+  printf("RNDIS: %u IN transfers, %u packet messages, at most %u per transfer\n",
+         stats->rndis_in_transfers, stats->rndis_in_messages, stats->rndis_max_messages);
+  printf("NCM: %u IN transfers, %u datagrams, %u ping replies\n",
+         stats->ncm_in_transfers, stats->ncm_in_datagrams, stats->ncm_in_replies);
+  printf("%u errors\n", stats->errors);
+  
+  return stats->errors ? 1 : 0;
+}
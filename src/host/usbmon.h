@@ -0,0 +1,37 @@
+#ifndef HOST_USBMON_H
+#define HOST_USBMON_H
+
+/* Record header of Linux usbmon captures, pcap link type 220.
+ * See Documentation/usb/usbmon.rst in the Linux sources. The data of the
+ * transfer follows the header. */
+
+#include <stdint.h>
+
+typedef struct {
+  uint64_t id;       /* URB, same in the submission and its completion */
+  uint8_t type;      /* 'S'ubmission, 'C'ompletion or 'E'rror */
+  uint8_t xfer_type; /* USBMON_XFER_* */
+  uint8_t epnum;     /* Endpoint address, 0x80 set for IN */
+  uint8_t devnum;
+  uint16_t busnum;
+  int8_t flag_setup; /* 0 if setup holds the setup packet */
+  int8_t flag_data;  /* 0 if data follows the header */
+  int64_t ts_sec;
+  int32_t ts_usec;
+  int32_t status;
+  uint32_t length;
+  uint32_t len_cap;
+  uint8_t setup[8];
+  int32_t interval;
+  int32_t start_frame;
+  uint32_t xfer_flags;
+  uint32_t ndesc;
+} __attribute__((packed)) usbmon_header_t;
+
+#define USBMON_XFER_INTERRUPT 1
+#define USBMON_XFER_CONTROL 2
+#define USBMON_XFER_BULK 3
+#define USBMON_URB_ZERO_PACKET 0x0040
+#define USBMON_EPIPE (-32)
+
+#endif
@@ -0,0 +1,307 @@
+#include "usbsim.h"
+#include "usb_dblbuf.h"
+#include <string.h>
+#include "debug.h"
+
+/* Endpoints are single-buffered unless set up with usb_dblbuf_setup(), in
+ * which case they have two packet buffers like on the STM32. The packet
+ * memory of each endpoint is a small FIFO. */
+#define USBSIM_MAX_PACKET 64
+#define USBSIM_ENDPOINTS 16
+#define USBSIM_MAX_CONTROL_CALLBACKS 4
+
+typedef struct {
+  usbd_endpoint_callback callback;
+  uint16_t max_size;
+  uint8_t depth;  /* Number of packet buffers, 0 if not set up */
+  uint8_t count;  /* Packets waiting */
+  uint8_t head;
+  uint8_t lengths[2];
+  uint8_t packets[2][USBSIM_MAX_PACKET];
+} usbsim_endpoint_t;
+
+typedef struct {
+  usbd_control_callback callback;
+  uint8_t type;
+  uint8_t type_mask;
+} usbsim_control_callback_t;
+
+struct _usbd_device {
+  uint8_t *control_buffer;
+  uint16_t control_buffer_size;
+};
+
+struct _usbd_driver {
+  int unused;
+};
+
+const usbd_driver st_usbfs_v2_usb_driver;
+
+static usbd_device g_usbsim_device;
+static usbsim_endpoint_t g_usbsim_endpoints[USBSIM_ENDPOINTS];
+static usbsim_control_callback_t g_usbsim_control_callbacks[USBSIM_MAX_CONTROL_CALLBACKS];
+static usbd_set_config_callback g_usbsim_set_config;
+static usbd_set_altsetting_callback g_usbsim_set_altsetting;
+
+static usbsim_endpoint_t *usbsim_endpoint(uint8_t addr)
+{
+  return &g_usbsim_endpoints[(addr & 0x07) | ((addr & 0x80) ? 0x08 : 0)];
+}
+
+static void usbsim_push(usbsim_endpoint_t *ep, const void *data, size_t len)
+{
+  int slot = (ep->head + ep->count) % 2;
+  memcpy(ep->packets[slot], data, len);
+  ep->lengths[slot] = len;
+  ep->count++;
+}
+
+static size_t usbsim_pop(usbsim_endpoint_t *ep, void *data, size_t max_len)
+{
+  size_t len = ep->lengths[ep->head];
+  len = (len < max_len) ? len : max_len;
+  memcpy(data, ep->packets[ep->head], len);
+  ep->head = (ep->head + 1) % 2;
+  ep->count--;
+  return len;
+}
+
+static void usbsim_setup_endpoint(uint8_t addr, uint16_t max_size, uint8_t depth,
+                                  usbd_endpoint_callback callback)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  *ep = (usbsim_endpoint_t){
+    .callback = callback,
+    .max_size = (max_size < USBSIM_MAX_PACKET) ? max_size : USBSIM_MAX_PACKET,
+    .depth = depth,
+  };
+}
+
+/*****************************
+ * libopencm3 USB device API *
+ *****************************/
+
+usbd_device *usbd_init(const usbd_driver *driver, const struct usb_device_descriptor *dev,
+                       const struct usb_config_descriptor *conf, const char **strings,
+                       int num_strings, uint8_t *control_buffer, uint16_t control_buffer_size)
+{
+  g_usbsim_device.control_buffer = control_buffer;
+  g_usbsim_device.control_buffer_size = control_buffer_size;
+  return &g_usbsim_device;
+}
+
+void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
+                                           usbd_set_altsetting_callback callback)
+{
+  g_usbsim_set_altsetting = callback;
+}
+
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+                                      usbd_set_config_callback callback)
+{
+  g_usbsim_set_config = callback;
+  return 0;
+}
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type, uint8_t type_mask,
+                                   usbd_control_callback callback)
+{
+  for (int i = 0; i < USBSIM_MAX_CONTROL_CALLBACKS; i++)
+  {
+    if (!g_usbsim_control_callbacks[i].callback)
+    {
+      g_usbsim_control_callbacks[i] = (usbsim_control_callback_t){callback, type, type_mask};
+      return 0;
+    }
+  }
+  
+  return -1;
+}
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type, uint16_t max_size,
+                   usbd_endpoint_callback callback)
+{
+  usbsim_setup_endpoint(addr, max_size, 1, callback);
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr, const void *buf, uint16_t len)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  if (ep->count >= ep->depth || len > ep->max_size)
+  {
+    return 0;
+  }
+  
+  usbsim_push(ep, buf, len);
+  return len;
+}
+
+/****************
+ * usb_dblbuf.h *
+ ****************/
+
+void usb_dblbuf_reset()
+{
+}
+
+void usb_dblbuf_setup(usbd_device *usbd_dev, uint8_t addr, uint16_t max_size,
+                      usbd_endpoint_callback callback)
+{
+  usbsim_setup_endpoint(addr, max_size, 2, callback);
+}
+
+size_t usb_dblbuf_tx_free(uint8_t addr)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  return ep->depth - ep->count;
+}
+
+void usb_dblbuf_write(uint8_t addr, const void *data, size_t len)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  if (ep->count >= ep->depth || len > ep->max_size)
+  {
+    warn("Write to full endpoint %02x", addr);
+    return;
+  }
+  
+  usbsim_push(ep, data, len);
+}
+
+bool usb_dblbuf_rx_pending(uint8_t addr)
+{
+  return usbsim_endpoint(addr)->count > 0;
+}
+
+size_t usb_dblbuf_read(uint8_t addr, void *buf, size_t max_len)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  if (ep->count == 0)
+  {
+    warn("Read from empty endpoint %02x", addr);
+    return 0;
+  }
+  
+  return usbsim_pop(ep, buf, max_len);
+}
+
+/*************
+ * Host side *
+ *************/
+
+/* Standard requests that change the configuration. Callbacks registered
+ * for the old configuration are dropped first, as libopencm3 does. */
+static int usbsim_standard_request(const struct usb_setup_data *setup)
+{
+  if (setup->bmRequestType == 0x00 && setup->bRequest == USB_REQ_SET_CONFIGURATION)
+  {
+    memset(g_usbsim_control_callbacks, 0, sizeof(g_usbsim_control_callbacks));
+    if (g_usbsim_set_config)
+    {
+      g_usbsim_set_config(&g_usbsim_device, setup->wValue);
+    }
+    return 0;
+  }
+  else if (setup->bmRequestType == 0x01 && setup->bRequest == USB_REQ_SET_INTERFACE)
+  {
+    if (g_usbsim_set_altsetting)
+    {
+      g_usbsim_set_altsetting(&g_usbsim_device, setup->wIndex, setup->wValue);
+    }
+    return 0;
+  }
+  
+  return -1;
+}
+
+int usbsim_control(const struct usb_setup_data *setup, uint8_t *data)
+{
+  bool in = (setup->bmRequestType & USB_REQ_TYPE_IN) != 0;
+  
+  if (!in && setup->wLength > g_usbsim_device.control_buffer_size)
+  {
+    return -1;
+  }
+  
+  for (int i = 0; i < USBSIM_MAX_CONTROL_CALLBACKS; i++)
+  {
+    usbsim_control_callback_t *cb = &g_usbsim_control_callbacks[i];
+    if (!cb->callback || (setup->bmRequestType & cb->type_mask) != cb->type)
+    {
+      continue;
+    }
+    
+    struct usb_setup_data req = *setup;
+    uint8_t *buf = g_usbsim_device.control_buffer;
+    uint16_t len = setup->wLength;
+    usbd_control_complete_callback complete = NULL;
+    
+    if (!in)
+    {
+      memcpy(buf, data, len);
+    }
+    
+    int result = cb->callback(&g_usbsim_device, &req, &buf, &len, &complete);
+    if (result == USBD_REQ_NOTSUPP)
+    {
+      return -1;
+    }
+    else if (result == USBD_REQ_HANDLED)
+    {
+      if (in)
+      {
+        len = (len < setup->wLength) ? len : setup->wLength;
+        memcpy(data, buf, len);
+      }
+      
+      if (complete)
+      {
+        complete(&g_usbsim_device, &req);
+      }
+      
+      return in ? len : 0;
+    }
+  }
+  
+  return usbsim_standard_request(setup);
+}
+
+bool usbsim_out_packet(uint8_t addr, const uint8_t *data, size_t len)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  if (ep->count >= ep->depth || len > ep->max_size)
+  {
+    return false;
+  }
+  
+  usbsim_push(ep, data, len);
+  if (ep->callback)
+  {
+    ep->callback(&g_usbsim_device, addr);
+  }
+  
+  return true;
+}
+
+int usbsim_in_packet(uint8_t addr, uint8_t *data)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  if (ep->count == 0)
+  {
+    return -1;
+  }
+  
+  int len = usbsim_pop(ep, data, USBSIM_MAX_PACKET);
+  if (ep->callback)
+  {
+    ep->callback(&g_usbsim_device, addr);
+  }
+  
+  return len;
+}
+
+size_t usbsim_packet_size(uint8_t addr)
+{
+  usbsim_endpoint_t *ep = usbsim_endpoint(addr);
+  return ep->depth ? ep->max_size : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef USBSIM_H
+#define USBSIM_H
+
+/* Simulated USB device controller for running usbnet.c on a host. It
+ * implements the libopencm3 USB device API and usb_dblbuf.h, and the host
+ * side of the bus is driven through the functions below. Endpoint
+ * callbacks are called from these, like the USB interrupt would call
+ * them on the device.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <libopencm3/usb/usbd.h>
+
+/* Run a control transfer. For OUT requests data holds the wLength bytes
+ * of the data stage, for IN requests the reply is copied to data, at most
+ * wLength bytes. Returns the length of the data stage, or -1 if the
+ * request was stalled.
+ */
+int usbsim_control(const struct usb_setup_data *setup, uint8_t *data);
+
+/* Send one packet of at most the endpoint size to an OUT endpoint.
+ * Returns false if the endpoint NAKed it because its buffers are full.
+ */
+bool usbsim_out_packet(uint8_t ep, const uint8_t *data, size_t len);
+
+/* Read the next packet from an IN endpoint to data.
+ * Returns its length, or -1 if the endpoint NAKed because it had none.
+ */
+int usbsim_in_packet(uint8_t ep, uint8_t *data);
+
+/* Maximum packet size of an endpoint, or 0 if it has not been set up */
+size_t usbsim_packet_size(uint8_t ep);
+
+#endif
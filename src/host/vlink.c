@@ -0,0 +1,398 @@
+#include "vlink.h"
+#include "pcap.h"
+#include "usbnet.h"
+#include "tcpip.h"
+#include "events.h"
+#include "capture.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "debug.h"
+
+/* Same memory as the firmware has, so that buffer shortages behave the
+ * same way. */
+static struct {buffer_t buf; uint8_t data[USBNET_BUFFER_SIZE];} g_vlink_bigbuffers[USBNET_BUFFER_COUNT];
+static struct {buffer_t buf; uint8_t data[USBNET_SMALLBUF_SIZE];} g_vlink_smallbuffers[USBNET_SMALLBUF_COUNT];
+
+static bufferqueue_t g_vlink_transmit_queue[USBNET_PRIO_COUNT];
+static uint8_t g_vlink_control_burst;
+static uint8_t g_vlink_transmit_peak;
+static bool g_vlink_tx_completed;
+static usbnet_tx_callback_t g_vlink_tx_callback;
+static bufferqueue_t g_vlink_received;
+
+static pcap_file_t g_vlink_input;
+static pcap_file_t g_vlink_output;
+static int g_vlink_socket = -1;
+static struct sockaddr_un g_vlink_peer;
+static socklen_t g_vlink_peer_len;
+
+/* Frame read from the input that did not get a buffer yet */
+static uint8_t g_vlink_pending[USBNET_MAX_FRAME_SIZE];
+static size_t g_vlink_pending_size;
+static systime_t g_vlink_nak_start;
+static uint16_t g_vlink_nak_count;
+static uint32_t g_vlink_nak_time;
+
+static vlink_stats_t g_vlink_stats;
+static unsigned g_vlink_loss_percent;
+static unsigned g_vlink_reorder_percent;
+static uint32_t g_vlink_random_state = 1;
+
+/* Received frame held back until the next one has been received */
+static uint8_t g_vlink_delayed[USBNET_MAX_FRAME_SIZE];
+static size_t g_vlink_delayed_size;
+static systime_t g_vlink_delay_start;
+static bool g_vlink_delay_overtaken;
+
+/* A delayed frame is released after this time even if no other frame
+ * arrives, microseconds */
+#define VLINK_REORDER_TIMEOUT 20000
+
+void vlink_init(uint32_t serialnumber)
+{
+  g_local_mac_addr.bytes[0] = 0xDE;
+  g_local_mac_addr.bytes[1] = (serialnumber >> 24) & 0xFF;
+  g_local_mac_addr.bytes[2] = (serialnumber >> 16) & 0xFF;
+  g_local_mac_addr.bytes[3] = (serialnumber >>  8) & 0xFF;
+  g_local_mac_addr.bytes[4] = (serialnumber >>  0) & 0xFF;
+  g_local_mac_addr.bytes[5] = 0xCC;
+  
+  g_local_ipv6_addr = (ipv6_addr_t){{
+    0xfd, 0xde,
+    (serialnumber >> 24) & 0xFF, (serialnumber >> 16) & 0xFF,
+    (serialnumber >>  8) & 0xFF, (serialnumber >>  0) & 0xFF,
+    0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01
+  }};
+  
+  buffer_add_pool(g_vlink_bigbuffers, USBNET_BUFFER_SIZE, USBNET_BUFFER_COUNT);
+  buffer_add_pool(g_vlink_smallbuffers, USBNET_SMALLBUF_SIZE, USBNET_SMALLBUF_COUNT);
+  buffer_reserve(BUFFER_CLASS_RX, USBNET_BUFFER_SIZE, USBNET_RX_RESERVE);
+  buffer_reserve(BUFFER_CLASS_CTRL, USBNET_SMALLBUF_SIZE, USBNET_CTRL_RESERVE);
+  buffer_set_limit(BUFFER_CLASS_TX, USBNET_TX_LIMIT);
+}
+
+bool vlink_open_pcap_input(const char *path)
+{
+  return pcap_open_read(&g_vlink_input, path, PCAP_LINKTYPE_ETHERNET);
+}
+
+bool vlink_open_pcap_output(const char *path)
+{
+  return pcap_open_write(&g_vlink_output, path, PCAP_LINKTYPE_ETHERNET);
+}
+
+bool vlink_open_socket(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    warn("Socket path too long: %s", path);
+    return false;
+  }
+  
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  
+  g_vlink_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (g_vlink_socket < 0 || bind(g_vlink_socket, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    warn("Cannot bind socket %s", path);
+    return false;
+  }
+  
+  fcntl(g_vlink_socket, F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+/*************************
+ * Virtual link transfer *
+ *************************/
+
+void vlink_set_loss(unsigned percent)
+{
+  g_vlink_loss_percent = percent;
+}
+
+void vlink_set_reorder(unsigned percent)
+{
+  g_vlink_reorder_percent = percent;
+}
+
+/* Returns true with the given probability */
+static bool vlink_random_event(unsigned percent)
+{
+  if (!percent)
+  {
+    return false;
+  }
+  
+  g_vlink_random_state = g_vlink_random_state * 1103515245 + 12345;
+  return (g_vlink_random_state >> 16) % 100 < percent;
+}
+
+/* Hold back the pending frame, or release the delayed frame once another
+ * has passed it */
+static void vlink_reorder_input()
+{
+  if (g_vlink_pending_size && !g_vlink_delayed_size &&
+      vlink_random_event(g_vlink_reorder_percent))
+  {
+    memcpy(g_vlink_delayed, g_vlink_pending, g_vlink_pending_size);
+    g_vlink_delayed_size = g_vlink_pending_size;
+    g_vlink_delay_start = get_systime();
+    g_vlink_delay_overtaken = false;
+    g_vlink_pending_size = 0;
+    g_vlink_stats.rx_reordered++;
+  }
+  else if (g_vlink_pending_size && g_vlink_delayed_size)
+  {
+    g_vlink_delay_overtaken = true;
+  }
+  else if (!g_vlink_pending_size && g_vlink_delayed_size &&
+           (g_vlink_delay_overtaken ||
+            get_systime() - g_vlink_delay_start >= VLINK_REORDER_TIMEOUT))
+  {
+    memcpy(g_vlink_pending, g_vlink_delayed, g_vlink_delayed_size);
+    g_vlink_pending_size = g_vlink_delayed_size;
+    g_vlink_delayed_size = 0;
+  }
+}
+
+/* Read the next input frame to g_vlink_pending, if there is none yet */
+static bool vlink_read_input()
+{
+  if (g_vlink_pending_size)
+  {
+    return true;
+  }
+  
+  if (g_vlink_input.file)
+  {
+    g_vlink_pending_size = pcap_read(&g_vlink_input, g_vlink_pending, sizeof(g_vlink_pending));
+    if (!g_vlink_pending_size)
+    {
+      pcap_close(&g_vlink_input);
+    }
+  }
+  else if (g_vlink_socket >= 0)
+  {
+    struct sockaddr_un peer;
+    socklen_t peer_len = sizeof(peer);
+    ssize_t len = recvfrom(g_vlink_socket, g_vlink_pending, sizeof(g_vlink_pending),
+                           MSG_TRUNC, (struct sockaddr*)&peer, &peer_len);
+    if (len > (ssize_t)sizeof(g_vlink_pending))
+    {
+      warn("Dropping too long frame, size = %d", (int)len);
+    }
+    else if (len > 0)
+    {
+      g_vlink_pending_size = len;
+      g_vlink_peer = peer;
+      g_vlink_peer_len = peer_len;
+    }
+  }
+  
+  if (g_vlink_pending_size && vlink_random_event(g_vlink_loss_percent))
+  {
+    g_vlink_stats.rx_dropped++;
+    g_vlink_pending_size = 0;
+  }
+  
+  vlink_reorder_input();
+  return g_vlink_pending_size != 0;
+}
+
+static void vlink_receive_frames()
+{
+  while (vlink_read_input())
+  {
+    buffer_t *buffer = NULL;
+    if (bufferqueue_size(&g_vlink_received) < USBNET_MAX_RX_QUEUE)
+    {
+      buffer = buffer_allocate(g_vlink_pending_size, BUFFER_SITE_USBNET_RX);
+    }
+    
+    if (!buffer)
+    {
+      /* Wait like the USB endpoint would */
+      if (!g_vlink_nak_start)
+      {
+        g_vlink_nak_start = get_systime() | 1;
+        g_vlink_nak_count++;
+      }
+      return;
+    }
+    
+    if (g_vlink_nak_start)
+    {
+      g_vlink_nak_time += get_systime() - g_vlink_nak_start;
+      g_vlink_nak_start = 0;
+    }
+    
+    memcpy(buffer->data, g_vlink_pending, g_vlink_pending_size);
+    buffer->data_size = g_vlink_pending_size;
+    g_vlink_pending_size = 0;
+    
+    if (g_vlink_output.file)
+    {
+      pcap_write(&g_vlink_output, buffer->data, buffer->data_size);
+    }
+    
+    g_vlink_stats.rx_frames++;
+    g_vlink_stats.rx_bytes += buffer->data_size;
+    bufferqueue_push(&g_vlink_received, buffer);
+    events_signal(EVENT_USBNET_RX);
+  }
+}
+
+/* Control frames first, see usbnet.h */
+static buffer_t *vlink_tx_dequeue()
+{
+  bufferqueue_t *control = &g_vlink_transmit_queue[USBNET_PRIO_CONTROL];
+  bufferqueue_t *bulk = &g_vlink_transmit_queue[USBNET_PRIO_BULK];
+  
+  if (bufferqueue_size(bulk) == 0)
+  {
+    g_vlink_control_burst = 0;
+    return bufferqueue_pop(control);
+  }
+  else if (bufferqueue_size(control) == 0 ||
+           g_vlink_control_burst >= USBNET_MAX_CONTROL_BURST)
+  {
+    g_vlink_control_burst = 0;
+    return bufferqueue_pop(bulk);
+  }
+  else
+  {
+    g_vlink_control_burst++;
+    return bufferqueue_pop(control);
+  }
+}
+
+static void vlink_transmit_frames()
+{
+  static uint8_t frame[USBNET_BUFFER_SIZE];
+  buffer_t *buffer;
+  
+  while ((buffer = vlink_tx_dequeue()))
+  {
+    size_t size = buffer_frame_size(buffer);
+    const uint8_t *data = buffer_gather(buffer, 0, size, frame);
+    
+    if (g_vlink_output.file)
+    {
+      pcap_write(&g_vlink_output, data, size);
+    }
+    
+    if (vlink_random_event(g_vlink_loss_percent))
+    {
+      g_vlink_stats.tx_dropped++;
+    }
+    else if (g_vlink_socket >= 0 && g_vlink_peer_len > 0)
+    {
+      sendto(g_vlink_socket, data, size, 0, (struct sockaddr*)&g_vlink_peer, g_vlink_peer_len);
+    }
+    
+    g_vlink_stats.tx_frames++;
+    g_vlink_stats.tx_bytes += size;
+    buffer_release(buffer);
+    g_vlink_tx_completed = true;
+    events_signal(EVENT_USBNET_TX);
+  }
+}
+
+int vlink_service()
+{
+  vlink_transmit_frames();
+  vlink_receive_frames();
+  return g_vlink_socket;
+}
+
+bool vlink_is_idle()
+{
+  return !g_vlink_input.file && !g_vlink_pending_size && !g_vlink_delayed_size &&
+         bufferqueue_size(&g_vlink_received) == 0 &&
+         usbnet_get_tx_queue_size() == 0;
+}
+
+void vlink_get_stats(vlink_stats_t *stats)
+{
+  *stats = g_vlink_stats;
+}
+
+/*********************************
+ * usbnet.h interface for tcpip *
+ *********************************/
+
+bool usbnet_is_connected()
+{
+  return true;
+}
+
+void usbnet_transmit(buffer_t *buffer, usbnet_prio_t prio)
+{
+  capture_frame(buffer);
+  bufferqueue_push(&g_vlink_transmit_queue[prio], buffer);
+  
+  if (usbnet_get_tx_queue_size() > g_vlink_transmit_peak)
+  {
+    g_vlink_transmit_peak = usbnet_get_tx_queue_size();
+  }
+}
+
+size_t usbnet_get_tx_queue_size()
+{
+  return bufferqueue_size(&g_vlink_transmit_queue[USBNET_PRIO_CONTROL]) +
+         bufferqueue_size(&g_vlink_transmit_queue[USBNET_PRIO_BULK]);
+}
+
+size_t usbnet_get_tx_credit()
+{
+  size_t queued = usbnet_get_tx_queue_size();
+  return (queued < USBNET_TX_QUEUE_TARGET) ? USBNET_TX_QUEUE_TARGET - queued : 0;
+}
+
+void usbnet_register_tx_callback(usbnet_tx_callback_t callback)
+{
+  g_vlink_tx_callback = callback;
+}
+
+buffer_t *usbnet_receive()
+{
+  buffer_t *buffer = bufferqueue_pop(&g_vlink_received);
+  if (buffer)
+  {
+    capture_frame(buffer);
+  }
+  
+  return buffer;
+}
+
+void usbnet_get_stats(usbnet_stats_t *stats)
+{
+  stats->tx_queue = usbnet_get_tx_queue_size();
+  stats->tx_queue_peak = g_vlink_transmit_peak;
+  stats->rx_queue = bufferqueue_size(&g_vlink_received);
+  stats->rx_queue_peak = g_vlink_received.peak;
+  stats->rx_queue_limit = USBNET_MAX_RX_QUEUE;
+  stats->rx_nak_count = g_vlink_nak_count;
+  stats->rx_nak_time = g_vlink_nak_time;
+}
+
+void usbnet_poll()
+{
+  if (g_vlink_tx_completed && usbnet_get_tx_credit() > 0)
+  {
+    g_vlink_tx_completed = false;
+    
+    if (g_vlink_tx_callback)
+    {
+      g_vlink_tx_callback();
+    }
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef VLINK_H
+#define VLINK_H
+
+/* Virtual link for running the network stack on a host. It implements
+ * the usbnet.h interface, but the frames come from a pcap file or a UNIX
+ * datagram socket instead of USB. The link itself is infinitely fast, so
+ * measurements show the cost of the stack code.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Set up buffers and addresses the same way as usbnet_init() */
+void vlink_init(uint32_t serialnumber);
+
+/* Receive the frames of a pcap file, as fast as the stack takes them */
+bool vlink_open_pcap_input(const char *path);
+
+/* Record received and transmitted frames to a pcap file */
+bool vlink_open_pcap_output(const char *path);
+
+/* Exchange frames with a client over a UNIX datagram socket bound to path,
+ * one Ethernet frame per datagram. Frames are sent to the address the
+ * latest datagram came from.
+ */
+bool vlink_open_socket(const char *path);
+
+/* Drop the given percentage of frames in each direction, chosen
+ * pseudo-randomly but the same on every run. */
+void vlink_set_loss(unsigned percent);
+
+/* Deliver the given percentage of received frames after the frame that
+ * follows them. */
+void vlink_set_reorder(unsigned percent);
+
+/* Simulated USB interrupt: sends all queued frames and receives frames
+ * while the RX queue has room. Called from events_wait().
+ * Returns a file descriptor that becomes readable on new input, or -1.
+ */
+int vlink_service();
+
+/* Returns true when the pcap input has ended and no frames are queued */
+bool vlink_is_idle();
+
+typedef struct {
+  uint32_t rx_frames;
+  uint32_t tx_frames;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint32_t rx_dropped;
+  uint32_t tx_dropped;
+  uint32_t rx_reordered;
+} vlink_stats_t;
+
+void vlink_get_stats(vlink_stats_t *stats);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
 #include <ctype.h>
@@ -10,6 +11,23 @@
 
 static http_url_handler_t *g_http_url_handlers;
 
+/* The handler of the response in progress is kept after the context words
+ * of URL handlers as a uintptr_t, which takes two words on 64-bit hosts. */
+#define HTTP_HANDLER_WORDS (sizeof(uintptr_t) / sizeof(uint32_t))
+
+static http_callback_t http_get_handler(const tcpip_conn_t *conn)
+{
+  uintptr_t handler;
+  memcpy(&handler, &conn->context[HTTP_CONTEXT_WORDS], sizeof(handler));
+  return (http_callback_t)handler;
+}
+
+static void http_set_handler(tcpip_conn_t *conn, http_callback_t callback)
+{
+  uintptr_t handler = (uintptr_t)callback;
+  memcpy(&conn->context[HTTP_CONTEXT_WORDS], &handler, sizeof(handler));
+}
+
 static void http_dispatch(tcpip_conn_t *conn, http_request_t *request)
 {
   http_url_handler_t *handler = g_http_url_handlers;
@@ -17,7 +35,7 @@ static void http_dispatch(tcpip_conn_t *conn, http_request_t *request)
   {
     if (strcmp(handler->url, request->url) == 0)
     {
-      conn->context[TCPIP_CONTEXT_WORDS-1] = (uint32_t)handler->callback;
+      http_set_handler(conn, handler->callback);
       handler->callback(conn, request);
       return;
     }
@@ -86,16 +104,16 @@ static bool handle_new_request(tcpip_conn_t *conn, buffer_t *payload)
   request.body_data = (uint8_t*)p;
   request.body_length = (end - p);
   
-  dbg("HTTP URL: %s, QS: %s, body_len: %d", request.url, request.query_string, request.body_length);
+  dbg("HTTP URL: %s, QS: %s, body_len: %d", request.url, request.query_string, (int)request.body_length);
   http_dispatch(conn, &request);
   return true;
 }
 
 static void handle_http_connection(tcpip_conn_t *conn, buffer_t *payload)
 {
-  http_callback_t callback = (http_callback_t)conn->context[TCPIP_CONTEXT_WORDS - 1];
+  http_callback_t callback = http_get_handler(conn);
   
-  if (conn->state == TCPIP_ESTABLISHED)
+  if (conn->state == TCPIP_ESTABLISHED || conn->state == TCPIP_CLOSE_WAIT)
   {
     if (!callback)
     {
@@ -107,19 +125,52 @@ static void handle_http_connection(tcpip_conn_t *conn, buffer_t *payload)
         {
           warn("HTTP closing after invalid request");
           tcpip_close(conn);
+          return;
         }
       }
     }
     else
     {
+      if (payload)
+      {
+        /* Requests are not queued while a response is in progress, as
+         * holding the buffer would take it from the response. The peer
+         * would wait for an answer forever, so end the connection and
+         * let it retry the request on a new one. */
+        warn("HTTP closing after a request during a response");
+        tcpip_release(payload);
+        tcpip_close(conn);
+        return;
+      }
+      
       callback(conn, NULL);
     }
+    
+    if (http_get_handler(conn))
+    {
+      /* Response still in progress, continue when there is transmit credit */
+      if (conn->state == TCPIP_ESTABLISHED || conn->state == TCPIP_CLOSE_WAIT)
+      {
+        tcpip_wait_tx(conn);
+      }
+    }
+    else if (conn->state == TCPIP_CLOSE_WAIT)
+    {
+      /* Peer has no more requests and the last response is sent */
+      tcpip_close(conn);
+    }
+  }
+  else if (callback)
+  {
+    /* Closed or reset during a response, let the handler clean up */
+    http_set_handler(conn, NULL);
+    callback(conn, NULL);
   }
 }
 
 void http_init()
 {
-  tcpip_register_listener(80, handle_http_connection);
+  tcpip_register_listener(80, handle_http_connection, HTTP_CONTEXT_WORDS + HTTP_HANDLER_WORDS);
 }
 
 void http_add_url_handler(http_url_handler_t* handler)
@@ -128,60 +179,95 @@ void http_add_url_handler(http_url_handler_t* handler)
   g_http_url_handlers = handler;
 }
 
+/* Write a line of atmost 63 characters to the response */
+static bool http_printf(tcpip_conn_t *conn, const char *fmt, ...)
+{
+  char buf[64];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  
+  return len >= 0 && len < (int)sizeof(buf) && tcpip_write(conn, buf, len) == (size_t)len;
+}
+
 void http_start_response(tcpip_conn_t* conn, int status,
                          const char *mime_type, const char* body_data,
                          bool response_done)
 {
   dbg("HTTP starting response, status=%d", status);
   
+  /* The headers are written to the connection's segment buffer, which
+   * sends them together with the start of the body. */
   size_t body_len = strlen(body_data);
-  buffer_t *payload = tcpip_allocate(256 + body_len);
-  if (!payload)
-  {
-    warn("HTTP could not allocate buffer for response");
-    tcpip_close(conn);
-    return;
-  }
-  
-  buffer_printf(payload, "HTTP/1.1 %d %s\r\n"
-                         "Content-Type: %s\r\n"
-                         "Connection: keep-alive\r\n",
-                         status, (status == 200) ? "OK" : "Error", mime_type);
+  bool ok = http_printf(conn, "HTTP/1.1 %d %s\r\n", status, (status == 200) ? "OK" : "Error") &&
+            http_printf(conn, "Content-Type: %s\r\n", mime_type) &&
+            http_printf(conn, "Connection: keep-alive\r\n");
   
   if (body_len)
   {
     if (response_done)
     {
-      buffer_printf(payload, "Content-Length: %d\r\n"
-                             "\r\n"
-                             "%s\r\n",
-                    body_len, body_data);
-      
-      conn->context[TCPIP_CONTEXT_WORDS-1] = 0;
+      ok = ok && http_printf(conn, "Content-Length: %d\r\n\r\n", (int)body_len);
+      http_set_handler(conn, NULL);
       
-      dbg("HTTP response_done, len = %d", body_len);
+      dbg("HTTP response_done, len = %d", (int)body_len);
     }
     else
     {
-      buffer_printf(payload, "Transfer-Encoding: chunked\r\n"
-                             "\r\n"
-                             "%08x\r\n"
-                             "%s\r\n",
-                    body_len, body_data);
+      ok = ok && http_printf(conn, "Transfer-Encoding: chunked\r\n\r\n%08x\r\n", (int)body_len);
     }
+    
+    ok = ok && tcpip_write(conn, body_data, body_len) == body_len &&
+         http_printf(conn, "\r\n");
   }
   else
   {
-    buffer_printf(payload, "Transfer-Encoding: chunked\r\n"
-                           "\r\n");
+    ok = ok && http_printf(conn, "Transfer-Encoding: chunked\r\n\r\n");
+  }
+  
+  if (!ok)
+  {
+    warn("HTTP no room to send response");
+    tcpip_close(conn);
+    return;
+  }
+  
+  /* Streamed responses are not reset to make room for new connections */
+  tcpip_set_evictable(conn, !http_get_handler(conn));
+  
+  if (!http_get_handler(conn))
+  {
+    tcpip_push(conn);
+  }
+}
+
+size_t http_chunk_limit(const tcpip_conn_t *conn)
+{
+  size_t overhead = HTTP_CHUNK_HEADER_SIZE + HTTP_CHUNK_TRAILER_SIZE;
+  size_t mss = tcpip_max_segment(conn);
+  return (mss > overhead) ? mss - overhead : 0;
+}
+
+size_t http_chunk_space(tcpip_conn_t *conn)
+{
+  size_t overhead = HTTP_CHUNK_HEADER_SIZE + HTTP_CHUNK_TRAILER_SIZE;
+  size_t space = tcpip_send_space(conn);
+  size_t limit = http_chunk_limit(conn);
+  
+  if (usbnet_get_tx_credit() == 0 || space <= overhead)
+  {
+    return 0;
   }
   
-  tcpip_send(conn, payload);
+  space -= overhead;
+  return (space < limit) ? space : limit;
 }
 
 buffer_t *http_allocate_chunk(size_t size)
 {
-  buffer_t *outer = tcpip_allocate(HTTP_CHUNK_HEADER_SIZE + size + HTTP_CHUNK_TRAILER_SIZE);
+  buffer_t *outer = tcpip_allocate(HTTP_CHUNK_HEADER_SIZE + size + HTTP_CHUNK_TRAILER_SIZE,
+                                  BUFFER_SITE_HTTP_CHUNK);
   if (outer)
   {
     return buffer_slice(outer, HTTP_CHUNK_HEADER_SIZE, HTTP_CHUNK_TRAILER_SIZE);
@@ -199,32 +285,49 @@ void http_release_chunk(buffer_t* chunk)
 
 void http_send_chunk(tcpip_conn_t* conn, buffer_t* chunk)
 {
-  size_t chunklen = chunk->data_size;
+  size_t chunklen = buffer_frame_size(chunk);
   buffer_t *outer = buffer_unslice(chunk, HTTP_CHUNK_HEADER_SIZE, HTTP_CHUNK_TRAILER_SIZE);
   
-  snprintf((char*)&outer->data[0], HTTP_CHUNK_HEADER_SIZE, "%08x\r", chunklen);
-  outer->data[9] = '\n';
+  memset(outer->data, '0', HTTP_CHUNK_HEADER_SIZE - 10);
+  snprintf((char*)&outer->data[HTTP_CHUNK_HEADER_SIZE - 10], 10, "%08x\r", (unsigned)chunklen);
+  outer->data[HTTP_CHUNK_HEADER_SIZE - 1] = '\n';
   outer->data[outer->data_size - 2] = '\r';
   outer->data[outer->data_size - 1] = '\n';
-  tcpip_send(conn, outer);
+  
+  if (!tcpip_send(conn, outer))
+  {
+    /* The response would have a gap */
+    tcpip_close(conn);
+  }
+}
+
+bool http_send_static_chunk(tcpip_conn_t* conn, const void *data, size_t size)
+{
+  buffer_t *chunk = http_allocate_chunk(0);
+  if (!chunk)
+  {
+    return false;
+  }
+  
+  buffer_attach(chunk, data, size);
+  http_send_chunk(conn, chunk);
+  return true;
 }
 
 void http_send_last_chunk(tcpip_conn_t* conn)
 {
   dbg("HTTP finishing response");
   
-  buffer_t *payload = tcpip_allocate(5);
-  if (!payload)
+  if (tcpip_write(conn, "0\r\n\r\n", 5) != 5)
   {
     tcpip_close(conn);
     return;
   }
   
-  payload->data_size = 5;
-  memcpy(payload->data, "0\r\n\r\n", 5);
-  tcpip_send(conn, payload);
+  tcpip_push(conn);
   
-  conn->context[TCPIP_CONTEXT_WORDS-1] = 0;
+  http_set_handler(conn, NULL);
+  tcpip_set_evictable(conn, true);
 }
 
 
@@ -3,10 +3,14 @@
 
 #include "tcpip.h"
 
-#define HTTP_CHUNK_HEADER_SIZE 10
+/* Chunk length in hex and CRLF. The chunk is a slice, so the header must
+ * also hold a buffer_t, which is larger on 64-bit hosts. */
+#define HTTP_CHUNK_HEADER_SIZE (sizeof(buffer_t) > 10 ? sizeof(buffer_t) : 10)
 #define HTTP_CHUNK_TRAILER_SIZE 2
 #define HTTP_CHUNK_SIZE (TCPIP_MAX_PAYLOAD-HTTP_CHUNK_HEADER_SIZE-HTTP_CHUNK_TRAILER_SIZE)
-#define HTTP_CONTEXT_WORDS (TCPIP_CONTEXT_WORDS - 1)
+/* Words of conn->context available to URL handlers. http keeps the
+ * handler of the response in progress in the words after them. */
+#define HTTP_CONTEXT_WORDS 3
 
 typedef enum {
   HTTP_GET,
@@ -24,8 +28,11 @@ typedef struct {
 /* Callback for request handling. The first call for a new request will have
  * the request parameter non-NULL. The callback should then call http_start_response().
  * It can either finish in a single call by passing response_done = true, or it can return
- * and receive periodic callbacks with request = NULL and send body data with
- * http_send_chunk() and finish with http_send_last_chunk().
+ * and receive callbacks with request = NULL whenever there is transmit credit, and send
+ * body data with http_send_chunk() and finish with http_send_last_chunk().
+ * If the connection is closed or reset before that, it gets one more call
+ * with request = NULL and conn->state other than TCPIP_ESTABLISHED or
+ * TCPIP_CLOSE_WAIT, and must not send.
  */
 typedef void (*http_callback_t)(tcpip_conn_t *conn, http_request_t *request);
 
@@ -45,6 +52,15 @@ void http_start_response(tcpip_conn_t *conn, int status,
                          const char *mime_type, const char *body_data,
                          bool response_done);
 
+/* Largest chunk that fits in one segment to the peer, atmost
+ * HTTP_CHUNK_SIZE */
+size_t http_chunk_limit(const tcpip_conn_t *conn);
+
+/* Size of the largest chunk the connection can send now, atmost
+ * http_chunk_limit(). Returns 0 if there is no transmit credit or the send
+ * space does not fit a chunk. */
+size_t http_chunk_space(tcpip_conn_t *conn);
+
 /* Allocate / release buffers that can be passed to http_send_chunk */
 buffer_t *http_allocate_chunk(size_t size);
 void http_release_chunk(buffer_t *chunk);
@@ -52,6 +68,14 @@ void http_release_chunk(buffer_t *chunk);
 /* Send response body chunk */
 void http_send_chunk(tcpip_conn_t *conn, buffer_t *chunk);
 
+/* Send response body chunk that refers to read-only data, such as flash.
+ * The data is not copied and must stay valid until the peer has
+ * acknowledged it.
+ * Size can be at most http_chunk_limit().
+ * Returns false if no buffer was available, in which case nothing was sent.
+ */
+bool http_send_static_chunk(tcpip_conn_t *conn, const void *data, size_t size);
+
 /* Send response end chunk */
 void http_send_last_chunk(tcpip_conn_t *conn);
 
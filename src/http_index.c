@@ -1,7 +1,10 @@
 #include "http_index.h"
 #include "http.h"
 #include "systime.h"
+#include "usbnet.h"
+#include "capture.h"
 #include <stdio.h>
+#include <libopencm3/stm32/memorymap.h>
 
 void http_index(tcpip_conn_t *conn, http_request_t *request)
 {
@@ -11,48 +14,218 @@ void http_index(tcpip_conn_t *conn, http_request_t *request)
   http_start_response(conn, 200, "text/plain", buf, true);
 }
 
+/* Size of the STM32F042 flash */
+#define FIRMWARE_SIZE 32768
+
 void http_firmware_bin(tcpip_conn_t *conn, http_request_t *request)
 {
   if (request)
   {
     http_start_response(conn, 200, "application/octet-stream", "", false);
-    conn->context[0] = 0x08000000;
+    conn->context[0] = 0;
   }
-  else if (usbnet_get_tx_queue_size() < 2)
+  else
   {
-    buffer_t *chunk = http_allocate_chunk(HTTP_CHUNK_SIZE);
-    if (chunk)
+    /* Flash is memory mapped, so chunks refer to it directly */
+    const uint8_t *flash = (const uint8_t*)FLASH_BASE;
+    
+    size_t space;
+    while ((space = http_chunk_space(conn)) > 0)
     {
       uint32_t pos = conn->context[0];
-      uint32_t end = 0x08000000 + 32768;
+      size_t max_len = FIRMWARE_SIZE - pos;
+      if (max_len > space)
+      {
+        max_len = space;
+      }
+      
+      if (max_len == 0)
+      {
+        http_send_last_chunk(conn);
+        break;
+      }
+      
+      if (!http_send_static_chunk(conn, flash + pos, max_len))
+      {
+        break;
+      }
+      
+      conn->context[0] = pos + max_len;
+    }
+  }
+}
+
+static const char *g_buffer_site_names[BUFFER_SITE_COUNT] = {
+  [BUFFER_SITE_USBNET_RX]       = "usbnet_rx",
+  [BUFFER_SITE_RNDIS_RESPONSE]  = "rndis_response",
+  [BUFFER_SITE_TCPIP_CTRL]      = "tcpip_ctrl",
+  [BUFFER_SITE_TCPIP_TX]        = "tcpip_tx",
+  [BUFFER_SITE_HTTP_CHUNK]      = "http_chunk",
+};
+
+/* Buffer allocator statistics. The text version has one line per pool and
+ * per allocation site. The binary version has the pool count and site count
+ * as bytes, followed by the packed little-endian buffer_pool_stats_t and
+ * buffer_site_stats_t structures, and finally usbnet_stats_t and
+ * tcpip_stats_t. */
+static void http_buffer_stats(tcpip_conn_t *conn, http_request_t *request, bool binary)
+{
+  if (conn->state != TCPIP_ESTABLISHED && conn->state != TCPIP_CLOSE_WAIT)
+  {
+    /* Connection ended during the response */
+    return;
+  }
+  
+  if (request)
+  {
+    http_start_response(conn, 200, binary ? "application/octet-stream" : "text/plain", "", false);
+    conn->context[0] = 0;
+  }
+  else if (conn->context[0])
+  {
+    http_send_last_chunk(conn);
+  }
+  else if (http_chunk_space(conn) == http_chunk_limit(conn))
+  {
+    buffer_t *chunk = http_allocate_chunk(http_chunk_limit(conn));
+    if (chunk)
+    {
+      buffer_stats_t stats;
+      usbnet_stats_t netstats;
+      tcpip_stats_t tcpstats;
+      buffer_get_stats(&stats);
+      usbnet_get_stats(&netstats);
+      tcpip_get_stats(&tcpstats);
+      
+      if (binary)
+      {
+        uint8_t counts[2] = {stats.pool_count, BUFFER_SITE_COUNT};
+        buffer_append(chunk, counts, sizeof(counts));
+        buffer_append(chunk, stats.pools, stats.pool_count * sizeof(buffer_pool_stats_t));
+        buffer_append(chunk, stats.sites, sizeof(stats.sites));
+        buffer_append(chunk, &netstats, sizeof(netstats));
+        buffer_append(chunk, &tcpstats, sizeof(tcpstats));
+      }
+      else
+      {
+        for (int i = 0; i < stats.pool_count; i++)
+        {
+          buffer_printf(chunk, "pool %u: count %u, in_use %u, high_water %u\n",
+                        (unsigned)stats.pools[i].max_size, (unsigned)stats.pools[i].count,
+                        (unsigned)stats.pools[i].in_use, (unsigned)stats.pools[i].high_water);
+        }
+        
+        for (int i = 0; i < BUFFER_SITE_COUNT; i++)
+        {
+          buffer_printf(chunk, "site %s: failures %u, max_hold_us %u\n",
+                        g_buffer_site_names[i], (unsigned)stats.sites[i].failures,
+                        (unsigned)stats.sites[i].max_hold_time);
+        }
+        
+        buffer_printf(chunk, "usbnet tx_queue %u, tx_queue_peak %u, rx_queue %u, rx_queue_peak %u\n",
+                      netstats.tx_queue, netstats.tx_queue_peak,
+                      netstats.rx_queue, netstats.rx_queue_peak);
+        buffer_printf(chunk, "usbnet rx_queue_limit %u, rx_nak_count %u, rx_nak_us %u\n",
+                      netstats.rx_queue_limit, (unsigned)netstats.rx_nak_count,
+                      (unsigned)netstats.rx_nak_time);
+        buffer_printf(chunk, "tcp pure_acks %u, piggybacked_acks %u\n",
+                      (unsigned)tcpstats.pure_acks, (unsigned)tcpstats.piggybacked_acks);
+      }
+      
+      http_send_chunk(conn, chunk);
+      conn->context[0] = 1;
+    }
+  }
+}
+
+void http_buffers_txt(tcpip_conn_t *conn, http_request_t *request)
+{
+  http_buffer_stats(conn, request, false);
+}
+
+void http_buffers_bin(tcpip_conn_t *conn, http_request_t *request)
+{
+  http_buffer_stats(conn, request, true);
+}
+
+#if CAPTURE_ENABLE
+/* Frames in the capture ring as a pcap file. The range to send is fixed
+ * when the request arrives, and frames overwritten before they are sent
+ * are left out. The download's own frames are not captured, until it
+ * finishes or the connection ends. */
+void http_capture_pcap(tcpip_conn_t *conn, http_request_t *request)
+{
+  if (request)
+  {
+    capture_exclude_port(conn->peer_port);
+    conn->context[0] = capture_first_seq();
+    conn->context[1] = capture_next_seq();
+    conn->context[2] = 0;
+    http_start_response(conn, 200, "application/vnd.tcpdump.pcap", "", false);
+  }
+  else if (conn->state != TCPIP_ESTABLISHED && conn->state != TCPIP_CLOSE_WAIT)
+  {
+    capture_include_port(conn->peer_port);
+  }
+  else
+  {
+    size_t space;
+    while ((space = http_chunk_space(conn)) >= CAPTURE_PCAP_HEADER_SIZE + CAPTURE_PCAP_RECORD_MAX)
+    {
+      if (conn->context[2] && conn->context[0] == conn->context[1])
+      {
+        capture_include_port(conn->peer_port);
+        http_send_last_chunk(conn);
+        break;
+      }
+      
+      buffer_t *chunk = http_allocate_chunk(space);
+      if (!chunk)
+      {
+        break;
+      }
       
-      size_t max_len = end - pos;
-      if (max_len > chunk->max_size)
+      if (!conn->context[2])
       {
-        max_len = chunk->max_size;
+        capture_pcap_header(chunk);
+        conn->context[2] = 1;
       }
       
-      if (max_len > 0)
+      while (conn->context[0] != conn->context[1] &&
+             chunk->data_size + CAPTURE_PCAP_RECORD_MAX <= space)
+      {
+        capture_pcap_record(chunk, conn->context[0]);
+        conn->context[0]++;
+      }
+      
+      if (chunk->data_size > 0)
       {
-        memcpy(chunk->data, (void*)pos, max_len);
-        chunk->data_size = max_len;
-        conn->context[0] = pos + max_len;
         http_send_chunk(conn, chunk);
       }
       else
       {
         http_release_chunk(chunk);
-        http_send_last_chunk(conn);
       }
     }
   }
 }
+#endif
 
 static http_url_handler_t g_index_handler = {NULL, "/", http_index};
 static http_url_handler_t g_firmware_bin = {NULL, "/api/firmware.bin", http_firmware_bin};
+static http_url_handler_t g_buffers_txt = {NULL, "/api/buffers", http_buffers_txt};
+static http_url_handler_t g_buffers_bin = {NULL, "/api/buffers.bin", http_buffers_bin};
+#if CAPTURE_ENABLE
+static http_url_handler_t g_capture_pcap = {NULL, "/api/capture.pcap", http_capture_pcap};
+#endif
 
 void http_index_init()
 {
   http_add_url_handler(&g_index_handler);
   http_add_url_handler(&g_firmware_bin);
+  http_add_url_handler(&g_buffers_txt);
+  http_add_url_handler(&g_buffers_bin);
+#if CAPTURE_ENABLE
+  http_add_url_handler(&g_capture_pcap);
+#endif
 }
@@ -6,27 +6,46 @@
 #include "tcpip_diagnostics.h"
 #include "http.h"
 #include "http_index.h"
+#include "events.h"
 #include <libopencm3/stm32/st_usbfs.h>
 
+static usbd_device *g_usbd_dev;
+
+/* USB endpoints are serviced in the interrupt. The network stack runs in
+ * the main loop, which sleeps until an event wakes it up. */
+void usb_isr()
+{
+  usbd_poll(g_usbd_dev);
+}
+
+void sys_tick_handler()
+{
+  events_signal(EVENT_TIMER);
+}
+
 int main(void)
 {
-  usbd_device *usbd_dev;
-  
   board_initialize();
   
   printf("Boot!\n");
   
-  usbd_dev = usbnet_init(&st_usbfs_v2_usb_driver, 0xD4000001);
+  g_usbd_dev = usbnet_init(&st_usbfs_v2_usb_driver, 0xD4000001);
+  tcpip_init();
   http_init();
   
   http_index_init();
   tcpip_diagnostics_init();
   
+  board_enable_interrupts(EVENTS_TICK_HZ);
+  
   while (1)
   {
-    usbd_poll(usbd_dev);
-    usbnet_poll();
+    events_wait();
+    
+    /* tcpip goes first so that usbnet can resume receiving into the
+     * buffers it released. */
     tcpip_poll();
+    usbnet_poll();
   }
 }
 
@@ -89,6 +89,13 @@ typedef struct {
 #define TCPIP_CONTROL_FIN 0x0001
 #define TCPIP_CONTROL_MASK 0x0FFF
 
+/* TCP option kinds, RFC 793, RFC 7323 and RFC 2018 */
+#define TCPIP_OPTION_END 0
+#define TCPIP_OPTION_NOP 1
+#define TCPIP_OPTION_MSS 2
+#define TCPIP_OPTION_WSCALE 3
+#define TCPIP_OPTION_SACK_PERMITTED 4
+
 /* RFC4443 ICMP6 header */
 typedef struct {
   uint8_t type;
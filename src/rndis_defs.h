@@ -77,6 +77,8 @@
 #define RNDIS_STATUS_BUFFER_OVERFLOW		0x80000005
 
 #define	RNDIS_STATUS_FAILURE			0xC0000001
+#define RNDIS_STATUS_INVALID_LENGTH		0xC0010014
+#define RNDIS_STATUS_INVALID_DATA		0xC0010015
 #define RNDIS_STATUS_RESOURCES			0xC000009A
 #define	RNDIS_STATUS_NOT_SUPPORTED		0xc00000BB
 #define RNDIS_STATUS_CLOSING			0xC0010002
@@ -8,6 +8,9 @@
 
 #include "rndis_defs.h"
 
+/* Messages are built directly in buffers, which are not word aligned */
+#pragma pack(push,1)
+
 struct rndis_notification {
   uint32_t Notification;
   uint32_t Reserved;
@@ -98,4 +101,6 @@ struct rndis_packet_msg {
   uint32_t Padding[7];
 };
 
+#pragma pack(pop)
+
 #endif
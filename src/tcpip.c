@@ -7,24 +7,138 @@
 
 /* #define DEBUG */
 #include "debug.h"
+#include "events.h"
 
 ipv6_addr_t g_local_ipv6_addr;
 mac_addr_t g_local_mac_addr;
 tcpip_conn_t g_tcpip_connections[TCPIP_MAX_CONNECTIONS];
 tcpip_listener_t g_tcpip_listeners[TCPIP_MAX_LISTENERS];
+static tcpip_stats_t g_tcpip_stats;
+
+/* Retransmission, congestion control and reassembly state of a
+ * connection, RFC 5681 and RFC 6298. 64 bytes on Cortex-M0. */
+typedef struct {
+  /* Unacknowledged data segments, oldest first */
+  buffer_t *rtx_queue[TCPIP_RTX_QUEUE];
+  
+  /* Received segments that start after rx_sequence, in sequence order */
+  buffer_t *ooo_queue[TCPIP_OOO_QUEUE];
+  
+  /* Payload that tcpip_write() is filling, and the time of its first write */
+  buffer_t *write_segment;
+  systime_t write_time;
+  
+  uint16_t cwnd; /* Congestion window */
+  uint16_t ssthresh;
+  uint8_t owner; /* Index of the connection, or TCPIP_NONE */
+  uint8_t rtx_count;
+  uint8_t rtx_retries; /* Timeouts of the oldest segment, or window probes */
+  uint8_t dup_acks;
+  uint8_t ooo_count;
+  bool rtt_active; /* Segment ending at rtt_sequence is being timed */
+  bool recovering; /* Resending lost segments up to recover_sequence */
+  systime_t rtx_time; /* Start of retransmission timer */
+  systime_t rto;
+  systime_t srtt;
+  systime_t rttvar;
+  systime_t rtt_start;
+  uint32_t rtt_sequence;
+  uint32_t recover_sequence;
+} tcpip_transfer_t;
+
+static tcpip_transfer_t g_tcpip_transfers[TCPIP_TRANSFER_BLOCKS];
+
+/* Connections and TIME_WAIT entries refer to their peer by index, as
+ * there are usually only one or two addresses on the link. */
+typedef struct {
+  ipv6_addr_t addr;
+  mac_addr_t mac;
+  uint8_t refcount;
+} tcpip_peer_t;
+
+static tcpip_peer_t g_tcpip_peers[TCPIP_MAX_PEERS];
+
+/* A received SYN only needs enough state to repeat the SYN-ACK and to
+ * recognize the ACK that completes the handshake. */
+typedef struct {
+  uint16_t peer_port;
+  uint16_t peer_window;
+  uint16_t peer_mss;
+  uint8_t peer_wscale;
+  bool window_scaling;
+  uint32_t tx_sequence; /* Our initial sequence number */
+  uint32_t rx_sequence; /* Peer's initial sequence number + 1 */
+  systime_t time;
+  uint8_t peer;
+  uint8_t listener; /* TCPIP_NONE when the entry is free */
+  bool sack_permitted;
+} tcpip_backlog_t;
+
+static tcpip_backlog_t g_tcpip_backlog[TCPIP_LISTEN_BACKLOG];
+
+/* Application context of the connections, with a bit for each used word */
+static uint32_t g_tcpip_context_pool[TCPIP_CONTEXT_POOL_WORDS];
+static uint32_t g_tcpip_context_used[(TCPIP_CONTEXT_POOL_WORDS + 31) / 32];
 
 /************************
  * Checksum calculation *
  ************************/
 
-static uint32_t ipsum(void *data, size_t length)
+/* Sum of bytes as big-endian 16-bit words, when the data starts at
+ * the given position of the summed range. */
+static uint32_t ipsum_at(const void *data, size_t length, size_t pos)
 {
   uint32_t sum = 0;
-  uint8_t *bytes = data;
-  for (size_t i = 0; i < length; i++)
+  const uint8_t *bytes = data;
+  size_t i = 0;
+  
+  if (((uintptr_t)data & 1) == 0 && (pos & 1) == 0)
+  {
+    /* Received frames are aligned, so most of the data can be summed with
+     * halfword loads. These give the words byte-swapped, which the one's
+     * complement sum allows swapping back after folding. */
+    const uint16_t *words = data;
+    uint32_t swapped = 0;
+    for (; i + 1 < length; i += 2)
+    {
+      swapped += *words++;
+    }
+    
+    swapped = (swapped & 0xFFFF) + (swapped >> 16);
+    swapped = (swapped & 0xFFFF) + (swapped >> 16);
+    sum = ((swapped & 0xFF) << 8) | (swapped >> 8);
+  }
+  
+  for (; i < length; i++)
+  {
+    sum += (uint32_t)bytes[i] << (((pos + i) & 1) ? 0 : 8);
+  }
+  return sum;
+}
+
+static uint32_t ipsum(const void *data, size_t length)
+{
+  return ipsum_at(data, length, 0);
+}
+
+/* Sum length bytes of the frame starting at start, including any external
+ * data attached to the buffer. */
+static uint32_t frame_ipsum(const buffer_t *packet, size_t start, size_t length)
+{
+  size_t offset;
+  const uint8_t *ext;
+  size_t ext_size = buffer_get_ext(packet, &offset, &ext);
+  
+  if (ext_size == 0)
   {
-    sum += (uint32_t)bytes[i] << ((i & 1) ? 0 : 8);
+    return ipsum(&packet->data[start], length);
   }
+  
+  assert(start <= offset && start + length >= offset + ext_size);
+  size_t head = offset - start;
+  uint32_t sum = ipsum(&packet->data[start], head);
+  sum += ipsum_at(ext, ext_size, head);
+  sum += ipsum_at(&packet->data[offset], length - head - ext_size, head + ext_size);
   return sum;
 }
 
@@ -51,8 +165,9 @@ static buint16_t icmp_checksum(ipv6_header_t *hdr)
   return foldsum(sum);
 }
 
-static buint16_t tcp_checksum(ipv6_header_t *hdr)
+static buint16_t tcp_checksum(buffer_t *packet)
 {
+  ipv6_header_t *hdr = (ipv6_header_t*)&packet->data[sizeof(ethernet_header_t)];
   ((tcp_header_t*)(hdr+1))->checksum = uint16_to_buint16(0);
   
   uint32_t sum = 0;
@@ -60,7 +175,8 @@ static buint16_t tcp_checksum(ipv6_header_t *hdr)
   sum += ipsum(&hdr->dest, sizeof(ipv6_addr_t));
   sum += ipsum(&hdr->payload_length, 2);
   sum += hdr->next_header;
-  sum += ipsum(hdr + 1, buint16_to_uint16(hdr->payload_length));
+  sum += frame_ipsum(packet, sizeof(ethernet_header_t) + sizeof(ipv6_header_t),
+                     buint16_to_uint16(hdr->payload_length));
   return foldsum(sum);
 }
 
@@ -134,7 +250,7 @@ static void send_neighbor_advertisement(buffer_t *packet)
   if (!packet)
   {
     // Unsolicited advert
-    packet = buffer_allocate(sizeof(*response));
+    packet = buffer_allocate(sizeof(*response), BUFFER_SITE_TCPIP_CTRL);
     if (!packet) return;
     prepare_multicast_headers(packet);
   }
@@ -172,7 +288,7 @@ static void send_neighbor_advertisement(buffer_t *packet)
   response->payload.icmp.checksum = icmp_checksum(&response->ipv6);
   
   packet->data_size = sizeof(*response);
-  usbnet_transmit(packet);
+  usbnet_transmit(packet, USBNET_PRIO_CONTROL);
   
   dbg("Neighbour advertisement sent");
 }
@@ -197,7 +313,7 @@ static void send_router_advertisement(buffer_t *packet)
   if (!packet)
   {
     // Unsolicited advert
-    packet = buffer_allocate(sizeof(*response));
+    packet = buffer_allocate(sizeof(*response), BUFFER_SITE_TCPIP_CTRL);
     if (!packet) return;
     prepare_multicast_headers(packet);
   }
@@ -230,12 +346,12 @@ static void send_router_advertisement(buffer_t *packet)
   
   response->payload.mtu.type = 5;
   response->payload.mtu.length = 1;
-  response->payload.mtu.mtu = uint32_to_buint32(USBNET_BUFFER_SIZE);
+  response->payload.mtu.mtu = uint32_to_buint32(USBNET_MAX_FRAME_SIZE);
   
   response->payload.icmp.checksum = icmp_checksum(&response->ipv6);
   
   packet->data_size = sizeof(*response);
-  usbnet_transmit(packet);
+  usbnet_transmit(packet, USBNET_PRIO_CONTROL);
   
   dbg("Router advertisement sent");
 }
@@ -255,7 +371,7 @@ static void send_ping_reply(buffer_t *packet)
   response->icmp.type = ICMP_TYPE_ECHO_REPLY;
   response->icmp.checksum = icmp_checksum(&response->ipv6);
   
-  usbnet_transmit(packet);
+  usbnet_transmit(packet, USBNET_PRIO_CONTROL);
   
   dbg("Response sent");
 }
@@ -313,333 +429,1934 @@ static void icmp6_poll()
  * TCP/IP connections *
  **********************/
 
-void tcpip_register_listener(uint16_t port, tcpip_callback_t callback)
+void tcpip_wait_tx(tcpip_conn_t *conn)
 {
-  for (int i = 0; i < TCPIP_MAX_LISTENERS; i++)
+  conn->tx_wait = true;
+}
+
+void tcpip_set_evictable(tcpip_conn_t *conn, bool evictable)
+{
+  conn->no_evict = !evictable;
+}
+
+/* Sequence number comparison that works across wraparound */
+static bool seq_before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+/* The application can send until it closes the connection */
+static bool tcp_is_writable(const tcpip_conn_t *conn)
+{
+  return conn->state == TCPIP_ESTABLISHED || conn->state == TCPIP_CLOSE_WAIT;
+}
+
+/* Our FIN has been sent but not acknowledged */
+static bool tcp_fin_pending(const tcpip_conn_t *conn)
+{
+  return conn->state == TCPIP_FIN_WAIT_1 || conn->state == TCPIP_CLOSING ||
+         conn->state == TCPIP_LAST_ACK;
+}
+
+static uint16_t tcp_local_port(const tcpip_conn_t *conn)
+{
+  return g_tcpip_listeners[conn->listener].local_port;
+}
+
+static void tcp_notify(tcpip_conn_t *conn, buffer_t *payload)
+{
+  g_tcpip_listeners[conn->listener].callback(conn, payload);
+}
+
+/* Receive window of the peer in bytes */
+static uint32_t tcp_peer_window(const tcpip_conn_t *conn)
+{
+  return (uint32_t)conn->peer_window << conn->peer_wscale;
+}
+
+/* Sender silly window avoidance, RFC 1122 section 4.2.3.4: send into
+ * usable bytes of window if a full segment fits, or at least half of the
+ * largest window the peer has offered, or if nothing is unacknowledged.
+ * The last one keeps a peer whose buffer is smaller than a segment from
+ * stalling the connection. */
+static bool tcp_sws_allows(const tcpip_conn_t *conn, uint32_t usable)
+{
+  uint32_t max_window = (uint32_t)conn->peer_max_window << conn->peer_wscale;
+  return usable > 0 &&
+         (usable >= tcpip_max_segment(conn) || usable >= max_window / 2 ||
+          conn->tx_sequence == conn->last_ack_received);
+}
+
+/*******************
+ * Transfer blocks *
+ *******************/
+
+static tcpip_transfer_t *tcp_transfer(const tcpip_conn_t *conn)
+{
+  return (conn->transfer == TCPIP_NONE) ? NULL : &g_tcpip_transfers[conn->transfer];
+}
+
+/* A block can be taken from its connection when it holds no segments
+ * and no timer is running in it. */
+static bool tcp_transfer_idle(const tcpip_transfer_t *tx)
+{
+  if (tx->owner == TCPIP_NONE)
   {
-    if (g_tcpip_listeners[i].local_port == 0)
-    {
-      g_tcpip_listeners[i].local_port = port;
-      g_tcpip_listeners[i].callback = callback;
-      return;
-    }
+    return true;
   }
   
-  warn("TCP listener slots all in use, not registering port %d", port);
+  const tcpip_conn_t *conn = &g_tcpip_connections[tx->owner];
+  return tx->rtx_count == 0 && tx->ooo_count == 0 && !tx->write_segment &&
+         !tcp_fin_pending(conn) &&
+         !(conn->tx_wait && !tcp_sws_allows(conn, tcp_peer_window(conn)));
 }
 
-void tcpip_send_ctrl(tcpip_conn_t *conn, buffer_t *packet, uint16_t control)
+/* Index of a free block, or else of the idle block whose connection has
+ * been quiet the longest. Returns -1 if all blocks are busy. */
+static int tcp_find_transfer()
 {
-  if (packet)
-  {
-    assert(packet->data_size <= packet->max_size);
-    assert(packet->data_size >= TCPIP_HEADER_SIZE);
-  }
-  else
+  systime_t now = get_systime();
+  int found = -1;
+  systime_t found_age = 0;
+  for (int i = 0; i < TCPIP_TRANSFER_BLOCKS; i++)
   {
-    packet = buffer_allocate(TCPIP_HEADER_SIZE);
-    
-    if (!packet)
+    const tcpip_transfer_t *tx = &g_tcpip_transfers[i];
+    if (tx->owner == TCPIP_NONE)
     {
-      dbg("Dropping TCPIP packet due to lack of buffers");
-      return;
+      return i;
     }
     
-    packet->data_size = TCPIP_HEADER_SIZE;
+    systime_t age = now - g_tcpip_connections[tx->owner].last_event;
+    if (tcp_transfer_idle(tx) && (found < 0 || age > found_age))
+    {
+      found = i;
+      found_age = age;
+    }
   }
   
-  struct {
-    ethernet_header_t eth;
-    ipv6_header_t ipv6;
-    tcp_header_t tcp;
-    buint32_t options[];
-  } *hdr = (void*)packet->data;
-  
-  size_t payload_len = packet->data_size - TCPIP_HEADER_SIZE;
-  size_t options_len = 0;
-  uint32_t data_offset = 0x5000;
-  
-  if (control & TCPIP_CONTROL_SYN && payload_len == 0)
+  return found;
+}
+
+static void tcp_rtx_clear(tcpip_transfer_t *tx)
+{
+  for (int i = 0; i < tx->rtx_count; i++)
   {
-    // Send maximum segment size option
-    options_len = 4;
-    hdr->options[0] = uint32_to_buint32(0x02040000 | (USBNET_BUFFER_SIZE - TCPIP_HEADER_SIZE));
-    data_offset = 0x6000;
-    packet->data_size += 4;
+    buffer_release(tx->rtx_queue[i]);
+    tx->rtx_queue[i] = NULL;
   }
   
-  hdr->eth.ethertype = uint16_to_buint16(ETHERTYPE_IPV6);
-  hdr->eth.mac_src = g_local_mac_addr;
-  hdr->eth.mac_dest = conn->peer_mac;
-  hdr->ipv6.version_and_class = IPV6_VERSION_CLASS;
-  hdr->ipv6.payload_length = uint16_to_buint16(sizeof(tcp_header_t) + options_len + payload_len);
-  hdr->ipv6.next_header = IP_NEXTHDR_TCP;
-  hdr->ipv6.hop_limit = IPV6_HOP_LIMIT;
-  hdr->ipv6.source = g_local_ipv6_addr;
-  hdr->ipv6.dest = conn->peer_addr;
-  hdr->tcp.source_port = uint16_to_buint16(conn->local_port);
-  hdr->tcp.dest_port = uint16_to_buint16(conn->peer_port);
-  hdr->tcp.sequence = uint32_to_buint32(conn->tx_sequence);
-  hdr->tcp.ack = uint32_to_buint32(conn->rx_sequence);
-  hdr->tcp.control = uint16_to_buint16(control | data_offset);
-  hdr->tcp.window_size = uint16_to_buint16(TCPIP_WINDOW_SIZE);
-  hdr->tcp.urgent_pointer = uint16_to_buint16(0);
-  hdr->tcp.checksum = tcp_checksum(&hdr->ipv6);
-  
-  dbg("TCP sending ctrl=%02x len=%d seq=%08x", control,
-      (int)payload_len, (unsigned)conn->tx_sequence);
-  conn->tx_sequence += payload_len;
-  conn->last_ack_sent = conn->rx_sequence;
-  conn->last_event = get_systime();
+  tx->rtx_count = 0;
+  tx->rtt_active = false;
+}
+
+static void tcp_ooo_clear(tcpip_transfer_t *tx)
+{
+  for (int i = 0; i < tx->ooo_count; i++)
+  {
+    buffer_release(tx->ooo_queue[i]);
+    tx->ooo_queue[i] = NULL;
+  }
   
-  usbnet_transmit(packet);
+  tx->ooo_count = 0;
 }
 
-buffer_t* tcpip_allocate(size_t size)
+/* Get the connection's transfer block, taking one if it has none. A new
+ * block starts from the initial windows and RTO, as a connection does
+ * after being idle for longer than the RTO, RFC 5681 section 4.1.
+ * Returns NULL if all blocks are busy. */
+static tcpip_transfer_t *tcp_acquire_transfer(tcpip_conn_t *conn)
 {
-  /* We pass the lower layer a smaller buffer and reserve ourselves
-   * space for appending the headers later. */
-  buffer_t *packet = buffer_allocate(size + TCPIP_HEADER_SIZE);
-  if (packet)
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  if (tx)
   {
-    buffer_t *payload = buffer_slice(packet, TCPIP_HEADER_SIZE, 0);
-    return payload;
+    return tx;
   }
-  else
+  
+  int index = tcp_find_transfer();
+  if (index < 0)
   {
     return NULL;
   }
+  
+  tx = &g_tcpip_transfers[index];
+  if (tx->owner != TCPIP_NONE)
+  {
+    g_tcpip_connections[tx->owner].transfer = TCPIP_NONE;
+  }
+  
+  memset(tx, 0, sizeof(tcpip_transfer_t));
+  tx->owner = conn - g_tcpip_connections;
+  tx->cwnd = TCPIP_INITIAL_CWND_SEGMENTS * tcpip_max_segment(conn);
+  tx->ssthresh = UINT16_MAX;
+  tx->rto = TCPIP_RTO_INITIAL;
+  tx->recover_sequence = conn->last_ack_received - 1;
+  conn->transfer = index;
+  return tx;
 }
 
-void tcpip_release(buffer_t* buffer)
+static void tcp_release_transfer(tcpip_conn_t *conn)
 {
-  buffer_release(buffer_unslice(buffer, TCPIP_HEADER_SIZE, 0));
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  if (tx)
+  {
+    tcp_rtx_clear(tx);
+    tcp_ooo_clear(tx);
+    
+    if (tx->write_segment)
+    {
+      tcpip_release(tx->write_segment);
+      tx->write_segment = NULL;
+    }
+    
+    tx->owner = TCPIP_NONE;
+    conn->transfer = TCPIP_NONE;
+  }
 }
 
-void tcpip_send(tcpip_conn_t *conn, buffer_t *payload)
+/**************
+ * Peer table *
+ **************/
+
+static uint8_t tcp_find_peer(const ipv6_addr_t *addr)
 {
-  assert(conn->state == TCPIP_ESTABLISHED);
+  for (int i = 0; i < TCPIP_MAX_PEERS; i++)
+  {
+    if (g_tcpip_peers[i].refcount > 0 &&
+        memcmp(&g_tcpip_peers[i].addr, addr, sizeof(ipv6_addr_t)) == 0)
+    {
+      return i;
+    }
+  }
   
-  buffer_t *packet = buffer_unslice(payload, TCPIP_HEADER_SIZE, 0);
-  tcpip_send_ctrl(conn, packet, TCPIP_CONTROL_ACK);
+  return TCPIP_NONE;
 }
 
-void tcpip_close(tcpip_conn_t *conn)
+/* Take a reference to the entry of the address, adding it if needed.
+ * Returns TCPIP_NONE if the table is full. */
+static uint8_t tcp_intern_peer(const ipv6_addr_t *addr, const mac_addr_t *mac)
 {
-  dbg("TCP closing port=%d", conn->local_port);
+  uint8_t peer = tcp_find_peer(addr);
+  for (int i = 0; i < TCPIP_MAX_PEERS && peer == TCPIP_NONE; i++)
+  {
+    if (g_tcpip_peers[i].refcount == 0)
+    {
+      peer = i;
+      g_tcpip_peers[i].addr = *addr;
+    }
+  }
   
-  tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_FIN | TCPIP_CONTROL_ACK);
-  conn->state = TCPIP_CLOSED;
-  conn->callback(conn, NULL);
+  if (peer != TCPIP_NONE)
+  {
+    g_tcpip_peers[peer].mac = *mac;
+    g_tcpip_peers[peer].refcount++;
+  }
+  
+  return peer;
 }
 
-static void tcp_send_rst(buffer_t *packet)
+static void tcp_release_peer(uint8_t peer)
 {
-  struct {
-    ethernet_header_t eth;
-    ipv6_header_t ipv6;
-    tcp_header_t tcp;
-  } *resp = (void*)packet->data;
-  
-  prepare_reply_headers(packet);
-  
-  packet->data_size = sizeof(*resp);
-  resp->ipv6.payload_length = uint16_to_buint16(sizeof(tcp_header_t));
-  buint16_t tmp = resp->tcp.source_port;
-  resp->tcp.source_port = resp->tcp.dest_port;
-  resp->tcp.dest_port = tmp;
-  buint32_t tmp2 = resp->tcp.sequence;
-  resp->tcp.sequence = resp->tcp.ack;
-  resp->tcp.ack = tmp2;
-  
-  if (buint16_to_uint16(resp->tcp.control) & TCPIP_CONTROL_SYN)
+  if (peer != TCPIP_NONE)
   {
-    resp->tcp.ack = uint32_to_buint32(buint32_to_uint32(resp->tcp.ack) + 1);
+    g_tcpip_peers[peer].refcount--;
   }
-  
-  resp->tcp.control = uint16_to_buint16(TCPIP_CONTROL_RST | TCPIP_CONTROL_ACK | 0x5000);
-  resp->tcp.urgent_pointer = uint16_to_buint16(0);
-  resp->tcp.checksum = tcp_checksum(&resp->ipv6);
-  
-  usbnet_transmit(packet);
 }
 
-static tcpip_conn_t *allocate_connection()
+/***********************
+ * Application context *
+ ***********************/
+
+static bool tcp_context_word_used(int index)
 {
-  tcpip_conn_t *result = NULL;
-  systime_t time_now = get_systime();
-  int oldest = 0;
-  for (int i = 0; i < TCPIP_MAX_CONNECTIONS; i++)
+  return g_tcpip_context_used[index / 32] & (1u << (index % 32));
+}
+
+static void tcp_mark_context(int start, int count, bool used)
+{
+  for (int i = start; i < start + count; i++)
   {
-    if (g_tcpip_connections[i].state == TCPIP_CLOSED)
+    if (used)
     {
-      result = &g_tcpip_connections[i];
-      break;
+      g_tcpip_context_used[i / 32] |= 1u << (i % 32);
     }
-    
-    systime_t delta1 = time_now - g_tcpip_connections[oldest].last_event;
-    systime_t delta2 = time_now - g_tcpip_connections[i].last_event;
-    if (delta2 > delta1)
+    else
     {
-      oldest = i;
+      g_tcpip_context_used[i / 32] &= ~(1u << (i % 32));
     }
   }
-  
-  if (!result)
-  {
-    warn("TCP no free connection slots, terminating oldest connection");
-    tcpip_close(&g_tcpip_connections[oldest]);
-    result = &g_tcpip_connections[oldest];
-  }
-  
-  memset(result, 0, sizeof(tcpip_conn_t));
-  return result;
 }
 
-static void handle_tcp_syn(buffer_t *packet)
+/* Start of the first free run of words, with the words of the
+ * connection that would be reset for it counted as free. Returns -1 if
+ * there is none. */
+static int tcp_find_context(int words, const tcpip_conn_t *victim)
 {
-  struct {
-    ethernet_header_t eth;
-    ipv6_header_t ipv6;
-    tcp_header_t tcp;
-  } *hdr = (void*)packet->data;
+  int victim_start = 0;
+  int victim_words = 0;
+  if (victim && victim->context)
+  {
+    victim_start = victim->context - g_tcpip_context_pool;
+    victim_words = g_tcpip_listeners[victim->listener].context_words;
+  }
   
-  for (int i = 0; i < TCPIP_MAX_LISTENERS; i++)
+  int run = 0;
+  for (int i = 0; i < TCPIP_CONTEXT_POOL_WORDS; i++)
   {
-    if (g_tcpip_listeners[i].local_port == buint16_to_uint16(hdr->tcp.dest_port))
+    bool victims = (i >= victim_start && i < victim_start + victim_words);
+    run = (tcp_context_word_used(i) && !victims) ? 0 : run + 1;
+    if (run == words)
     {
-      tcpip_conn_t *conn = allocate_connection();
-      conn->state = TCPIP_ESTABLISHED;
-      conn->local_port = g_tcpip_listeners[i].local_port;
-      conn->callback = g_tcpip_listeners[i].callback;
-      
-      dbg("TCP connected port=%d", conn->local_port);
-
-      conn->peer_addr = hdr->ipv6.source;
-      conn->peer_mac = hdr->eth.mac_src;
-      conn->peer_port = buint16_to_uint16(hdr->tcp.source_port);
-      conn->rx_sequence = buint32_to_uint32(hdr->tcp.sequence) + 1;
-      conn->tx_sequence = conn->rx_sequence + get_systime();
-      conn->last_ack_received = conn->tx_sequence;
-      packet->data_size = TCPIP_HEADER_SIZE;
-      tcpip_send_ctrl(conn, packet, TCPIP_CONTROL_SYN | TCPIP_CONTROL_ACK);
-      conn->tx_sequence++;
-      
-      conn->callback(conn, NULL);
-      return;
+      return i + 1 - words;
     }
   }
   
-  // No matching listener found, send RST
-  warn("TCP no matching listener port=%d", buint16_to_uint16(hdr->tcp.dest_port));
-  tcp_send_rst(packet);
+  return -1;
 }
 
-static void handle_tcp_active(buffer_t *packet)
+/* Give the connection the first free run of words its listener asked
+ * for. Returns false if there is none. */
+static bool tcp_allocate_context(tcpip_conn_t *conn)
 {
-  struct {
-    ethernet_header_t eth;
-    ipv6_header_t ipv6;
-    tcp_header_t tcp;
-  } *hdr = (void*)packet->data;
-  
-  uint16_t control = buint16_to_uint16(hdr->tcp.control);
-  uint32_t sequence = buint32_to_uint32(hdr->tcp.sequence);
-  uint32_t data_offset = (sizeof(ethernet_header_t) + sizeof(ipv6_header_t) +
-                          (buint16_to_uint16(hdr->tcp.control) >> 12) * 4);
-  size_t data_len = packet->data_size - data_offset;
+  int words = g_tcpip_listeners[conn->listener].context_words;
   
-  for (int i = 0; i < TCPIP_MAX_CONNECTIONS; i++)
+  conn->context = NULL;
+  if (words == 0)
   {
-    tcpip_conn_t *conn = &g_tcpip_connections[i];
-    if (conn->state == TCPIP_ESTABLISHED &&
-        conn->local_port == buint16_to_uint16(hdr->tcp.dest_port) &&
-        conn->peer_port == buint16_to_uint16(hdr->tcp.source_port) &&
-        memcmp(&conn->peer_addr, &hdr->ipv6.source, sizeof(ipv6_addr_t)) == 0)
-    {
-      conn->last_ack_received = buint32_to_uint32(hdr->tcp.ack);
-      conn->last_event = get_systime();
-      dbg("TCP data len=%d to port=%d", (int)data_len, conn->local_port);
-      
-      if (data_len)
-      {
-        if (sequence < conn->rx_sequence && sequence + TCPIP_WINDOW_SIZE > conn->rx_sequence)
-        {
-          warn("Ignoring TCP resend");
-          buffer_release(packet);
-          return;
-        }
-        else if (sequence > conn->rx_sequence)
-        {
-          warn("TCPIP sequence mismatch: expected %08x, got %08x",
-               (unsigned)conn->rx_sequence, (unsigned)sequence);
-          buffer_release(packet);
-          tcpip_close(conn);
-          return;
-        }
-        
-        conn->rx_sequence += data_len;
-        
-        if (data_offset > TCPIP_HEADER_SIZE)
-        {
-          memmove(&packet->data[TCPIP_HEADER_SIZE], &packet->data[data_offset], data_len);
-          packet->data_size = TCPIP_HEADER_SIZE + data_len;
-        }
-        
-        buffer_t *payload = buffer_slice(packet, TCPIP_HEADER_SIZE, 0);
-        conn->callback(conn, payload);
-      }
-      else
-      {
-        buffer_release(packet);
-      }
-      
-      if (control & (TCPIP_CONTROL_FIN | TCPIP_CONTROL_RST))
-      {
-        conn->rx_sequence++;
-        tcpip_close(conn);
-      }
-
-      return;
-    }
+    return true;
   }
   
-  if ((control & TCPIP_CONTROL_ACK) && data_len == 0)
+  int start = tcp_find_context(words, NULL);
+  if (start < 0)
   {
-    // Probably just ACK to FIN-ACK, ignore
-    buffer_release(packet);
-    return;
+    return false;
   }
   
-  // No matching connection, reply with RST
-  warn("TCP no matching connection port=%d", buint16_to_uint16(hdr->tcp.dest_port));
+  tcp_mark_context(start, words, true);
+  conn->context = &g_tcpip_context_pool[start];
+  memset(conn->context, 0, words * sizeof(uint32_t));
+  return true;
+}
+
+/* Called when the slot is freed, after the application's last callback */
+static void tcp_free_context(tcpip_conn_t *conn)
+{
+  if (conn->context)
+  {
+    tcp_mark_context(conn->context - g_tcpip_context_pool,
+                     g_tcpip_listeners[conn->listener].context_words, false);
+    conn->context = NULL;
+  }
+}
+
+/***********************
+ * Connection handling *
+ ***********************/
+
+size_t tcpip_max_segment(const tcpip_conn_t *conn)
+{
+  return (conn->peer_mss < TCPIP_MAX_PAYLOAD) ? conn->peer_mss : TCPIP_MAX_PAYLOAD;
+}
+
+size_t tcpip_send_space(const tcpip_conn_t *conn)
+{
+  /* A segment being filled by tcpip_write() will take a queue slot */
+  const tcpip_transfer_t *tx = tcp_transfer(conn);
+  if (!tcp_is_writable(conn) ||
+      (tx && tx->rtx_count + (tx->write_segment != NULL) >= TCPIP_RTX_QUEUE) ||
+      (!tx && tcp_find_transfer() < 0))
+  {
+    return 0;
+  }
+  
+  uint32_t cwnd = tx ? tx->cwnd : TCPIP_INITIAL_CWND_SEGMENTS * tcpip_max_segment(conn);
+  uint32_t window = tcp_peer_window(conn);
+  if (window > cwnd) window = cwnd;
+  uint32_t in_flight = conn->tx_sequence - conn->last_ack_received;
+  if (tx && tx->write_segment) in_flight += tx->write_segment->data_size;
+  return (in_flight < window) ? window - in_flight : 0;
+}
+
+/* Producers are woken only when tcp_sws_allows() the space, which
+ * avoids sending tiny segments into a slowly opening window. */
+static bool tcp_can_send(const tcpip_conn_t *conn)
+{
+  return tcp_sws_allows(conn, tcpip_send_space(conn));
+}
+
+/* Returns true if a producer can get a buffer and queue it now. Buffers
+ * held for retransmission come back with received ACKs, and those bring
+ * us to tcp_poll() anyway. */
+static bool tcp_tx_ready()
+{
+  return usbnet_get_tx_credit() > 0 &&
+         buffer_available(USBNET_BUFFER_SIZE, BUFFER_CLASS_TX) > 0;
+}
+
+/* Give connections waiting for transmit credit a chance to send.
+ * Starts from a different connection each time so that one busy stream
+ * cannot take all the credit. */
+static void tcp_service_tx_waiters()
+{
+  static int first;
+  
+  for (int j = 0; j < TCPIP_MAX_CONNECTIONS; j++)
+  {
+    if (!tcp_tx_ready())
+      break;
+    
+    tcpip_conn_t *conn = &g_tcpip_connections[(first + j) % TCPIP_MAX_CONNECTIONS];
+    if (conn->tx_wait && tcp_can_send(conn))
+    {
+      conn->tx_wait = false;
+      tcp_notify(conn, NULL);
+    }
+  }
+  
+  first = (first + 1) % TCPIP_MAX_CONNECTIONS;
+  
+  /* Without a TX completion there is no event to come back here, so
+   * wake up again if someone is still waiting while there is credit. */
+  if (tcp_tx_ready())
+  {
+    for (int i = 0; i < TCPIP_MAX_CONNECTIONS; i++)
+    {
+      if (g_tcpip_connections[i].tx_wait && tcp_can_send(&g_tcpip_connections[i]))
+      {
+        events_signal(EVENT_TCPIP);
+        break;
+      }
+    }
+  }
+}
+
+void tcpip_init()
+{
+  for (int i = 0; i < TCPIP_TRANSFER_BLOCKS; i++)
+  {
+    g_tcpip_transfers[i].owner = TCPIP_NONE;
+  }
+  
+  for (int i = 0; i < TCPIP_LISTEN_BACKLOG; i++)
+  {
+    g_tcpip_backlog[i].listener = TCPIP_NONE;
+  }
+  
+  usbnet_register_tx_callback(tcp_service_tx_waiters);
+}
+
+void tcpip_register_listener(uint16_t port, tcpip_callback_t callback,
+                             uint8_t context_words)
+{
+  for (int i = 0; i < TCPIP_MAX_LISTENERS; i++)
+  {
+    if (g_tcpip_listeners[i].local_port == 0)
+    {
+      g_tcpip_listeners[i].local_port = port;
+      g_tcpip_listeners[i].context_words = context_words;
+      g_tcpip_listeners[i].callback = callback;
+      return;
+    }
+  }
+  
+  warn("TCP listener slots all in use, not registering port %d", port);
+}
+
+/* Keep a sent data segment until it is acknowledged. The first segment
+ * sent while no measurement is running is timed for the RTT estimate.
+ * Senders check with tcp_rtx_prepare() first that there is room. */
+static void tcp_rtx_push(tcpip_conn_t *conn, buffer_t *packet, uint32_t end)
+{
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  assert(tx && tx->rtx_count < TCPIP_RTX_QUEUE);
+  
+  systime_t now = get_systime();
+  if (tx->rtx_count == 0)
+  {
+    tx->rtx_time = now;
+  }
+  
+  if (!tx->rtt_active)
+  {
+    tx->rtt_active = true;
+    tx->rtt_start = now;
+    tx->rtt_sequence = end;
+  }
+  
+  tx->rtx_queue[tx->rtx_count++] = buffer_retain(packet);
+}
+
+/* A data segment is only sent if it can be kept for retransmission. One
+ * in a receive buffer is copied to a transmit buffer when keeping it would
+ * leave no buffer for reception. Returns the packet to send, or NULL if
+ * the segment cannot be kept, in which case the packet is released. */
+static buffer_t *tcp_rtx_prepare(tcpip_conn_t *conn, buffer_t *packet)
+{
+  tcpip_transfer_t *tx = tcp_acquire_transfer(conn);
+  if (!tx || tx->rtx_count == TCPIP_RTX_QUEUE)
+  {
+    warn("TCP retransmission queue full, segment not sent");
+    buffer_release(packet);
+    return NULL;
+  }
+  
+  if (buffer_get_class(packet) == BUFFER_CLASS_RX &&
+      buffer_available(USBNET_BUFFER_SIZE, BUFFER_CLASS_RX) == 0)
+  {
+    size_t size = buffer_frame_size(packet);
+    buffer_t *copy = buffer_allocate(size, BUFFER_SITE_TCPIP_TX);
+    if (!copy)
+    {
+      warn("TCP out of receive buffers, segment not sent");
+      buffer_release(packet);
+      return NULL;
+    }
+    
+    const uint8_t *data = buffer_gather(packet, 0, size, copy->data);
+    if (data != copy->data) memcpy(copy->data, data, size);
+    copy->data_size = size;
+    buffer_release(packet);
+    packet = copy;
+  }
+  
+  return packet;
+}
+
+/* Sequence number of a received segment */
+static uint32_t tcp_segment_sequence(const buffer_t *packet)
+{
+  const struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (const void*)packet->data;
+  
+  return buint32_to_uint32(hdr->tcp.sequence);
+}
+
+/* Receive window to put in a segment. SYN segments, and segments sent
+ * without a connection, carry it unscaled. */
+static uint16_t tcp_window_field(const tcpip_conn_t *conn, uint16_t control)
+{
+  uint32_t window = TCPIP_WINDOW_SIZE;
+  if (conn && !(control & TCPIP_CONTROL_SYN))
+  {
+    window >>= conn->local_wscale;
+  }
+  
+  return (window < UINT16_MAX) ? window : UINT16_MAX;
+}
+
+void tcpip_send_ctrl(tcpip_conn_t *conn, buffer_t *packet, uint16_t control)
+{
+  if (packet)
+  {
+    assert(packet->data_size <= packet->max_size);
+    assert(packet->data_size >= TCPIP_HEADER_SIZE);
+  }
+  else
+  {
+    packet = buffer_allocate(TCPIP_HEADER_SIZE, BUFFER_SITE_TCPIP_CTRL);
+    
+    if (!packet)
+    {
+      dbg("Dropping TCPIP packet due to lack of buffers");
+      return;
+    }
+    
+    packet->data_size = TCPIP_HEADER_SIZE;
+  }
+  
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+    buint32_t options[];
+  } *hdr = (void*)packet->data;
+  
+  size_t payload_len = buffer_frame_size(packet) - TCPIP_HEADER_SIZE;
+  size_t options_len = 0;
+  uint32_t data_offset = 0x5000;
+  
+  if (control & TCPIP_CONTROL_SYN && payload_len == 0)
+  {
+    // Send maximum segment size option, and window scale if the peer sent it
+    hdr->options[0] = uint32_to_buint32(TCPIP_OPTION_MSS << 24 | 4 << 16 | TCPIP_RECEIVE_MSS);
+    options_len = 4;
+    
+    if (conn->window_scaling)
+    {
+      hdr->options[1] = uint32_to_buint32(TCPIP_OPTION_NOP << 24 | TCPIP_OPTION_WSCALE << 16 |
+                                          3 << 8 | conn->local_wscale);
+      options_len = 8;
+    }
+    
+    data_offset = (5 + options_len / 4) << 12;
+    packet->data_size += options_len;
+  }
+  
+  hdr->eth.ethertype = uint16_to_buint16(ETHERTYPE_IPV6);
+  hdr->eth.mac_src = g_local_mac_addr;
+  hdr->eth.mac_dest = g_tcpip_peers[conn->peer].mac;
+  hdr->ipv6.version_and_class = IPV6_VERSION_CLASS;
+  hdr->ipv6.payload_length = uint16_to_buint16(sizeof(tcp_header_t) + options_len + payload_len);
+  hdr->ipv6.next_header = IP_NEXTHDR_TCP;
+  hdr->ipv6.hop_limit = IPV6_HOP_LIMIT;
+  hdr->ipv6.source = g_local_ipv6_addr;
+  hdr->ipv6.dest = g_tcpip_peers[conn->peer].addr;
+  hdr->tcp.source_port = uint16_to_buint16(tcp_local_port(conn));
+  hdr->tcp.dest_port = uint16_to_buint16(conn->peer_port);
+  hdr->tcp.sequence = uint32_to_buint32(conn->tx_sequence);
+  hdr->tcp.ack = uint32_to_buint32(conn->rx_sequence);
+  hdr->tcp.control = uint16_to_buint16(control | data_offset);
+  hdr->tcp.window_size = uint16_to_buint16(tcp_window_field(conn, control));
+  hdr->tcp.urgent_pointer = uint16_to_buint16(0);
+  hdr->tcp.checksum = tcp_checksum(packet);
+  
+  dbg("TCP sending ctrl=%02x len=%d seq=%08x", control,
+      (int)payload_len, (unsigned)conn->tx_sequence);
+  
+  if (payload_len == 0 && control == TCPIP_CONTROL_ACK)
+  {
+    g_tcpip_stats.pure_acks++;
+  }
+  else if (payload_len != 0 && conn->last_ack_sent != conn->rx_sequence)
+  {
+    g_tcpip_stats.piggybacked_acks++;
+  }
+  
+  conn->tx_sequence += payload_len;
+  conn->last_ack_sent = conn->rx_sequence;
+  conn->last_event = get_systime();
+  
+  if (payload_len)
+  {
+    tcp_rtx_push(conn, packet, conn->tx_sequence);
+  }
+  
+  /* Pure ACKs may overtake queued data, but FIN must stay behind it. */
+  bool bulk = payload_len || (control & TCPIP_CONTROL_FIN);
+  usbnet_transmit(packet, bulk ? USBNET_PRIO_BULK : USBNET_PRIO_CONTROL);
+}
+
+buffer_t* tcpip_allocate(size_t size, buffer_site_t site)
+{
+  /* We pass the lower layer a smaller buffer and reserve ourselves
+   * space for appending the headers later. */
+  buffer_t *packet = buffer_allocate(size + TCPIP_HEADER_SIZE, site);
+  if (packet)
+  {
+    buffer_t *payload = buffer_slice(packet, TCPIP_HEADER_SIZE, 0);
+    return payload;
+  }
+  else
+  {
+    return NULL;
+  }
+}
+
+void tcpip_release(buffer_t* buffer)
+{
+  buffer_release(buffer_unslice(buffer, TCPIP_HEADER_SIZE, 0));
+}
+
+bool tcpip_send(tcpip_conn_t *conn, buffer_t *payload)
+{
+  assert(tcp_is_writable(conn));
+  
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  if (tx && tx->write_segment)
+  {
+    if (buffer_frame_size(payload) == payload->data_size &&
+        tx->write_segment->data_size + payload->data_size <= tcpip_max_segment(conn))
+    {
+      tcpip_write(conn, payload->data, payload->data_size);
+      tcpip_release(payload);
+      return true;
+    }
+    
+    tcpip_push(conn);
+  }
+  
+  buffer_t *packet = tcp_rtx_prepare(conn, buffer_unslice(payload, TCPIP_HEADER_SIZE, 0));
+  if (!packet)
+  {
+    return false;
+  }
+  
+  tcpip_send_ctrl(conn, packet, TCPIP_CONTROL_ACK);
+  return true;
+}
+
+size_t tcpip_write(tcpip_conn_t *conn, const void *data, size_t len)
+{
+  assert(tcp_is_writable(conn));
+  
+  const uint8_t *src = data;
+  size_t mss = tcpip_max_segment(conn);
+  size_t written = 0;
+  while (written < len)
+  {
+    tcpip_transfer_t *tx = tcp_acquire_transfer(conn);
+    if (!tx)
+    {
+      break;
+    }
+    
+    if (!tx->write_segment)
+    {
+      /* The segment needs a retransmission slot when it is sent, and only
+       * tcpip_send() adds to the queue while it is being filled */
+      if (tx->rtx_count == TCPIP_RTX_QUEUE)
+      {
+        break;
+      }
+      
+      tx->write_segment = tcpip_allocate(mss, BUFFER_SITE_TCPIP_TX);
+      if (!tx->write_segment)
+      {
+        break;
+      }
+      
+      tx->write_segment->data_size = 0;
+      tx->write_time = get_systime();
+    }
+    
+    buffer_t *segment = tx->write_segment;
+    size_t count = mss - segment->data_size;
+    if (count > len - written) count = len - written;
+    
+    memcpy(&segment->data[segment->data_size], &src[written], count);
+    segment->data_size += count;
+    written += count;
+    
+    if (segment->data_size == mss)
+    {
+      tcpip_push(conn);
+    }
+  }
+  
+  return written;
+}
+
+void tcpip_push(tcpip_conn_t *conn)
+{
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  if (tx && tx->write_segment)
+  {
+    buffer_t *packet = buffer_unslice(tx->write_segment, TCPIP_HEADER_SIZE, 0);
+    tx->write_segment = NULL;
+    tcpip_send_ctrl(conn, packet, TCPIP_CONTROL_ACK);
+  }
+}
+
+void tcpip_close(tcpip_conn_t *conn)
+{
+  if (!tcp_is_writable(conn))
+  {
+    return;
+  }
+  
+  tcpip_push(conn);
+  dbg("TCP closing port=%d", tcp_local_port(conn));
+  
+  tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_FIN | TCPIP_CONTROL_ACK);
+  conn->tx_sequence++;
+  
+  /* Without a transfer block the FIN timer starts once one is free */
+  tcpip_transfer_t *tx = tcp_acquire_transfer(conn);
+  if (tx)
+  {
+    if (tx->rtx_count == 0)
+    {
+      /* Time the FIN like a data segment */
+      tx->rtx_time = get_systime();
+      tx->rtx_retries = 0;
+    }
+    
+    tcp_ooo_clear(tx);
+  }
+  
+  conn->state = (conn->state == TCPIP_CLOSE_WAIT) ? TCPIP_LAST_ACK : TCPIP_FIN_WAIT_1;
+  conn->tx_wait = false;
+  tcp_notify(conn, NULL);
+}
+
+/* Free the connection slot. The application gets its last callback if it
+ * has not closed the connection itself. */
+static void tcp_release_connection(tcpip_conn_t *conn)
+{
+  bool notify = tcp_is_writable(conn);
+  
+  tcp_release_transfer(conn);
+  conn->state = TCPIP_CLOSED;
+  conn->tx_wait = false;
+  
+  if (notify)
+  {
+    tcp_notify(conn, NULL);
+  }
+  
+  tcp_free_context(conn);
+  tcp_release_peer(conn->peer);
+  conn->peer = TCPIP_NONE;
+}
+
+/* Reset the connection and free its slot at once */
+static void tcp_abort(tcpip_conn_t *conn)
+{
+  tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_RST | TCPIP_CONTROL_ACK);
+  tcp_release_connection(conn);
+}
+
+/* Turn a received segment into a segment without data back to its sender */
+static void tcp_send_reply(buffer_t *packet, uint32_t sequence, uint32_t ack, uint16_t control)
+{
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *resp = (void*)packet->data;
+  
+  prepare_reply_headers(packet);
+  
+  packet->data_size = sizeof(*resp);
+  resp->ipv6.payload_length = uint16_to_buint16(sizeof(tcp_header_t));
+  buint16_t tmp = resp->tcp.source_port;
+  resp->tcp.source_port = resp->tcp.dest_port;
+  resp->tcp.dest_port = tmp;
+  resp->tcp.sequence = uint32_to_buint32(sequence);
+  resp->tcp.ack = uint32_to_buint32(ack);
+  resp->tcp.control = uint16_to_buint16(control | 0x5000);
+  resp->tcp.window_size = uint16_to_buint16(tcp_window_field(NULL, control));
+  resp->tcp.urgent_pointer = uint16_to_buint16(0);
+  resp->tcp.checksum = tcp_checksum(packet);
+  
+  usbnet_transmit(packet, USBNET_PRIO_CONTROL);
+}
+
+static void tcp_send_rst(buffer_t *packet)
+{
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (void*)packet->data;
+  
+  uint32_t ack = buint32_to_uint32(hdr->tcp.sequence);
+  if (buint16_to_uint16(hdr->tcp.control) & TCPIP_CONTROL_SYN)
+  {
+    ack++;
+  }
+  
+  tcp_send_reply(packet, buint32_to_uint32(hdr->tcp.ack), ack,
+                 TCPIP_CONTROL_RST | TCPIP_CONTROL_ACK);
+}
+
+/************************************
+ * Compact FIN_WAIT_2 and TIME_WAIT *
+ ************************************/
+
+/* A connection that has sent and got ACK for its FIN has no data left to
+ * resend and no application, so it only needs enough state to
+ * acknowledge the rest of the peer's data and FIN. */
+typedef struct {
+  uint16_t peer_port;
+  uint16_t local_port;
+  uint32_t tx_sequence;
+  uint32_t rx_sequence;
+  systime_t last_event;
+  uint8_t peer;
+  uint8_t state; /* TCPIP_FIN_WAIT_2, TCPIP_TIME_WAIT or TCPIP_CLOSED */
+} tcpip_timewait_t;
+
+static tcpip_timewait_t g_tcpip_timewait[TCPIP_TIME_WAIT_SLOTS];
+
+static bool tcp_timewait_expired(const tcpip_timewait_t *tw, systime_t now)
+{
+  return tw->state == TCPIP_CLOSED || now - tw->last_event >= TCPIP_TIME_WAIT_TIMEOUT;
+}
+
+static void tcp_free_timewait(tcpip_timewait_t *tw)
+{
+  if (tw->state != TCPIP_CLOSED)
+  {
+    tw->state = TCPIP_CLOSED;
+    tcp_release_peer(tw->peer);
+  }
+}
+
+/* Free expired entries, so that they don't keep their peers in the table */
+static void tcp_timewait_poll()
+{
+  systime_t now = get_systime();
+  for (int i = 0; i < TCPIP_TIME_WAIT_SLOTS; i++)
+  {
+    if (tcp_timewait_expired(&g_tcpip_timewait[i], now))
+    {
+      tcp_free_timewait(&g_tcpip_timewait[i]);
+    }
+  }
+}
+
+/* Move a connection whose FIN has been acknowledged to a compact entry,
+ * reusing the oldest one if all are taken. */
+static tcpip_timewait_t *tcp_enter_timewait(tcpip_conn_t *conn, tcpip_state_t state)
+{
+  systime_t now = get_systime();
+  tcpip_timewait_t *tw = &g_tcpip_timewait[0];
+  for (int i = 0; i < TCPIP_TIME_WAIT_SLOTS; i++)
+  {
+    if (tcp_timewait_expired(&g_tcpip_timewait[i], now))
+    {
+      tw = &g_tcpip_timewait[i];
+      break;
+    }
+    
+    if (now - g_tcpip_timewait[i].last_event > now - tw->last_event)
+    {
+      tw = &g_tcpip_timewait[i];
+    }
+  }
+  
+  dbg("TCP port=%d entering %s", tcp_local_port(conn),
+      (state == TCPIP_TIME_WAIT) ? "TIME_WAIT" : "FIN_WAIT_2");
+  
+  tcp_free_timewait(tw);
+  tw->peer = conn->peer;
+  g_tcpip_peers[tw->peer].refcount++;
+  tw->peer_port = conn->peer_port;
+  tw->local_port = tcp_local_port(conn);
+  tw->tx_sequence = conn->tx_sequence;
+  tw->rx_sequence = conn->rx_sequence;
+  tw->last_event = now;
+  tw->state = state;
+  
+  tcp_release_connection(conn);
+  return tw;
+}
+
+static tcpip_timewait_t *tcp_find_timewait(uint8_t peer, uint16_t peer_port,
+                                           uint16_t local_port)
+{
+  systime_t now = get_systime();
+  for (int i = 0; i < TCPIP_TIME_WAIT_SLOTS; i++)
+  {
+    tcpip_timewait_t *tw = &g_tcpip_timewait[i];
+    if (!tcp_timewait_expired(tw, now) && tw->peer == peer &&
+        tw->local_port == local_port && tw->peer_port == peer_port)
+    {
+      return tw;
+    }
+  }
+  
+  return NULL;
+}
+
+/* Acknowledge data and FIN from the peer. In FIN_WAIT_2 the application
+ * has closed, so data is discarded. In TIME_WAIT a repeated FIN means our
+ * ACK was lost. */
+static void handle_tcp_timewait(tcpip_timewait_t *tw, buffer_t *packet)
+{
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (void*)packet->data;
+  
+  uint16_t control = buint16_to_uint16(hdr->tcp.control);
+  uint32_t sequence = buint32_to_uint32(hdr->tcp.sequence);
+  size_t data_len = packet->data_size - (sizeof(ethernet_header_t) + sizeof(ipv6_header_t) +
+                                         (control >> 12) * 4);
+  uint32_t segment_len = data_len + ((control & TCPIP_CONTROL_FIN) ? 1 : 0);
+  
+  if ((control & TCPIP_CONTROL_RST) || segment_len == 0)
+  {
+    if (control & TCPIP_CONTROL_RST)
+    {
+      tcp_free_timewait(tw);
+    }
+    
+    buffer_release(packet);
+    return;
+  }
+  
+  if (tw->state == TCPIP_FIN_WAIT_2 && sequence == tw->rx_sequence)
+  {
+    tw->rx_sequence += segment_len;
+    if (control & TCPIP_CONTROL_FIN)
+    {
+      tw->state = TCPIP_TIME_WAIT;
+    }
+  }
+  
+  tw->last_event = get_systime();
+  tcp_send_reply(packet, tw->tx_sequence, tw->rx_sequence, TCPIP_CONTROL_ACK);
+}
+
+/******************
+ * Listen backlog *
+ ******************/
+
+static void tcp_free_backlog(tcpip_backlog_t *syn)
+{
+  if (syn->listener != TCPIP_NONE)
+  {
+    syn->listener = TCPIP_NONE;
+    tcp_release_peer(syn->peer);
+  }
+}
+
+static void tcp_backlog_poll()
+{
+  systime_t now = get_systime();
+  for (int i = 0; i < TCPIP_LISTEN_BACKLOG; i++)
+  {
+    if (now - g_tcpip_backlog[i].time >= TCPIP_SYN_TIMEOUT)
+    {
+      tcp_free_backlog(&g_tcpip_backlog[i]);
+    }
+  }
+}
+
+static tcpip_backlog_t *tcp_find_backlog(uint8_t peer, uint16_t peer_port, uint16_t local_port)
+{
+  for (int i = 0; i < TCPIP_LISTEN_BACKLOG; i++)
+  {
+    tcpip_backlog_t *syn = &g_tcpip_backlog[i];
+    if (syn->listener != TCPIP_NONE && syn->peer == peer && syn->peer_port == peer_port &&
+        g_tcpip_listeners[syn->listener].local_port == local_port)
+    {
+      return syn;
+    }
+  }
+  
+  return NULL;
+}
+
+/* Free entry, or else the oldest one */
+static tcpip_backlog_t *tcp_allocate_backlog()
+{
+  systime_t now = get_systime();
+  tcpip_backlog_t *syn = &g_tcpip_backlog[0];
+  for (int i = 0; i < TCPIP_LISTEN_BACKLOG; i++)
+  {
+    if (g_tcpip_backlog[i].listener == TCPIP_NONE)
+    {
+      return &g_tcpip_backlog[i];
+    }
+    
+    if (now - g_tcpip_backlog[i].time > now - syn->time)
+    {
+      syn = &g_tcpip_backlog[i];
+    }
+  }
+  
+  dbg("TCP listen backlog full, dropping oldest SYN");
+  tcp_free_backlog(syn);
+  return syn;
+}
+
+/* Read the MSS, window scale and SACK-permitted options of a SYN, RFC 793,
+ * RFC 7323 and RFC 2018. Missing options keep their defaults, and parsing
+ * stops at a malformed one. */
+static void tcp_parse_syn_options(const buffer_t *packet, tcpip_backlog_t *syn)
+{
+  const struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+    uint8_t options[];
+  } *hdr = (const void*)packet->data;
+  
+  syn->peer_mss = TCPIP_DEFAULT_MSS;
+  syn->peer_wscale = 0;
+  syn->window_scaling = false;
+  syn->sack_permitted = false;
+  
+  size_t len = (buint16_to_uint16(hdr->tcp.control) >> 12) * 4;
+  len = (len > sizeof(tcp_header_t)) ? len - sizeof(tcp_header_t) : 0;
+  if (packet->data_size < TCPIP_HEADER_SIZE + len)
+  {
+    len = (packet->data_size > TCPIP_HEADER_SIZE) ? packet->data_size - TCPIP_HEADER_SIZE : 0;
+  }
+  
+  const uint8_t *opt = hdr->options;
+  size_t pos = 0;
+  while (pos < len && opt[pos] != TCPIP_OPTION_END)
+  {
+    if (opt[pos] == TCPIP_OPTION_NOP)
+    {
+      pos++;
+      continue;
+    }
+    
+    if (pos + 1 >= len || opt[pos + 1] < 2 || pos + opt[pos + 1] > len)
+    {
+      dbg("TCP malformed option %d", opt[pos]);
+      return;
+    }
+    
+    if (opt[pos] == TCPIP_OPTION_MSS && opt[pos + 1] == 4)
+    {
+      uint16_t mss = (opt[pos + 2] << 8) | opt[pos + 3];
+      if (mss > 0) syn->peer_mss = mss;
+    }
+    else if (opt[pos] == TCPIP_OPTION_WSCALE && opt[pos + 1] == 3)
+    {
+      /* Larger shifts are taken as 14, RFC 7323 section 2.3 */
+      syn->peer_wscale = (opt[pos + 2] < 14) ? opt[pos + 2] : 14;
+      syn->window_scaling = true;
+    }
+    else if (opt[pos] == TCPIP_OPTION_SACK_PERMITTED && opt[pos + 1] == 2)
+    {
+      syn->sack_permitted = true;
+    }
+    
+    pos += opt[pos + 1];
+  }
+}
+
+/* Send SYN-ACK for a backlog entry, reusing the buffer of the SYN */
+static void tcp_send_synack(const tcpip_backlog_t *syn, buffer_t *packet)
+{
+  tcpip_conn_t conn = {
+    .listener = syn->listener,
+    .peer = syn->peer,
+    .transfer = TCPIP_NONE,
+    .peer_port = syn->peer_port,
+    .local_wscale = syn->window_scaling ? TCPIP_WINDOW_SCALE : 0,
+    .window_scaling = syn->window_scaling,
+    .tx_sequence = syn->tx_sequence,
+    .rx_sequence = syn->rx_sequence,
+  };
+  
+  packet->data_size = TCPIP_HEADER_SIZE;
+  tcpip_send_ctrl(&conn, packet, TCPIP_CONTROL_SYN | TCPIP_CONTROL_ACK);
+}
+
+/* How much is lost by resetting the connection: nothing much if it is
+ * closing, more if it is sending. Negative if it must not be reset. */
+static int tcp_eviction_cost(const tcpip_conn_t *conn)
+{
+  const tcpip_transfer_t *tx = tcp_transfer(conn);
+  
+  if (!tcp_is_writable(conn))
+  {
+    return 0;
+  }
+  else if (conn->no_evict)
+  {
+    return -1;
+  }
+  else if (!conn->tx_wait &&
+           (!tx || (tx->rtx_count == 0 && tx->ooo_count == 0 && !tx->write_segment)))
+  {
+    return 1;
+  }
+  else
+  {
+    return 2;
+  }
+}
+
+/* Free slot, or else the slot of the connection that is cheapest to
+ * reset, among those that would leave room for the listener's context.
+ * Returns NULL if no connection can be reset. */
+static tcpip_conn_t *allocate_connection(uint8_t listener)
+{
+  int words = g_tcpip_listeners[listener].context_words;
+  tcpip_conn_t *result = NULL;
+  systime_t time_now = get_systime();
+  int victim = -1;
+  int victim_cost = 0;
+  for (int i = 0; i < TCPIP_MAX_CONNECTIONS; i++)
+  {
+    tcpip_conn_t *conn = &g_tcpip_connections[i];
+    if (conn->state == TCPIP_CLOSED)
+    {
+      result = conn;
+      break;
+    }
+    
+    int cost = tcp_eviction_cost(conn);
+    if (cost < 0 || (words > 0 && tcp_find_context(words, conn) < 0))
+    {
+      continue;
+    }
+    
+    if (victim < 0 || cost < victim_cost ||
+        (cost == victim_cost &&
+         time_now - conn->last_event > time_now - g_tcpip_connections[victim].last_event))
+    {
+      victim = i;
+      victim_cost = cost;
+    }
+  }
+  
+  if (!result)
+  {
+    if (victim < 0)
+    {
+      return NULL;
+    }
+    
+    result = &g_tcpip_connections[victim];
+    warn("TCP no free connection slots, resetting port=%d", tcp_local_port(result));
+    tcp_abort(result);
+  }
+  
+  memset(result, 0, sizeof(tcpip_conn_t));
+  result->peer = TCPIP_NONE;
+  result->transfer = TCPIP_NONE;
+  return result;
+}
+
+/* Move a backlog entry to a connection slot once the peer has
+ * acknowledged our SYN. Returns false if there is no room for it. */
+static bool tcp_accept(tcpip_backlog_t *syn)
+{
+  tcpip_conn_t *conn = allocate_connection(syn->listener);
+  if (!conn)
+  {
+    warn("TCP no connection can be reset to make room, refusing port=%d",
+         g_tcpip_listeners[syn->listener].local_port);
+    return false;
+  }
+  
+  conn->listener = syn->listener;
+  if (!tcp_allocate_context(conn))
+  {
+    warn("TCP context pool full, refusing port=%d", tcp_local_port(conn));
+    return false;
+  }
+  
+  /* The entry's reference to the peer moves to the connection */
+  conn->peer = syn->peer;
+  syn->listener = TCPIP_NONE;
+  
+  conn->state = TCPIP_ESTABLISHED;
+  conn->peer_port = syn->peer_port;
+  conn->peer_mss = syn->peer_mss;
+  conn->window_scaling = syn->window_scaling;
+  conn->sack_permitted = syn->sack_permitted;
+  if (syn->window_scaling)
+  {
+    conn->peer_wscale = syn->peer_wscale;
+    conn->local_wscale = TCPIP_WINDOW_SCALE;
+  }
+  
+  /* The window in the SYN was not scaled */
+  conn->peer_window = syn->peer_window >> conn->peer_wscale;
+  conn->peer_max_window = conn->peer_window;
+  conn->rx_sequence = syn->rx_sequence;
+  conn->tx_sequence = syn->tx_sequence + 1;
+  conn->last_ack_sent = syn->rx_sequence;
+  conn->last_ack_received = conn->tx_sequence;
+  conn->last_event = get_systime();
+  
+  dbg("TCP connected port=%d", tcp_local_port(conn));
+  tcp_notify(conn, NULL);
+  return true;
+}
+
+/* Answer a SYN from the backlog, without taking a connection slot. A
+ * repeated SYN gets the same SYN-ACK again. */
+static void handle_tcp_syn(buffer_t *packet)
+{
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (void*)packet->data;
+  
+  for (int i = 0; i < TCPIP_MAX_LISTENERS; i++)
+  {
+    if (g_tcpip_listeners[i].local_port == buint16_to_uint16(hdr->tcp.dest_port))
+    {
+      uint16_t peer_port = buint16_to_uint16(hdr->tcp.source_port);
+      uint32_t rx_sequence = buint32_to_uint32(hdr->tcp.sequence) + 1;
+      
+      /* A new connection from the same port ends the old one's TIME_WAIT */
+      tcpip_timewait_t *tw = tcp_find_timewait(tcp_find_peer(&hdr->ipv6.source),
+                                               peer_port, g_tcpip_listeners[i].local_port);
+      if (tw)
+      {
+        tcp_free_timewait(tw);
+      }
+      
+      tcpip_backlog_t *syn = tcp_find_backlog(tcp_find_peer(&hdr->ipv6.source), peer_port,
+                                              g_tcpip_listeners[i].local_port);
+      if (!syn || syn->rx_sequence != rx_sequence)
+      {
+        uint8_t peer = tcp_intern_peer(&hdr->ipv6.source, &hdr->eth.mac_src);
+        if (peer == TCPIP_NONE)
+        {
+          warn("TCP peer table full, refusing port=%d", g_tcpip_listeners[i].local_port);
+          tcp_send_rst(packet);
+          return;
+        }
+        
+        if (syn)
+        {
+          tcp_free_backlog(syn);
+        }
+        else
+        {
+          syn = tcp_allocate_backlog();
+        }
+        
+        syn->listener = i;
+        syn->peer = peer;
+        syn->peer_port = peer_port;
+        syn->rx_sequence = rx_sequence;
+        syn->tx_sequence = rx_sequence + get_systime();
+      }
+      
+      syn->peer_window = buint16_to_uint16(hdr->tcp.window_size);
+      syn->time = get_systime();
+      tcp_parse_syn_options(packet, syn);
+      tcp_send_synack(syn, packet);
+      return;
+    }
+  }
+  
+  // No matching listener found, send RST
+  warn("TCP no matching listener port=%d", buint16_to_uint16(hdr->tcp.dest_port));
+  tcp_send_rst(packet);
+}
+
+/* End sequence number of a data segment kept for retransmission */
+static uint32_t tcp_segment_end(const buffer_t *packet)
+{
+  const struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (const void*)packet->data;
+  
+  size_t header_len = (buint16_to_uint16(hdr->tcp.control) >> 12) * 4;
+  size_t payload_len = buint16_to_uint16(hdr->ipv6.payload_length) - header_len;
+  return buint32_to_uint32(hdr->tcp.sequence) + payload_len;
+}
+
+/* Resend the oldest unacknowledged segment with the current ACK number.
+ * Returns false if the previous copy is still waiting in usbnet, as the
+ * buffer can be in only one queue at a time. */
+static bool tcp_retransmit(tcpip_conn_t *conn, tcpip_transfer_t *tx)
+{
+  buffer_t *packet = tx->rtx_queue[0];
+  if (buffer_get_refcount(packet) > 1)
+  {
+    return false;
+  }
+  
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (void*)packet->data;
+  
+  dbg("TCP retransmit seq=%08x", (unsigned)buint32_to_uint32(hdr->tcp.sequence));
+  
+  hdr->tcp.ack = uint32_to_buint32(conn->rx_sequence);
+  hdr->tcp.checksum = tcp_checksum(packet);
+  conn->last_ack_sent = conn->rx_sequence;
+  
+  /* Karn's algorithm: the ACK could be for either copy, so don't time it */
+  tx->rtt_active = false;
+  
+  usbnet_transmit(buffer_retain(packet), USBNET_PRIO_BULK);
+  return true;
+}
+
+/* Update the smoothed RTT and the retransmission timeout, RFC 6298 */
+static void tcp_update_rto(tcpip_transfer_t *tx, systime_t rtt)
+{
+  if (tx->srtt == 0)
+  {
+    tx->srtt = rtt;
+    tx->rttvar = rtt / 2;
+  }
+  else
+  {
+    systime_t delta = (tx->srtt > rtt) ? tx->srtt - rtt : rtt - tx->srtt;
+    tx->rttvar = (3 * tx->rttvar + delta) / 4;
+    tx->srtt = (7 * tx->srtt + rtt) / 8;
+  }
+  
+  tx->rto = tx->srtt + 4 * tx->rttvar;
+  if (tx->rto < TCPIP_RTO_MIN) tx->rto = TCPIP_RTO_MIN;
+  if (tx->rto > TCPIP_RTO_MAX) tx->rto = TCPIP_RTO_MAX;
+}
+
+/* Grow the congestion window for newly acknowledged data: by the acked
+ * amount in slow start, and by about a segment per RTT in congestion
+ * avoidance. */
+static void tcp_grow_cwnd(const tcpip_conn_t *conn, tcpip_transfer_t *tx, uint32_t acked)
+{
+  uint32_t mss = tcpip_max_segment(conn);
+  uint32_t cwnd = tx->cwnd;
+  
+  if (cwnd < tx->ssthresh)
+  {
+    cwnd += (acked < mss) ? acked : mss;
+  }
+  else
+  {
+    cwnd += mss * mss / cwnd + 1;
+  }
+  
+  tx->cwnd = (cwnd < UINT16_MAX) ? cwnd : UINT16_MAX;
+}
+
+/* Halve the window on loss. After a timeout, start again from one
+ * segment. */
+static void tcp_shrink_cwnd(tcpip_conn_t *conn, tcpip_transfer_t *tx, bool timeout)
+{
+  uint32_t mss = tcpip_max_segment(conn);
+  uint32_t in_flight = conn->tx_sequence - conn->last_ack_received;
+  uint32_t ssthresh = in_flight / 2;
+  if (ssthresh < 2 * mss) ssthresh = 2 * mss;
+  if (ssthresh > UINT16_MAX) ssthresh = UINT16_MAX;
+  
+  tx->ssthresh = ssthresh;
+  tx->cwnd = timeout ? mss : ssthresh;
+}
+
+/* Resend the oldest segment and remember which data was in flight then.
+ * ACKs that advance but stay below it show that the next segment was lost
+ * also, as in NewReno, RFC 6582. */
+static bool tcp_start_recovery(tcpip_conn_t *conn, tcpip_transfer_t *tx)
+{
+  tx->recovering = true;
+  tx->recover_sequence = conn->tx_sequence;
+  return tcp_retransmit(conn, tx);
+}
+
+/* Release acknowledged segments, or count a duplicate ACK. A duplicate
+ * is an ACK without data that does not advance or change the window while
+ * data is in flight. */
+static void tcp_handle_ack(tcpip_conn_t *conn, uint32_t ack, uint16_t window, bool maybe_dup)
+{
+  if (seq_before(ack, conn->last_ack_received))
+  {
+    /* Old segment, its window is out of date too */
+    return;
+  }
+  
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  bool window_changed = (window != conn->peer_window);
+  if (window_changed && tx && tx->rtx_count == 0)
+  {
+    /* Restart window probing from the shortest interval */
+    tx->rtx_retries = 0;
+  }
+  
+  conn->peer_window = window;
+  if (window > conn->peer_max_window)
+  {
+    conn->peer_max_window = window;
+  }
+  
+  if (seq_before(conn->last_ack_received, ack) && !seq_before(conn->tx_sequence, ack))
+  {
+    uint32_t acked = ack - conn->last_ack_received;
+    conn->last_ack_received = ack;
+    
+    if (!tx)
+    {
+      /* Nothing was kept for retransmission */
+      return;
+    }
+    
+    systime_t now = get_systime();
+    tcp_grow_cwnd(conn, tx, acked);
+    tx->dup_acks = 0;
+    tx->rtx_retries = 0;
+    tx->rtx_time = now;
+    
+    while (tx->rtx_count > 0 && !seq_before(ack, tcp_segment_end(tx->rtx_queue[0])))
+    {
+      buffer_release(tx->rtx_queue[0]);
+      tx->rtx_count--;
+      memmove(&tx->rtx_queue[0], &tx->rtx_queue[1], tx->rtx_count * sizeof(buffer_t*));
+      tx->rtx_queue[tx->rtx_count] = NULL;
+    }
+    
+    if (tx->rtt_active && !seq_before(ack, tx->rtt_sequence))
+    {
+      tcp_update_rto(tx, now - tx->rtt_start);
+      tx->rtt_active = false;
+    }
+    
+    if (tx->recovering)
+    {
+      if (seq_before(ack, tx->recover_sequence) && tx->rtx_count > 0)
+      {
+        tcp_retransmit(conn, tx);
+      }
+      else
+      {
+        tx->recovering = false;
+      }
+    }
+  }
+  else if (tx && ack == conn->last_ack_received && maybe_dup && !window_changed &&
+           tx->rtx_count > 0)
+  {
+    int threshold = TCPIP_DUPACK_THRESHOLD;
+    if (tx->rtx_count <= threshold)
+    {
+      threshold = (tx->rtx_count > 1) ? tx->rtx_count - 1 : 1;
+    }
+    
+    /* Duplicates of the segments resent in the last recovery also ACK
+     * recover_sequence, and with one segment in flight they would start
+     * another, RFC 6582 section 4.2 */
+    tx->dup_acks++;
+    if (tx->dup_acks == threshold && !tx->recovering && ack != tx->recover_sequence)
+    {
+      dbg("TCP fast retransmit after %d duplicate ACKs", threshold);
+      tcp_shrink_cwnd(conn, tx, false);
+      tcp_start_recovery(conn, tx);
+    }
+  }
+}
+
+/* While the peer's window is too small to send into and there is no
+ * data in flight to bring ACKs, probe it with the sequence number of the
+ * last acknowledged byte. That is outside the window, so the peer replies
+ * with an ACK that carries its current window. The interval backs off
+ * like the RTO, but the connection is not closed for it. */
+static void tcp_check_persist_timer(tcpip_conn_t *conn, tcpip_transfer_t *tx, systime_t now)
+{
+  if (!conn->tx_wait || tcp_sws_allows(conn, tcp_peer_window(conn)))
+  {
+    if (tx) tx->rtx_time = now;
+    return;
+  }
+  
+  if (!tx)
+  {
+    /* Start the timer once the connection has a block for it */
+    tx = tcp_acquire_transfer(conn);
+    if (tx) tx->rtx_time = now;
+    return;
+  }
+  
+  systime_t interval = tx->rto;
+  for (int i = 0; i < tx->rtx_retries && interval < TCPIP_RTO_MAX; i++)
+  {
+    interval *= 2;
+  }
+  
+  if (now - tx->rtx_time < interval)
+  {
+    return;
+  }
+  
+  dbg("TCP window probe, peer window %d", (int)tcp_peer_window(conn));
+  tx->rtx_time = now;
+  if (tx->rtx_retries < UINT8_MAX) tx->rtx_retries++;
+  
+  conn->tx_sequence--;
+  tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_ACK);
+  conn->tx_sequence++;
+}
+
+/* Resend our FIN, which has the sequence number before tx_sequence */
+static bool tcp_retransmit_fin(tcpip_conn_t *conn)
+{
+  dbg("TCP retransmit FIN");
+  conn->tx_sequence--;
+  tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_FIN | TCPIP_CONTROL_ACK);
+  conn->tx_sequence++;
+  return true;
+}
+
+/* Resend the oldest segment, or the FIN once all data is acknowledged,
+ * when its timer expires, backing off exponentially. Gives up after
+ * TCPIP_MAX_RETRIES timeouts. */
+static void tcp_check_rtx_timer(tcpip_conn_t *conn)
+{
+  systime_t now = get_systime();
+  tcpip_transfer_t *tx = tcp_transfer(conn);
+  if (!tx && tcp_fin_pending(conn))
+  {
+    /* FIN was sent while all blocks were busy, start timing it now */
+    tx = tcp_acquire_transfer(conn);
+    if (tx) tx->rtx_time = now;
+    return;
+  }
+  
+  if (!tx || (tx->rtx_count == 0 && !tcp_fin_pending(conn)))
+  {
+    tcp_check_persist_timer(conn, tx, now);
+    return;
+  }
+  
+  if (now - tx->rtx_time < tx->rto)
+  {
+    return;
+  }
+  
+  if (tx->rtx_retries >= TCPIP_MAX_RETRIES)
+  {
+    warn("TCP resetting connection due to not getting ACKs");
+    tcp_abort(conn);
+    return;
+  }
+  
+  tx->rtx_time = now;
+  if (tx->rtx_count > 0 ? tcp_start_recovery(conn, tx) : tcp_retransmit_fin(conn))
+  {
+    if (tx->rtx_retries == 0)
+    {
+      tcp_shrink_cwnd(conn, tx, true);
+    }
+    
+    tx->rtx_retries++;
+    tx->rto *= 2;
+    if (tx->rto > TCPIP_RTO_MAX) tx->rto = TCPIP_RTO_MAX;
+  }
+}
+
+/* Keep a segment that arrived after a gap until the gap fills. When the
+ * queue is full, the segment furthest ahead is dropped. Segments outside
+ * the window, or that would take the last receive buffer, are dropped
+ * too, and the peer will resend them. So are segments that arrive while
+ * all transfer blocks are busy. */
+static void tcp_ooo_push(tcpip_conn_t *conn, buffer_t *packet)
+{
+  uint32_t sequence = tcp_segment_sequence(packet);
+  tcpip_transfer_t *tx = NULL;
+  
+  if (sequence - conn->rx_sequence >= TCPIP_WINDOW_SIZE ||
+      buffer_available(USBNET_BUFFER_SIZE, BUFFER_CLASS_RX) == 0 ||
+      !(tx = tcp_acquire_transfer(conn)))
+  {
+    dbg("TCP dropping out-of-order segment %08x", (unsigned)sequence);
+    buffer_release(packet);
+    return;
+  }
+  
+  int pos = 0;
+  while (pos < tx->ooo_count && seq_before(tcp_segment_sequence(tx->ooo_queue[pos]), sequence))
+  {
+    pos++;
+  }
+  
+  if ((pos < tx->ooo_count && tcp_segment_sequence(tx->ooo_queue[pos]) == sequence) ||
+      pos == TCPIP_OOO_QUEUE)
+  {
+    /* Duplicate, or beyond all queued segments */
+    buffer_release(packet);
+    return;
+  }
+  
+  if (tx->ooo_count == TCPIP_OOO_QUEUE)
+  {
+    buffer_release(tx->ooo_queue[--tx->ooo_count]);
+  }
+  
+  for (int i = tx->ooo_count; i > pos; i--)
+  {
+    tx->ooo_queue[i] = tx->ooo_queue[i - 1];
+  }
+  
+  tx->ooo_queue[pos] = packet;
+  tx->ooo_count++;
+  dbg("TCP queued out-of-order segment %08x, count %d", (unsigned)sequence, tx->ooo_count);
+}
+
+/* Pass a received segment that starts at or before rx_sequence to the
+ * callback. The part that was already received is skipped, and data that
+ * arrives after the application has closed is discarded. */
+static void tcp_deliver(tcpip_conn_t *conn, buffer_t *packet)
+{
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (void*)packet->data;
+  
+  uint16_t control = buint16_to_uint16(hdr->tcp.control);
+  uint32_t skip = conn->rx_sequence - buint32_to_uint32(hdr->tcp.sequence);
+  size_t data_offset = (sizeof(ethernet_header_t) + sizeof(ipv6_header_t) +
+                        (control >> 12) * 4);
+  size_t data_len = packet->data_size - data_offset;
+  
+  if (skip > data_len)
+  {
+    /* Everything including the FIN has been received already */
+    buffer_release(packet);
+    return;
+  }
+  
+  data_offset += skip;
+  data_len -= skip;
+  
+  if (data_len)
+  {
+    if (conn->last_ack_sent == conn->rx_sequence)
+    {
+      conn->ack_time = get_systime();
+    }
+    
+    conn->rx_sequence += data_len;
+  }
+  
+  if (data_len && conn->state == TCPIP_ESTABLISHED)
+  {
+    if (data_offset > TCPIP_HEADER_SIZE)
+    {
+      memmove(&packet->data[TCPIP_HEADER_SIZE], &packet->data[data_offset], data_len);
+      packet->data_size = TCPIP_HEADER_SIZE + data_len;
+    }
+    
+    buffer_t *payload = buffer_slice(packet, TCPIP_HEADER_SIZE, 0);
+    tcp_notify(conn, payload);
+  }
+  else
+  {
+    buffer_release(packet);
+  }
+  
+  if ((control & TCPIP_CONTROL_FIN) &&
+      (conn->state == TCPIP_ESTABLISHED || conn->state == TCPIP_FIN_WAIT_1))
+  {
+    conn->rx_sequence++;
+    
+    if (conn->state == TCPIP_ESTABLISHED)
+    {
+      dbg("TCP port=%d peer closed", tcp_local_port(conn));
+      conn->state = TCPIP_CLOSE_WAIT;
+      tcp_notify(conn, NULL);
+    }
+    else
+    {
+      conn->state = TCPIP_CLOSING;
+    }
+    
+    /* Acknowledge the FIN at once, unless our own FIN just did */
+    if (conn->state != TCPIP_CLOSED && conn->last_ack_sent != conn->rx_sequence)
+    {
+      tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_ACK);
+    }
+  }
+}
+
+/* Deliver queued segments that are no longer after a gap */
+static void tcp_ooo_deliver(tcpip_conn_t *conn)
+{
+  tcpip_transfer_t *tx;
+  while (conn->state == TCPIP_ESTABLISHED && (tx = tcp_transfer(conn)) && tx->ooo_count > 0 &&
+         !seq_before(conn->rx_sequence, tcp_segment_sequence(tx->ooo_queue[0])))
+  {
+    buffer_t *packet = tx->ooo_queue[0];
+    tx->ooo_count--;
+    for (int i = 0; i < tx->ooo_count; i++)
+    {
+      tx->ooo_queue[i] = tx->ooo_queue[i + 1];
+    }
+    tx->ooo_queue[tx->ooo_count] = NULL;
+    
+    tcp_deliver(conn, packet);
+  }
+}
+
+static void handle_tcp_active(buffer_t *packet)
+{
+  struct {
+    ethernet_header_t eth;
+    ipv6_header_t ipv6;
+    tcp_header_t tcp;
+  } *hdr = (void*)packet->data;
+  
+  uint16_t control = buint16_to_uint16(hdr->tcp.control);
+  uint32_t sequence = buint32_to_uint32(hdr->tcp.sequence);
+  uint32_t data_offset = (sizeof(ethernet_header_t) + sizeof(ipv6_header_t) +
+                          (buint16_to_uint16(hdr->tcp.control) >> 12) * 4);
+  size_t data_len = packet->data_size - data_offset;
+  uint8_t peer = tcp_find_peer(&hdr->ipv6.source);
+  
+  for (int i = 0; i < TCPIP_MAX_CONNECTIONS && peer != TCPIP_NONE; i++)
+  {
+    tcpip_conn_t *conn = &g_tcpip_connections[i];
+    if (conn->state != TCPIP_CLOSED && conn->peer == peer &&
+        conn->peer_port == buint16_to_uint16(hdr->tcp.source_port) &&
+        tcp_local_port(conn) == buint16_to_uint16(hdr->tcp.dest_port))
+    {
+      if (control & TCPIP_CONTROL_ACK)
+      {
+        bool maybe_dup = data_len == 0 &&
+                         !(control & (TCPIP_CONTROL_FIN | TCPIP_CONTROL_RST));
+        tcp_handle_ack(conn, buint32_to_uint32(hdr->tcp.ack),
+                       buint16_to_uint16(hdr->tcp.window_size), maybe_dup);
+        
+        if (tcp_fin_pending(conn) && conn->last_ack_received == conn->tx_sequence &&
+            !(control & TCPIP_CONTROL_RST))
+        {
+          /* Our FIN is acknowledged */
+          if (conn->state == TCPIP_LAST_ACK)
+          {
+            dbg("TCP port=%d closed", tcp_local_port(conn));
+            tcp_release_connection(conn);
+            buffer_release(packet);
+          }
+          else
+          {
+            tcpip_state_t next = (conn->state == TCPIP_CLOSING) ? TCPIP_TIME_WAIT : TCPIP_FIN_WAIT_2;
+            handle_tcp_timewait(tcp_enter_timewait(conn, next), packet);
+          }
+          
+          return;
+        }
+      }
+      
+      conn->last_event = get_systime();
+      dbg("TCP data len=%d to port=%d", (int)data_len, tcp_local_port(conn));
+      
+      /* FIN takes one sequence number after the data */
+      uint32_t segment_len = data_len + ((control & TCPIP_CONTROL_FIN) ? 1 : 0);
+      
+      if (control & TCPIP_CONTROL_RST)
+      {
+        dbg("TCP port=%d reset by peer", tcp_local_port(conn));
+        buffer_release(packet);
+        tcp_release_connection(conn);
+      }
+      else if (segment_len == 0)
+      {
+        buffer_release(packet);
+      }
+      else if (!seq_before(conn->rx_sequence, sequence + segment_len))
+      {
+        /* Our ACK was probably lost, repeat it */
+        warn("Ignoring TCP resend");
+        buffer_release(packet);
+        tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_ACK);
+      }
+      else if (seq_before(conn->rx_sequence, sequence))
+      {
+        /* Segment after a gap. The duplicate ACK tells the peer what is
+         * missing, RFC 5681 section 4.2. */
+        dbg("TCP out of order: expected %08x, got %08x",
+            (unsigned)conn->rx_sequence, (unsigned)sequence);
+        if (conn->state == TCPIP_ESTABLISHED)
+        {
+          tcp_ooo_push(conn, packet);
+        }
+        else
+        {
+          buffer_release(packet);
+        }
+        
+        tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_ACK);
+      }
+      else
+      {
+        tcpip_transfer_t *tx = tcp_transfer(conn);
+        bool gap_filled = tx && tx->ooo_count > 0;
+        tcp_deliver(conn, packet);
+        tcp_ooo_deliver(conn);
+        
+        if (gap_filled && conn->state == TCPIP_ESTABLISHED)
+        {
+          /* Tell the peer at once that the loss is repaired */
+          tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_ACK);
+        }
+      }
+      
+      return;
+    }
+  }
+  
+  tcpip_backlog_t *syn = tcp_find_backlog(peer, buint16_to_uint16(hdr->tcp.source_port),
+                                          buint16_to_uint16(hdr->tcp.dest_port));
+  if (syn && (control & TCPIP_CONTROL_RST))
+  {
+    tcp_free_backlog(syn);
+    buffer_release(packet);
+    return;
+  }
+  
+  if (syn && (control & TCPIP_CONTROL_ACK) &&
+      buint32_to_uint32(hdr->tcp.ack) == syn->tx_sequence + 1)
+  {
+    if (tcp_accept(syn))
+    {
+      /* The segment can carry data already */
+      handle_tcp_active(packet);
+    }
+    else
+    {
+      tcp_free_backlog(syn);
+      tcp_send_rst(packet);
+    }
+    
+    return;
+  }
+  
+  tcpip_timewait_t *tw = tcp_find_timewait(peer, buint16_to_uint16(hdr->tcp.source_port),
+                                           buint16_to_uint16(hdr->tcp.dest_port));
+  if (tw)
+  {
+    handle_tcp_timewait(tw, packet);
+    return;
+  }
+  
+  if (control & TCPIP_CONTROL_RST)
+  {
+    buffer_release(packet);
+    return;
+  }
+  
+  if ((control & TCPIP_CONTROL_ACK) && data_len == 0)
+  {
+    // Late ACK for a connection that is gone, ignore
+    buffer_release(packet);
+    return;
+  }
+  
+  // No matching connection, reply with RST
+  warn("TCP no matching connection port=%d", buint16_to_uint16(hdr->tcp.dest_port));
   tcp_send_rst(packet);
 }
 
-// Give all active connections a chance to do their processing
+// Give waiting connections a chance to transmit, send the segments that
+// tcpip_write() has not filled in time, and send the delayed ACKs that no
+// data segment has carried
 static void tcp_poll()
 {
+  tcp_service_tx_waiters();
+  
+  systime_t now = get_systime();
   for (int i = 0; i < TCPIP_MAX_CONNECTIONS; i++)
   {
     tcpip_conn_t *conn = &g_tcpip_connections[i];
   
-    if (conn->state == TCPIP_ESTABLISHED)
+    if (conn->state != TCPIP_CLOSED)
     {
-      conn->callback(conn, NULL);
-      
-      if (conn->last_ack_sent != conn->rx_sequence)
+      tcpip_transfer_t *tx = tcp_transfer(conn);
+      if (tx && tx->write_segment && now - tx->write_time >= TCPIP_WRITE_DELAY)
       {
-        // Ack the received data so far
-        tcpip_send(conn, NULL);
+        tcpip_push(conn);
       }
       
-      if (conn->tx_sequence > conn->last_ack_received + 2 * TCPIP_WINDOW_SIZE)
+      if (conn->last_ack_sent != conn->rx_sequence &&
+          (conn->rx_sequence - conn->last_ack_sent >= 2 * TCPIP_RECEIVE_MSS ||
+           now - conn->ack_time >= TCPIP_ACK_DELAY))
       {
-        warn("TCP closing connection due to not getting ACKs");
-        tcpip_close(conn);
+        tcpip_send_ctrl(conn, NULL, TCPIP_CONTROL_ACK);
       }
+      
+      tcp_check_rtx_timer(conn);
     }
   }
+  
+  tcp_timewait_poll();
+  tcp_backlog_poll();
 }
 
 static void handle_tcp(buffer_t *packet)
@@ -702,6 +2419,11 @@ static void handle_ipv6(buffer_t *packet)
   }
 }
 
+void tcpip_get_stats(tcpip_stats_t *stats)
+{
+  *stats = g_tcpip_stats;
+}
+
 void tcpip_poll()
 {
   if (!usbnet_is_connected())
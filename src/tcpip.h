@@ -7,65 +7,240 @@
 
 #define TCPIP_HEADER_SIZE (14+40+20)
 #define TCPIP_MAX_PAYLOAD (USBNET_BUFFER_SIZE - TCPIP_HEADER_SIZE)
+
+/* Receive window. Above 65535 it needs TCPIP_WINDOW_SCALE, and builds
+ * with larger buffer pools can raise both. */
+#ifndef TCPIP_WINDOW_SIZE
 #define TCPIP_WINDOW_SIZE 16384
-#define TCPIP_MAX_CONNECTIONS 4
+#endif
+
+/* Shift of our window when the peer sends the window scale option,
+ * RFC 7323, at most 14. Peers that don't scale are offered at most 65535. */
+#ifndef TCPIP_WINDOW_SCALE
+#define TCPIP_WINDOW_SCALE 0
+#endif
+
+/* Largest segment accepted from the peer, sent in the MSS option */
+#define TCPIP_RECEIVE_MSS (USBNET_MAX_FRAME_SIZE - TCPIP_HEADER_SIZE)
+
+/* Largest segment sent to a peer that gives no MSS option, from the
+ * IPv6 minimum MTU, RFC 8200 */
+#define TCPIP_DEFAULT_MSS 1220
+
+#define TCPIP_MAX_CONNECTIONS 12
 #define TCPIP_MAX_LISTENERS 8
-#define TCPIP_CONTEXT_WORDS 8
+
+/* Distinct peer addresses with connections or TIME_WAIT entries */
+#define TCPIP_MAX_PEERS 4
+
+/* Words of application context shared by all connections. Each connection
+ * takes the number of words given for its listener, and http needs four,
+ * or five on 64-bit hosts where its handler pointer takes two. */
+#define TCPIP_CONTEXT_POOL_WORDS ((3 + sizeof(uintptr_t) / 4) * TCPIP_MAX_CONNECTIONS)
+
+/* Connections with unacknowledged data, out-of-order segments, a FIN to
+ * resend or a closed window to probe need a transfer block. An idle
+ * connection keeps its block until another connection needs it. Only
+ * three segments can be in transmit buffers at a time, so more blocks
+ * would not let more connections send at once. */
+#define TCPIP_TRANSFER_BLOCKS 3
+
+/* Index for no peer, listener or transfer block */
+#define TCPIP_NONE 0xFF
+
+/* Sent data segments are kept until acknowledged, atmost this many
+ * per connection. */
+#define TCPIP_RTX_QUEUE 4
+
+/* Segments received after a gap are kept until it fills, atmost this
+ * many per connection. */
+#define TCPIP_OOO_QUEUE 2
+
+/* Retransmission timeout limits in microseconds, RFC 6298 */
+#define TCPIP_RTO_INITIAL 1000000
+#define TCPIP_RTO_MIN 200000
+#define TCPIP_RTO_MAX 30000000
+
+/* Connection is closed after this many timeouts of the same segment */
+#define TCPIP_MAX_RETRIES 6
+
+/* Congestion window at the start of a connection in segments, RFC 3390 */
+#define TCPIP_INITIAL_CWND_SEGMENTS 4
+
+/* Received data is acknowledged once two full segments are unacknowledged,
+ * or after this many microseconds unless a reply carries the ACK sooner,
+ * RFC 1122 section 4.2.3.2 */
+#define TCPIP_ACK_DELAY 40000
+
+/* Segments partially filled by tcpip_write() are sent after this many
+ * microseconds unless they are filled or pushed sooner */
+#define TCPIP_WRITE_DELAY 10000
+
+/* Duplicate ACKs that trigger fast retransmit. With fewer segments in
+ * flight one less than their count is used, RFC 5827. */
+#define TCPIP_DUPACK_THRESHOLD 3
+
+/* Connections in FIN_WAIT_2 and TIME_WAIT leave the connection table for
+ * small entries, atmost this many. The entry of a connection is dropped
+ * when this many microseconds pass without segments from the peer, or
+ * earlier if the entry is needed for another connection. */
+#define TCPIP_TIME_WAIT_SLOTS 4
+#define TCPIP_TIME_WAIT_TIMEOUT 10000000
+
+/* Received SYNs wait in small entries until the handshake completes, and
+ * only then take a connection slot. Atmost this many are kept, each for
+ * this many microseconds, and a new SYN replaces the oldest when all are
+ * taken. */
+#define TCPIP_LISTEN_BACKLOG 4
+#define TCPIP_SYN_TIMEOUT 5000000
 
 extern ipv6_addr_t g_local_ipv6_addr;
 extern mac_addr_t g_local_mac_addr;
 
 /* Callback for connection handling. Data will be a pointer to received
- * data, or NULL if this is just a poll call. */
+ * data, or NULL if this is just a poll call or the state changed.
+ * When the peer closes its side, the callback is called in CLOSE_WAIT and
+ * can still send, until it calls tcpip_close(). The last call is made
+ * when the connection is closed or reset, with a state other than
+ * ESTABLISHED or CLOSE_WAIT. */
 struct _tcpip_conn_t;
 typedef void (*tcpip_callback_t)(struct _tcpip_conn_t *conn, buffer_t *payload);
 
+/* States of RFC 793. FIN_WAIT_2 and TIME_WAIT are only used by the
+ * compact entries. */
 typedef enum {
   TCPIP_CLOSED = 0,
   TCPIP_ESTABLISHED,
+  TCPIP_CLOSE_WAIT, /* Peer has sent FIN */
+  TCPIP_LAST_ACK,   /* Both have sent FIN, peer first, ours is unacknowledged */
+  TCPIP_FIN_WAIT_1, /* Our FIN is unacknowledged */
+  TCPIP_CLOSING,    /* Both have sent FIN, ours first and unacknowledged */
+  TCPIP_FIN_WAIT_2, /* Our FIN is acknowledged, waiting for the peer's */
+  TCPIP_TIME_WAIT,  /* Both FINs acknowledged, repeating the last ACK */
 } tcpip_state_t;
 
+/* Connection state that is needed for the whole connection. The local
+ * port and callback come from the listener, the peer address from the
+ * peer table, and retransmission state from a transfer block, which are
+ * all referred to by index. 48 bytes on Cortex-M0. */
 typedef struct _tcpip_conn_t {
-  tcpip_state_t state;
-  tcpip_callback_t callback;
-  ipv6_addr_t peer_addr;
-  mac_addr_t peer_mac;
+  uint8_t state; /* tcpip_state_t */
+  uint8_t listener;
+  uint8_t peer;
+  uint8_t transfer; /* TCPIP_NONE if the connection has none */
   uint16_t peer_port;
-  uint16_t local_port;
+  uint16_t peer_window; /* Receive window advertised by the peer, unscaled */
+  uint16_t peer_max_window; /* Largest peer_window so far, unscaled */
+  uint16_t peer_mss; /* From the peer's SYN, or TCPIP_DEFAULT_MSS */
+  uint8_t peer_wscale; /* Shift of peer_window, RFC 7323 */
+  uint8_t local_wscale; /* Shift of our advertised window */
   uint32_t tx_sequence;
   uint32_t rx_sequence;
   uint32_t last_ack_sent;
   uint32_t last_ack_received;
   systime_t last_event;
+  systime_t ack_time; /* Reception of the oldest unacknowledged data */
+  bool tx_wait; /* Callback requested by tcpip_wait_tx() */
+  bool no_evict; /* Set by tcpip_set_evictable() */
+  bool window_scaling; /* Both sides sent the window scale option */
+  bool sack_permitted; /* Peer accepts SACK blocks, RFC 2018 */
   
-  /* Place for other modules to store per-connection data. */
-  uint32_t context[TCPIP_CONTEXT_WORDS];
+  /* Words of per-connection data for the application, as many as it
+   * asked for when registering the listener. Zeroed on connect. */
+  uint32_t *context;
 } tcpip_conn_t;
 
 typedef struct {
   uint16_t local_port;
+  uint8_t context_words;
   tcpip_callback_t callback;
 } tcpip_listener_t;
 
-/* Register TCP listener for a port */
-void tcpip_register_listener(uint16_t port, tcpip_callback_t callback);
+/* Counts of sent ACKs. A pure ACK is a segment with no data, SYN or FIN.
+ * A piggybacked ACK is a data segment that acknowledges new data. */
+typedef struct {
+  uint32_t pure_acks;
+  uint32_t piggybacked_acks;
+} __attribute__((packed)) tcpip_stats_t;
+
+/* Module initialization */
+void tcpip_init();
+
+/* Register TCP listener for a port. Connections to it get context_words
+ * words of conn->context, and are refused when the context pool cannot
+ * fit them. */
+void tcpip_register_listener(uint16_t port, tcpip_callback_t callback,
+                             uint8_t context_words);
 
 /* Allocate a buffer that can later be given to tcpip_send().
+ * Site identifies the caller in buffer statistics, normally BUFFER_SITE_TCPIP_TX.
  * Safe to call from IRQs.
  */
-buffer_t *tcpip_allocate(size_t size);
+buffer_t *tcpip_allocate(size_t size, buffer_site_t site);
 
 /* Release a received or otherwise allocated tcpip buffer. */
 void tcpip_release(buffer_t *buffer);
 
 /* Fill in the TCP headers and transmit the payload.
- * Buffer must have been allocated using tcpip_allocate().
+ * Buffer must have been allocated using tcpip_allocate(). The buffer is
+ * kept for retransmission until the peer acknowledges it.
+ * If tcpip_write() is filling a segment, a payload that fits is copied to
+ * it and the buffer released. Otherwise that segment is sent first.
+ * Returns false if the segment could not be kept for retransmission,
+ * because the retransmission queue is full or there is no buffer. Then
+ * nothing was sent and the payload has been released. Checking
+ * tcpip_send_space() first avoids this.
+ */
+bool tcpip_send(tcpip_conn_t *conn, buffer_t *payload);
+
+/* Copy data to the end of the segment the connection is filling, and
+ * start new segments as they fill up to tcpip_max_segment(). A segment is
+ * sent when it is full, on tcpip_push(), or TCPIP_WRITE_DELAY after its
+ * first write, so that small writes share frames. Like tcpip_send(), this
+ * does not check the send space.
+ * Returns the number of bytes taken, less than len if no buffer was free
+ * or the retransmission queue has no room for another segment.
+ */
+size_t tcpip_write(tcpip_conn_t *conn, const void *data, size_t len);
+
+/* Send the segment that tcpip_write() is filling now, if there is one */
+void tcpip_push(tcpip_conn_t *conn);
+
+/* Largest payload to send in one segment on the connection, the peer's
+ * MSS or TCPIP_MAX_PAYLOAD if that is smaller. */
+size_t tcpip_max_segment(const tcpip_conn_t *conn);
+
+/* Number of payload bytes the connection can send now without exceeding
+ * the peer's receive window or the congestion window. Producers should
+ * not send more, and should check again before each segment.
  */
-void tcpip_send(tcpip_conn_t *conn, buffer_t *payload);
+size_t tcpip_send_space(const tcpip_conn_t *conn);
 
-/* Close a currently open connection and return it to listeners. */
+/* Request a poll callback (with NULL payload) when there is transmit
+ * credit available and the send space fits a full segment. The request
+ * is cleared when the callback is called, so streaming producers renew
+ * it each time they have more to send. While the peer's window is
+ * closed, the connection probes it until it opens again.
+ */
+void tcpip_wait_tx(tcpip_conn_t *conn);
+
+/* When a handshake completes while all connection slots are in use, a
+ * connection is reset to make room: one that is closing, else one that
+ * is idle, else one that is sending, the least recently active first.
+ * A connection marked non-evictable, like one in the middle of a stream,
+ * is not reset until it closes. If all are marked, the new connection
+ * is refused. */
+void tcpip_set_evictable(tcpip_conn_t *conn, bool evictable);
+
+/* Send FIN after the data sent so far, in ESTABLISHED or CLOSE_WAIT.
+ * The callback is called one last time, and the connection finishes
+ * closing without the application. Data that still arrives is
+ * acknowledged and discarded. */
 void tcpip_close(tcpip_conn_t *conn);
 
+/* Take a snapshot of tcpip statistics. */
+void tcpip_get_stats(tcpip_stats_t *stats);
+
 /* Polls for new packets from usbnet and calls all callbacks. */
 void tcpip_poll();
 
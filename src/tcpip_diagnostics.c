@@ -2,11 +2,22 @@
 #include "tcpip.h"
 #include <string.h>
 
+/* The services below end their side when the peer ends its side */
+
 static void echo_callback(tcpip_conn_t *conn, buffer_t *payload)
 {
   if (payload)
   {
-    tcpip_send(conn, payload);
+    /* A peer that sends faster than it acknowledges the echo fills the
+     * retransmission queue. Close rather than leave a gap in the echo. */
+    if (!tcpip_send(conn, payload))
+    {
+      tcpip_close(conn);
+    }
+  }
+  else if (conn->state == TCPIP_CLOSE_WAIT)
+  {
+    tcpip_close(conn);
   }
 }
 
@@ -16,6 +27,10 @@ static void discard_callback(tcpip_conn_t *conn, buffer_t *payload)
   {
     tcpip_release(payload);
   }
+  else if (conn->state == TCPIP_CLOSE_WAIT)
+  {
+    tcpip_close(conn);
+  }
 }
 
 static void chargen_callback(tcpip_conn_t *conn, buffer_t *payload)
@@ -24,7 +39,13 @@ static void chargen_callback(tcpip_conn_t *conn, buffer_t *payload)
   static int line_phase = 2;
   static int linepos = 0;
   
-  if (conn->state == TCPIP_CLOSED)
+  if (conn->state == TCPIP_CLOSE_WAIT)
+  {
+    tcpip_close(conn);
+    return;
+  }
+  
+  if (conn->state != TCPIP_ESTABLISHED)
   {
     char_phase = 1;
     line_phase = 2;
@@ -36,14 +57,29 @@ static void chargen_callback(tcpip_conn_t *conn, buffer_t *payload)
     tcpip_release(payload);
   }
   
-  if (usbnet_get_tx_queue_size() < 2)
+  if (conn->state != TCPIP_ESTABLISHED)
   {
-    payload = tcpip_allocate(TCPIP_MAX_PAYLOAD);
+    return;
+  }
+  
+  size_t space = tcpip_send_space(conn);
+  if (space > tcpip_max_segment(conn))
+  {
+    space = tcpip_max_segment(conn);
+  }
+  
+  if (usbnet_get_tx_credit() > 0 && space > 0)
+  {
+    payload = tcpip_allocate(space, BUFFER_SITE_TCPIP_TX);
     if (payload)
     {
+      int start_char_phase = char_phase;
+      int start_line_phase = line_phase;
+      int start_linepos = linepos;
+      
       // RFC 864: generate lines of 72 characters + CRLF
       payload->data_size = 0;
-      while (payload->data_size < payload->max_size)
+      while (payload->data_size < space)
       {
         linepos++;
         if (linepos <= 72)
@@ -64,15 +100,24 @@ static void chargen_callback(tcpip_conn_t *conn, buffer_t *payload)
         }
       }
       
-      tcpip_send(conn, payload);
+      if (!tcpip_send(conn, payload))
+      {
+        /* Nothing was sent, so the next segment starts from the same
+         * place to keep the stream without gaps */
+        char_phase = start_char_phase;
+        line_phase = start_line_phase;
+        linepos = start_linepos;
+      }
     }
   }
+  
+  tcpip_wait_tx(conn);
 }
 
 void tcpip_diagnostics_init()
 {
-  tcpip_register_listener(7, echo_callback);
-  tcpip_register_listener(9, discard_callback);
-  tcpip_register_listener(19, chargen_callback);
+  tcpip_register_listener(7, echo_callback, 0);
+  tcpip_register_listener(9, discard_callback, 0);
+  tcpip_register_listener(19, chargen_callback, 0);
 }
 
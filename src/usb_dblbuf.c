@@ -0,0 +1,185 @@
+#include "usb_dblbuf.h"
+#include <assert.h>
+#include <libopencm3/stm32/st_usbfs.h>
+
+/* In double-buffered mode both buffer descriptor slots of the endpoint
+ * are used for the same direction: buffer 0 uses the TX address and
+ * count, buffer 1 the RX ones. The data toggle bit of the unused direction
+ * becomes SW_BUF, which tells the buffer owned by software. */
+#define BTABLE_ENTRY(ep, offset) \
+  (*(volatile uint16_t*)(USB_PMA_BASE + (*USB_BTABLE_REG & 0xFFF8) + (ep) * 8 + (offset)))
+#define BUF_ADDR(ep, buf)  BTABLE_ENTRY(ep, (buf) ? 4 : 0)
+#define BUF_COUNT(ep, buf) BTABLE_ENTRY(ep, (buf) ? 6 : 2)
+#define COUNT_MASK 0x03FF
+
+/* Bits that are written as is. The toggle bits are left out, and writing
+ * 1 to the CTR bits leaves them unchanged. */
+#define EPR_KEEP (USB_EP_TYPE | USB_EP_KIND | USB_EP_ADDR)
+#define EPR_NOCLEAR (USB_EP_RX_CTR | USB_EP_TX_CTR)
+
+#define MAX_ENDPOINTS 8
+
+static uint16_t g_dblbuf_pma_top = USB_DBLBUF_PMA_SIZE;
+static usbd_endpoint_callback g_dblbuf_callbacks[MAX_ENDPOINTS];
+static volatile uint8_t g_dblbuf_tx_queued[MAX_ENDPOINTS];
+
+/* Invert the given toggle bits */
+static void toggle_bits(uint8_t ep, uint16_t bits)
+{
+  uint16_t reg = *USB_EP_REG(ep);
+  *USB_EP_REG(ep) = (reg & EPR_KEEP) | EPR_NOCLEAR | bits;
+}
+
+/* Set the toggle bits in mask to the values in value */
+static void set_toggles(uint8_t ep, uint16_t mask, uint16_t value)
+{
+  toggle_bits(ep, (*USB_EP_REG(ep) ^ value) & mask);
+}
+
+static void copy_to_pma(uint16_t pma, const uint8_t *src, size_t len)
+{
+  volatile uint16_t *dst = (volatile uint16_t*)(USB_PMA_BASE + pma);
+  for (size_t i = 0; i < len; i += 2)
+  {
+    uint16_t value = src[i];
+    if (i + 1 < len) value |= src[i + 1] << 8;
+    *dst++ = value;
+  }
+}
+
+static void copy_from_pma(uint8_t *dst, uint16_t pma, size_t len)
+{
+  const volatile uint16_t *src = (const volatile uint16_t*)(USB_PMA_BASE + pma);
+  for (size_t i = 0; i < len; i += 2)
+  {
+    uint16_t value = *src++;
+    dst[i] = value & 0xFF;
+    if (i + 1 < len) dst[i + 1] = value >> 8;
+  }
+}
+
+/* True if the toggle bits show that hardware has a buffer to send. They
+ * are equal both when nothing is queued and when both buffers are. */
+static bool tx_buffer_busy(uint8_t ep)
+{
+  uint16_t reg = *USB_EP_REG(ep);
+  return !(reg & USB_EP_TX_DTOG) != !(reg & USB_EP_RX_DTOG);
+}
+
+static void dblbuf_tx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+  ep &= 0x7F;
+  
+  /* Both buffers can be sent before the interrupt is handled, and then
+   * CTR_TX is raised only once. At least one buffer is done, so both
+   * can't be queued, and the toggle bits give the count. */
+  g_dblbuf_tx_queued[ep] = tx_buffer_busy(ep) ? 1 : 0;
+  
+  g_dblbuf_callbacks[ep](usbd_dev, ep | 0x80);
+}
+
+static void dblbuf_rx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+  ep &= 0x7F;
+  
+  /* Clear CTR_RX. The packet stays in its buffer until it is read. */
+  uint16_t reg = *USB_EP_REG(ep);
+  *USB_EP_REG(ep) = (reg & EPR_KEEP) | USB_EP_TX_CTR;
+  
+  g_dblbuf_callbacks[ep](usbd_dev, ep);
+}
+
+void usb_dblbuf_reset()
+{
+  g_dblbuf_pma_top = USB_DBLBUF_PMA_SIZE;
+}
+
+void usb_dblbuf_setup(usbd_device *usbd_dev, uint8_t addr, uint16_t max_size,
+                      usbd_endpoint_callback callback)
+{
+  uint8_t ep = addr & 0x7F;
+  bool in = addr & 0x80;
+  assert(ep < MAX_ENDPOINTS);
+  
+  g_dblbuf_callbacks[ep] = callback;
+  g_dblbuf_tx_queued[ep] = 0;
+  
+  /* libopencm3 allocates the first buffer and sets the endpoint type */
+  usbd_ep_setup(usbd_dev, addr, USB_ENDPOINT_ATTR_BULK, max_size,
+                in ? dblbuf_tx_callback : dblbuf_rx_callback);
+  
+  g_dblbuf_pma_top -= (max_size + 1) & ~1;
+  
+  uint16_t reg = *USB_EP_REG(ep);
+  *USB_EP_REG(ep) = (reg & EPR_KEEP) | EPR_NOCLEAR | USB_EP_KIND;
+  
+  if (in)
+  {
+    /* Hardware sends from DTOG_TX, software writes to SW_BUF = DTOG_RX.
+     * When they are equal, there is nothing to send. */
+    BUF_ADDR(ep, 1) = g_dblbuf_pma_top;
+    BUF_COUNT(ep, 0) = 0;
+    BUF_COUNT(ep, 1) = 0;
+    set_toggles(ep, USB_EP_TX_DTOG | USB_EP_RX_DTOG | USB_EP_TX_STAT, USB_EP_TX_STAT_VALID);
+  }
+  else
+  {
+    /* Hardware receives to DTOG_RX, software owns SW_BUF = DTOG_TX.
+     * The block size field of the count is the same for both buffers. */
+    BUF_ADDR(ep, 0) = g_dblbuf_pma_top;
+    BUF_COUNT(ep, 0) = BUF_COUNT(ep, 1) & ~COUNT_MASK;
+    set_toggles(ep, USB_EP_RX_DTOG | USB_EP_TX_DTOG | USB_EP_RX_STAT,
+                USB_EP_TX_DTOG | USB_EP_RX_STAT_VALID);
+  }
+}
+
+size_t usb_dblbuf_tx_free(uint8_t addr)
+{
+  uint8_t ep = addr & 0x7F;
+  if (g_dblbuf_tx_queued[ep] < 2)
+  {
+    /* A buffer finished but its interrupt is not handled yet */
+    return tx_buffer_busy(ep) ? 1 : 2;
+  }
+  
+  /* Equal toggle bits may also mean both were sent, the interrupt
+   * will tell */
+  return tx_buffer_busy(ep) ? 1 : 0;
+}
+
+void usb_dblbuf_write(uint8_t addr, const void *data, size_t len)
+{
+  uint8_t ep = addr & 0x7F;
+  assert(usb_dblbuf_tx_free(addr) > 0);
+  
+  int buf = (*USB_EP_REG(ep) & USB_EP_RX_DTOG) ? 1 : 0;
+  copy_to_pma(BUF_ADDR(ep, buf), data, len);
+  BUF_COUNT(ep, buf) = len;
+  
+  /* Hand the buffer to hardware. If the toggle bits are equal now,
+   * both buffers are queued. */
+  toggle_bits(ep, USB_EP_RX_DTOG);
+  g_dblbuf_tx_queued[ep] = tx_buffer_busy(ep) ? 1 : 2;
+}
+
+bool usb_dblbuf_rx_pending(uint8_t addr)
+{
+  /* The hardware stops when the buffer it would use next is the one
+   * owned by software, which happens after it has filled its own. */
+  uint16_t reg = *USB_EP_REG(addr & 0x7F);
+  return !(reg & USB_EP_RX_DTOG) == !(reg & USB_EP_TX_DTOG);
+}
+
+size_t usb_dblbuf_read(uint8_t addr, void *buf, size_t max_len)
+{
+  uint8_t ep = addr & 0x7F;
+  
+  /* Give the previous buffer back to hardware and take the new packet */
+  toggle_bits(ep, USB_EP_TX_DTOG);
+  
+  int sw_buf = (*USB_EP_REG(ep) & USB_EP_TX_DTOG) ? 1 : 0;
+  size_t len = BUF_COUNT(ep, sw_buf) & COUNT_MASK;
+  if (len > max_len) len = max_len;
+  copy_from_pma(buf, BUF_ADDR(ep, sw_buf), len);
+  return len;
+}
@@ -0,0 +1,45 @@
+#ifndef USB_DBLBUF_H
+#define USB_DBLBUF_H
+
+/* Double-buffered bulk endpoints for the STM32 USB peripheral.
+ * libopencm3 only supports single-buffered endpoints, where the hardware
+ * NAKs after every packet until software has copied it. With double
+ * buffering the hardware transfers one packet buffer while software
+ * handles the other one.
+ *
+ * The libopencm3 read, write and NAK functions must not be used on
+ * endpoints set up with these functions.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <libopencm3/usb/usbd.h>
+
+/* Size of the packet memory, the extra buffers are allocated from the top */
+#define USB_DBLBUF_PMA_SIZE 1024
+
+/* Free the extra packet buffers. Call before setting up the endpoints
+ * again on a new configuration. */
+void usb_dblbuf_reset();
+
+/* Set up a double-buffered bulk endpoint. For IN endpoints the callback
+ * is called after each transmitted packet, and for OUT endpoints after
+ * each received packet. */
+void usb_dblbuf_setup(usbd_device *usbd_dev, uint8_t addr, uint16_t max_size,
+                      usbd_endpoint_callback callback);
+
+/* Number of packets that can be written to an IN endpoint now, 0 to 2. */
+size_t usb_dblbuf_tx_free(uint8_t addr);
+
+/* Queue a packet for transmission. Requires usb_dblbuf_tx_free() > 0. */
+void usb_dblbuf_write(uint8_t addr, const void *data, size_t len);
+
+/* Returns true if an OUT endpoint has a received packet waiting. While
+ * it does, the hardware NAKs further packets. */
+bool usb_dblbuf_rx_pending(uint8_t addr);
+
+/* Read the waiting packet and return its length. The buffer is given back
+ * to the hardware. Requires usb_dblbuf_rx_pending(). */
+size_t usb_dblbuf_read(uint8_t addr, void *buf, size_t max_len);
+
+#endif
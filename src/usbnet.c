@@ -2,10 +2,14 @@
 #include "cdcecm_std.h"
 #include "rndis_std.h"
 #include "usbnet_descriptors.h"
+#include "usb_dblbuf.h"
+#include "events.h"
 #include "network_std.h"
 #include "tcpip.h"
 #include "systime.h"
+#include "capture.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
 #include <libopencm3/cm3/cortex.h>
@@ -24,13 +28,18 @@ static struct {buffer_t buf; uint8_t data[USBNET_SMALLBUF_SIZE];} g_usbnet_small
 
 static usbd_device *g_usbd_dev;
 static uint8_t g_usb_temp_buffer[160] __attribute__((aligned(4)));
+static uint8_t g_usb_tx_scratch[USBNET_USB_PACKET_SIZE] __attribute__((aligned(4)));
 
 static mac_addr_t g_rndis_mac_addr;
 
 static bool g_cdcecm_connected;
 static bool g_rndis_connected;
-static buffer_t *g_usbnet_transmit_queue;
-static buffer_t *g_usbnet_received;
+static bufferqueue_t g_usbnet_transmit_queue[USBNET_PRIO_COUNT];
+static uint8_t g_usbnet_control_burst;
+static uint8_t g_usbnet_transmit_peak;
+static volatile bool g_usbnet_tx_completed;
+static usbnet_tx_callback_t g_usbnet_tx_callback;
+static bufferqueue_t g_usbnet_received;
 
 static bool rx_alloc_buffer(size_t size);
 static void usbnet_set_config(usbd_device *usbd_dev, uint16_t wValue);
@@ -72,17 +81,11 @@ usbd_device *usbnet_init(const usbd_driver *driver, uint32_t serialnumber)
   }};
   
   /* Initialize memory buffers */
-  for (int i = 0; i < USBNET_BUFFER_COUNT; i++)
-  {
-    *(uint16_t*)&g_usbnet_bigbuffers[i].buf.max_size = USBNET_BUFFER_SIZE;
-    buffer_release(&g_usbnet_bigbuffers[i].buf);
-  }
-
-  for (int i = 0; i < USBNET_SMALLBUF_COUNT; i++)
-  {
-    *(uint16_t*)&g_usbnet_smallbuffers[i].buf.max_size = USBNET_SMALLBUF_SIZE;
-    buffer_release(&g_usbnet_smallbuffers[i].buf);
-  }
+  buffer_add_pool(g_usbnet_bigbuffers, USBNET_BUFFER_SIZE, USBNET_BUFFER_COUNT);
+  buffer_add_pool(g_usbnet_smallbuffers, USBNET_SMALLBUF_SIZE, USBNET_SMALLBUF_COUNT);
+  buffer_reserve(BUFFER_CLASS_RX, USBNET_BUFFER_SIZE, USBNET_RX_RESERVE);
+  buffer_reserve(BUFFER_CLASS_CTRL, USBNET_SMALLBUF_SIZE, USBNET_CTRL_RESERVE);
+  buffer_set_limit(BUFFER_CLASS_TX, USBNET_TX_LIMIT);
 
   // Preallocate buffer for first incoming packet
   rx_alloc_buffer(USBNET_USB_PACKET_SIZE);
@@ -110,8 +113,14 @@ static void cdcecm_rx_callback(usbd_device *usbd_dev, uint8_t ep);
 static void cdcecm_tx_callback(usbd_device *usbd_dev, uint8_t ep);
 static int rndis_ctrl_callback(usbd_device *usbd_dev, struct usb_setup_data *req,
         uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete);
+#if USBNET_CDC_NCM
+static int cdcncm_ctrl_callback(usbd_device *usbd_dev, struct usb_setup_data *req,
+        uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete);
+#endif
 static void rndis_rx_callback(usbd_device *usbd_dev, uint8_t ep);
 static void rndis_tx_callback(usbd_device *usbd_dev, uint8_t ep);
+static void cdcecm_reset_tx();
+static void rndis_reset_tx();
 
 static void usbnet_altset_callback(usbd_device *usbd_dev, uint16_t wIndex, uint16_t wValue)
 {
@@ -125,19 +134,33 @@ static void usbnet_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
   g_cdcecm_connected = false;
   g_rndis_connected = false;
-
-  usbd_ep_setup(g_usbd_dev, CDCECM_IN_EP, USB_ENDPOINT_ATTR_BULK, 64, cdcecm_tx_callback);
-  usbd_ep_setup(g_usbd_dev, CDCECM_OUT_EP, USB_ENDPOINT_ATTR_BULK, 64, cdcecm_rx_callback);
+  
+  /* A transfer that was being sent is not continued */
+  cdcecm_reset_tx();
+  rndis_reset_tx();
+
+  /* Bulk endpoints are double-buffered so that the host does not get NAKs
+   * between packets while the previous one is being copied. */
+  usb_dblbuf_reset();
+  usb_dblbuf_setup(g_usbd_dev, CDCECM_IN_EP, 64, cdcecm_tx_callback);
+  usb_dblbuf_setup(g_usbd_dev, CDCECM_OUT_EP, 64, cdcecm_rx_callback);
   usbd_ep_setup(g_usbd_dev, CDCECM_IRQ_EP, USB_ENDPOINT_ATTR_INTERRUPT, 16, cdcecm_status_callback);
 
-  usbd_ep_setup(g_usbd_dev, RNDIS_IN_EP, USB_ENDPOINT_ATTR_BULK, 64, rndis_tx_callback);
-  usbd_ep_setup(g_usbd_dev, RNDIS_OUT_EP, USB_ENDPOINT_ATTR_BULK, 64, rndis_rx_callback);
+  usb_dblbuf_setup(g_usbd_dev, RNDIS_IN_EP, 64, rndis_tx_callback);
+  usb_dblbuf_setup(g_usbd_dev, RNDIS_OUT_EP, 64, rndis_rx_callback);
   usbd_ep_setup(g_usbd_dev, RNDIS_IRQ_EP, USB_ENDPOINT_ATTR_INTERRUPT, 8, NULL);
 
   usbd_register_control_callback(g_usbd_dev,
                                  USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
                                  USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
                                  rndis_ctrl_callback);
+
+#if USBNET_CDC_NCM
+  usbd_register_control_callback(g_usbd_dev,
+                                 USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                                 USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+                                 cdcncm_ctrl_callback);
+#endif
 }
 
 /**************************
@@ -147,31 +170,57 @@ static void usbnet_set_config(usbd_device *usbd_dev, uint16_t wValue)
 static buffer_t *g_rx_buffer;
 static bool g_rx_waiting_for_buffer;
 static bool g_rx_discard;
+static uint8_t g_rx_queue_limit = USBNET_MIN_RX_QUEUE;
+static bool g_rx_nak_active;
+static systime_t g_rx_nak_start;
+static uint16_t g_rx_nak_count;
+static uint32_t g_rx_nak_time;
+
+/* Allocate a buffer for received data. The returned buffer is a slice
+ * whose data starts 2 bytes past a 4-byte boundary, so that the IPv6 and
+ * TCP headers following the 14-byte Ethernet header are aligned. The
+ * frames are received directly to their final place and never moved. */
+static buffer_t *rx_new_buffer(size_t size)
+{
+  buffer_t *buffer = buffer_allocate(size + USBNET_RX_HEADROOM, BUFFER_SITE_USBNET_RX);
+  if (!buffer)
+  {
+    return NULL;
+  }
+  
+  size_t prefix = sizeof(buffer_t);
+  prefix += (2 - (uintptr_t)&buffer->data[prefix]) & 3;
+  return buffer_slice(buffer, prefix, 0);
+}
 
 /* Returns true if g_current_rx_buffer is available and can store
- * atleast size bytes
+ * atleast size bytes, or as much as the largest transfer if less.
  */
 static bool rx_alloc_buffer(size_t size)
 {
-  if (g_rx_discard || (g_rx_buffer && size > USBNET_BUFFER_SIZE))
+  if (g_rx_discard)
   {
-    g_rx_discard = true;
     g_rx_waiting_for_buffer = false;
     return true;
   }
   
+  if (size > USBNET_RX_TRANSFER_MAX)
+  {
+    size = USBNET_RX_TRANSFER_MAX;
+  }
+  
   if (!g_rx_buffer)
   {
-    if (bufferlist_size(g_usbnet_received) < USBNET_MAX_RX_QUEUE)
+    if (bufferqueue_size(&g_usbnet_received) < g_rx_queue_limit)
     {
       // Allocate storage for first packet
-      g_rx_buffer = buffer_allocate(size);
+      g_rx_buffer = rx_new_buffer(size);
     }
   }
   else if (g_rx_buffer->max_size < size)
   {
     // Have to increase buffer size
-    buffer_t *newbuf = buffer_allocate(size);
+    buffer_t *newbuf = rx_new_buffer(size);
     if (newbuf)
     {
       memcpy(newbuf->data, g_rx_buffer->data, g_rx_buffer->data_size);
@@ -186,30 +235,97 @@ static bool rx_alloc_buffer(size_t size)
   return buf_ok;
 }
 
-static uint8_t *rx_buffer_ptr()
+/* Position of a frame inside a received transfer */
+typedef struct {
+  uint16_t offset;
+  uint16_t length;
+} rx_frame_t;
+
+/* Finds the frames in a transfer that contains several of them.
+ * Returns the number of frames, at most USBNET_MAX_TRANSFER_FRAMES. */
+typedef size_t (*rx_parser_t)(const buffer_t *transfer, rx_frame_t *frames);
+
+/* Queue the frames of a transfer for tcpip. The first frame is passed on
+ * as a slice of the transfer buffer, the rest are copied to buffers of
+ * their own. */
+static void rx_split(buffer_t *transfer, rx_parser_t parser)
 {
-  if (g_rx_discard)
+  rx_frame_t positions[USBNET_MAX_TRANSFER_FRAMES];
+  buffer_t *frames[USBNET_MAX_TRANSFER_FRAMES];
+  size_t count = parser(transfer, positions);
+  
+  if (count == 0)
+  {
+    buffer_release(transfer);
+    return;
+  }
+  
+  /* NCM allows the first datagram right after the 12-byte NTH, with no
+   * room for the slice header before it. Then it is moved up by a
+   * multiple of 4 bytes, which keeps its alignment, or copied if the
+   * buffer has no room for that. */
+  size_t offset = positions[0].offset;
+  if (offset < sizeof(buffer_t))
+  {
+    offset += (sizeof(buffer_t) - offset + 3) & ~3;
+  }
+  
+  bool slice_first = offset + positions[0].length <= transfer->max_size;
+  
+  for (size_t i = slice_first ? 1 : 0; i < count; i++)
   {
-    return g_usb_temp_buffer;
+    frames[i] = rx_new_buffer(positions[i].length);
+    if (frames[i])
+    {
+      memcpy(frames[i]->data, &transfer->data[positions[i].offset], positions[i].length);
+      frames[i]->data_size = positions[i].length;
+    }
+    else
+    {
+      warn("Dropping received frame, no buffer");
+    }
+  }
+  
+  /* The slice header, and the first frame if it is moved, overwrite other
+   * parts of the transfer, so this has to be done after the other frames
+   * have been copied. */
+  if (slice_first)
+  {
+    if (offset != positions[0].offset)
+    {
+      memmove(&transfer->data[offset], &transfer->data[positions[0].offset],
+              positions[0].length);
+    }
+    
+    frames[0] = buffer_slice(transfer, offset, 0);
+    frames[0]->data_size = positions[0].length;
   }
   else
   {
-    return &g_rx_buffer->data[g_rx_buffer->data_size];
+    buffer_release(transfer);
+  }
+  
+  for (size_t i = 0; i < count; i++)
+  {
+    if (frames[i])
+    {
+      bufferqueue_push(&g_usbnet_received, frames[i]);
+    }
   }
 }
 
-static void rx_done()
+/* Finish the current transfer. If parser is NULL, the transfer is a
+ * single frame. */
+static void rx_done(rx_parser_t parser)
 {
-  if (g_rx_discard && g_rx_buffer->data_size <= USBNET_BUFFER_SIZE + 1)
+  if (!g_rx_discard && parser)
   {
-    // The discard bit got set just because of the ZLP termination packet
-    g_rx_buffer->data_size = USBNET_BUFFER_SIZE;
-    g_rx_discard = false;
+    rx_split(g_rx_buffer, parser);
+    g_rx_buffer = NULL;
   }
-  
-  if (!g_rx_discard)
+  else if (!g_rx_discard)
   {
-    bufferlist_append(&g_usbnet_received, g_rx_buffer);
+    bufferqueue_push(&g_usbnet_received, g_rx_buffer);
     g_rx_buffer = NULL;
   }
   else
@@ -219,9 +335,179 @@ static void rx_done()
     g_rx_buffer = NULL;
     g_rx_discard = false;
   }
+  
+  events_signal(EVENT_USBNET_RX);
   rx_alloc_buffer(USBNET_USB_PACKET_SIZE);
 }
 
+/* Returns the total length of a transfer if its header tells it, or 0.
+ * Used for transfers that do not have to end in a short packet. */
+typedef size_t (*rx_length_t)(const buffer_t *transfer);
+
+/* Grow the RX queue limit while buffers are plentiful, and shrink it
+ * when transmit cannot get a buffer. Shrinking does not drop frames,
+ * new transfers just wait until the queue has drained below the limit. */
+static void rx_adapt_queue_limit()
+{
+  if (buffer_available(USBNET_BUFFER_SIZE, BUFFER_CLASS_TX) == 0)
+  {
+    if (g_rx_queue_limit > USBNET_MIN_RX_QUEUE)
+    {
+      g_rx_queue_limit--;
+    }
+  }
+  else if (buffer_available(USBNET_BUFFER_SIZE, BUFFER_CLASS_RX) >= 2)
+  {
+    if (g_rx_queue_limit < USBNET_MAX_RX_QUEUE)
+    {
+      g_rx_queue_limit++;
+    }
+  }
+}
+
+/* Track the time packets wait in the endpoint for a buffer. The hardware
+ * NAKs the host for most of this time. */
+static void rx_nak_begin()
+{
+  if (!g_rx_nak_active)
+  {
+    g_rx_nak_active = true;
+    g_rx_nak_start = get_systime();
+    g_rx_nak_count++;
+  }
+}
+
+static void rx_nak_end()
+{
+  if (g_rx_nak_active)
+  {
+    g_rx_nak_active = false;
+    g_rx_nak_time += get_systime() - g_rx_nak_start;
+  }
+}
+
+/* Read the packets waiting in an OUT endpoint. If there is no buffer for
+ * the next packet, it is left in the endpoint and the hardware NAKs until
+ * usbnet_poll() calls this again. */
+static void rx_receive(uint8_t ep, rx_parser_t parser, rx_length_t length)
+{
+  while (usb_dblbuf_rx_pending(ep))
+  {
+    size_t current_size = g_rx_buffer ? g_rx_buffer->data_size : 0;
+    if (!rx_alloc_buffer(current_size + USBNET_USB_PACKET_SIZE))
+    {
+      rx_nak_begin();
+      return;
+    }
+    
+    rx_nak_end();
+    
+    size_t room = g_rx_buffer->max_size - g_rx_buffer->data_size;
+    size_t len;
+    
+    if (!g_rx_discard && room >= USBNET_USB_PACKET_SIZE)
+    {
+      len = usb_dblbuf_read(ep, &g_rx_buffer->data[g_rx_buffer->data_size],
+                            USBNET_USB_PACKET_SIZE);
+    }
+    else
+    {
+      /* Near the end of the buffer the packet is kept only if it fits,
+       * which is always the case for a terminating ZLP. */
+      len = usb_dblbuf_read(ep, g_usb_temp_buffer, USBNET_USB_PACKET_SIZE);
+      if (!g_rx_discard && len <= room)
+      {
+        memcpy(&g_rx_buffer->data[g_rx_buffer->data_size], g_usb_temp_buffer, len);
+      }
+      else
+      {
+        g_rx_discard = true;
+      }
+    }
+    
+    g_rx_buffer->data_size += len;
+    
+    bool complete = (len < USBNET_USB_PACKET_SIZE);
+    if (length)
+    {
+      size_t expected = length(g_rx_buffer);
+      if (expected != 0 && g_rx_buffer->data_size >= expected)
+      {
+        complete = true;
+      }
+    }
+    
+    if (complete && g_rx_buffer->data_size > 0)
+    {
+      /* Transfer complete, a lone ZLP is ignored */
+      rx_done(parser);
+    }
+  }
+}
+
+/**************************
+ * Common TX buffer logic *
+ **************************/
+
+static size_t tx_queue_size()
+{
+  return bufferqueue_size(&g_usbnet_transmit_queue[USBNET_PRIO_CONTROL]) +
+         bufferqueue_size(&g_usbnet_transmit_queue[USBNET_PRIO_BULK]);
+}
+
+/* Select the queue the next frame is taken from, control frames first. */
+static bufferqueue_t *tx_next_queue()
+{
+  bufferqueue_t *control = &g_usbnet_transmit_queue[USBNET_PRIO_CONTROL];
+  bufferqueue_t *bulk = &g_usbnet_transmit_queue[USBNET_PRIO_BULK];
+  
+  if (bufferqueue_size(bulk) == 0)
+  {
+    return control;
+  }
+  else if (bufferqueue_size(control) == 0 ||
+           g_usbnet_control_burst >= USBNET_MAX_CONTROL_BURST)
+  {
+    return bulk;
+  }
+  else
+  {
+    return control;
+  }
+}
+
+/* Return the frame tx_dequeue() would return next, without removing it. */
+static buffer_t *tx_peek()
+{
+  return bufferqueue_peek(tx_next_queue());
+}
+
+/* Take the next frame to transmit. */
+static buffer_t *tx_dequeue()
+{
+  bufferqueue_t *queue = tx_next_queue();
+  
+  if (queue == &g_usbnet_transmit_queue[USBNET_PRIO_CONTROL] &&
+      bufferqueue_size(&g_usbnet_transmit_queue[USBNET_PRIO_BULK]) > 0)
+  {
+    g_usbnet_control_burst++;
+  }
+  else
+  {
+    g_usbnet_control_burst = 0;
+  }
+  
+  return bufferqueue_pop(queue);
+}
+
+/* Called when the last packet of a frame has been written to the endpoint. */
+static void tx_frame_done(buffer_t *buffer)
+{
+  buffer_release(buffer);
+  g_usbnet_tx_completed = true;
+  events_signal(EVENT_USBNET_TX);
+}
+
 /***************************
  * CDC ECM RX/TX callbacks *
  ***************************/
@@ -284,91 +570,387 @@ static void cdcecm_send_connection_status()
   g_cdcecm_send_connection_status = true;
 }
 
-static void cdcecm_continue_rx()
+#if USBNET_CDC_NCM
+
+/* With NCM the data endpoints carry NTBs (NCM transfer blocks) that
+ * contain one or more Ethernet frames. The control and notification side
+ * is the same as for ECM. */
+
+static const struct usb_cdc_ncm_ntb_parameters g_cdcncm_ntb_parameters = {
+  .wLength = sizeof(struct usb_cdc_ncm_ntb_parameters),
+  .bmNtbFormatsSupported = 1, /* NTB16 only */
+  .dwNtbInMaxSize = USBNET_NCM_NTB_IN_MAX,
+  .wNdpInDivisor = 4,
+  .wNdpInPayloadRemainder = 0,
+  .wNdpInAlignment = 4,
+  .dwNtbOutMaxSize = USBNET_RX_TRANSFER_MAX,
+  .wNdpOutDivisor = 4,
+  .wNdpOutPayloadRemainder = 0,
+  .wNdpOutAlignment = 4,
+  .wNtbOutMaxDatagrams = USBNET_MAX_TRANSFER_FRAMES,
+};
+
+static uint32_t g_cdcncm_ntb_in_max = USBNET_NCM_NTB_IN_MAX;
+
+static int cdcncm_ctrl_callback(usbd_device *usbd_dev, struct usb_setup_data *req,
+        uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete)
 {
-  size_t current_size = g_rx_buffer ? g_rx_buffer->data_size : 0;
-  bool status = rx_alloc_buffer(current_size + USBNET_USB_PACKET_SIZE);
-  usbd_ep_nak_set(g_usbd_dev, CDCECM_OUT_EP, !status);
+  if (req->wIndex == CDCECM_INTERFACE)
+  {
+    if (req->bRequest == USB_CDC_REQ_GET_NTB_PARAMETERS)
+    {
+      *buf = (uint8_t*)&g_cdcncm_ntb_parameters;
+      if (*len > sizeof(g_cdcncm_ntb_parameters)) *len = sizeof(g_cdcncm_ntb_parameters);
+      return USBD_REQ_HANDLED;
+    }
+    else if (req->bRequest == USB_CDC_REQ_GET_NTB_INPUT_SIZE)
+    {
+      *buf = (uint8_t*)&g_cdcncm_ntb_in_max;
+      if (*len > sizeof(g_cdcncm_ntb_in_max)) *len = sizeof(g_cdcncm_ntb_in_max);
+      return USBD_REQ_HANDLED;
+    }
+    else if (req->bRequest == USB_CDC_REQ_SET_NTB_INPUT_SIZE && *len >= 4)
+    {
+      uint32_t size;
+      memcpy(&size, *buf, sizeof(size));
+      
+      if (size < USBNET_BUFFER_SIZE + USBNET_OUT_OVERHEAD || size > USBNET_NCM_NTB_IN_MAX)
+      {
+        warn("NCM rejected NTB input size %u", (unsigned)size);
+        return USBD_REQ_NOTSUPP;
+      }
+      
+      g_cdcncm_ntb_in_max = size;
+      return USBD_REQ_HANDLED;
+    }
+  }
+  
+  return USBD_REQ_NEXT_CALLBACK;
 }
 
-static void cdcecm_rx_callback(usbd_device *usbd_dev, uint8_t ep)
+/* Find the frames in a received NTB. Only the first NDP is processed. */
+static size_t cdcncm_parse_ntb(const buffer_t *ntb, rx_frame_t *frames)
 {
-  assert(g_rx_buffer);
-  assert(g_rx_discard || g_rx_buffer->max_size >= g_rx_buffer->data_size + USBNET_USB_PACKET_SIZE);
+  const struct usb_cdc_ncm_nth16 *nth = (const void*)ntb->data;
+  size_t count = 0;
+  size_t size = ntb->data_size;
+  
+  if (size >= sizeof(*nth) && nth->wBlockLength != 0 && nth->wBlockLength < size)
+  {
+    size = nth->wBlockLength;
+  }
+  
+  if (size < sizeof(*nth) || nth->dwSignature != USB_CDC_NCM_NTH16_SIGNATURE ||
+      nth->wNdpIndex < sizeof(*nth) || nth->wNdpIndex + sizeof(struct usb_cdc_ncm_ndp16) > size)
+  {
+    warn("NCM invalid NTH, size = %d", (int)size);
+    return 0;
+  }
   
-  // Set NAK bit until we know whether there is space available for next packet.
-  usbd_ep_nak_set(usbd_dev, ep, true);
-  size_t len = usbd_ep_read_packet(usbd_dev, ep, rx_buffer_ptr(),
-                                   USBNET_USB_PACKET_SIZE);
-  g_rx_buffer->data_size += len;
+  const struct usb_cdc_ncm_ndp16 *ndp = (const void*)&ntb->data[nth->wNdpIndex];
+  size_t ndp_end = nth->wNdpIndex + ndp->hdr.wLength;
+  if (ndp->hdr.dwSignature != USB_CDC_NCM_NDP16_SIGNATURE_NOCRC || ndp_end > size)
+  {
+    warn("NCM invalid NDP");
+    return 0;
+  }
   
-  if (len < USBNET_USB_PACKET_SIZE)
+  for (const struct usb_cdc_ncm_ndp16_pointer *p = ndp->datagrams;
+       (const uint8_t*)(p + 1) <= &ntb->data[ndp_end] && p->wDatagramIndex != 0; p++)
   {
-    /* Transfer complete */
-    rx_done();
+    if (p->wDatagramIndex < sizeof(*nth) || p->wDatagramIndex + p->wDatagramLength > size)
+    {
+      warn("NCM invalid datagram pointer");
+    }
+    else if (count < USBNET_MAX_TRANSFER_FRAMES)
+    {
+      frames[count].offset = p->wDatagramIndex;
+      frames[count].length = p->wDatagramLength;
+      count++;
+    }
   }
   
+  return count;
+}
+
+/* The NTB ends either at a short packet or when wBlockLength is reached.
+ * A ZLP following a full NTB arrives as an empty transfer and is ignored. */
+static size_t cdcncm_ntb_length(const buffer_t *ntb)
+{
+  const struct usb_cdc_ncm_nth16 *nth = (const void*)ntb->data;
+  return (ntb->data_size >= sizeof(*nth)) ? nth->wBlockLength : 0;
+}
+
+static void cdcecm_continue_rx()
+{
+  rx_receive(CDCECM_OUT_EP, cdcncm_parse_ntb, cdcncm_ntb_length);
+}
+
+static void cdcecm_rx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
   cdcecm_continue_rx();
 }
 
+/* The IN NTB is generated on the fly: the headers are kept here and the
+ * frames are read directly from their buffers. Frames are placed after
+ * the headers, aligned to 4 bytes. */
+static struct {
+  struct usb_cdc_ncm_nth16 nth;
+  struct usb_cdc_ncm_ndp16_header ndp;
+  struct usb_cdc_ncm_ndp16_pointer datagrams[USBNET_MAX_TRANSFER_FRAMES + 1];
+} __attribute__((packed)) g_cdcncm_tx_header;
+
+static buffer_t *g_cdcncm_tx_frames[USBNET_MAX_TRANSFER_FRAMES];
+static uint8_t g_cdcncm_tx_frame_count;
+static uint16_t g_cdcncm_tx_sequence;
+static size_t g_cdcecm_tx_size;
 static size_t g_cdcecm_tx_bytes_written;
 static bool g_cdcecm_tx_waiting_for_frame = true;
-static buffer_t *g_cdcecm_current_tx_buffer;
 
-static void cdcecm_start_tx()
+static size_t cdcecm_tx_in_flight()
 {
-  if (!g_cdcecm_connected)
-    return;
+  return g_cdcncm_tx_frame_count;
+}
+
+static void cdcecm_reset_tx()
+{
+  for (int i = 0; i < g_cdcncm_tx_frame_count; i++)
+  {
+    tx_frame_done(g_cdcncm_tx_frames[i]);
+    g_cdcncm_tx_frames[i] = NULL;
+  }
   
-  assert(!g_cdcecm_current_tx_buffer);
-  buffer_t *buffer = bufferlist_popfront(&g_usbnet_transmit_queue);
+  g_cdcncm_tx_frame_count = 0;
+  g_cdcecm_tx_size = 0;
+  g_cdcecm_tx_bytes_written = 0;
+  g_cdcecm_tx_waiting_for_frame = true;
+}
 
-  if (buffer)
+/* Copy len bytes of the IN NTB starting at pos to dst. */
+static void cdcncm_tx_gather(uint8_t *dst, size_t pos, size_t len)
+{
+  uint8_t *end = dst + len;
+  int i = 0;
+  
+  while (dst < end)
   {
-    g_cdcecm_tx_waiting_for_frame = false;
-    g_cdcecm_current_tx_buffer = buffer;
-    g_cdcecm_tx_bytes_written = 0;
+    size_t n = end - dst;
+    
+    if (pos < sizeof(g_cdcncm_tx_header))
+    {
+      if (n > sizeof(g_cdcncm_tx_header) - pos) n = sizeof(g_cdcncm_tx_header) - pos;
+      memcpy(dst, (uint8_t*)&g_cdcncm_tx_header + pos, n);
+    }
+    else
+    {
+      struct usb_cdc_ncm_ndp16_pointer *p = &g_cdcncm_tx_header.datagrams[i];
+      
+      if (pos >= p->wDatagramIndex + p->wDatagramLength)
+      {
+        i++;
+        continue;
+      }
+      else if (pos < p->wDatagramIndex)
+      {
+        /* Alignment padding */
+        if (n > p->wDatagramIndex - pos) n = p->wDatagramIndex - pos;
+        memset(dst, 0, n);
+      }
+      else
+      {
+        size_t offset = pos - p->wDatagramIndex;
+        if (n > p->wDatagramLength - offset) n = p->wDatagramLength - offset;
+        const uint8_t *data = buffer_gather(g_cdcncm_tx_frames[i], offset, n, dst);
+        if (data != dst) memcpy(dst, data, n);
+      }
+    }
+    
+    dst += n;
+    pos += n;
+  }
+}
 
-    cdcecm_tx_callback(g_usbd_dev, CDCECM_IN_EP);
+/* Start a new NTB with as many of the queued frames as fit in it.
+ * Returns false if there was nothing to send. */
+static bool cdcncm_prepare_tx()
+{
+  assert(g_cdcncm_tx_frame_count == 0);
+  
+  size_t pos = sizeof(g_cdcncm_tx_header);
+  size_t size = 0;
+  int count = 0;
+  memset(&g_cdcncm_tx_header, 0, sizeof(g_cdcncm_tx_header));
+  
+  while (count < USBNET_MAX_TRANSFER_FRAMES)
+  {
+    buffer_t *buffer = tx_peek();
+    if (!buffer)
+      break;
+    
+    size_t frame_size = buffer_frame_size(buffer);
+    if (pos + frame_size >= g_cdcncm_ntb_in_max)
+      break;
+    
+    tx_dequeue();
+    g_cdcncm_tx_frames[count] = buffer;
+    g_cdcncm_tx_header.datagrams[count].wDatagramIndex = pos;
+    g_cdcncm_tx_header.datagrams[count].wDatagramLength = frame_size;
+    count++;
+    
+    size = pos + frame_size;
+    pos = (size + 3) & ~3;
   }
-  else
+  
+  if (count > 0)
   {
-    g_cdcecm_tx_waiting_for_frame = true;
+    g_cdcncm_tx_header.nth.dwSignature = USB_CDC_NCM_NTH16_SIGNATURE;
+    g_cdcncm_tx_header.nth.wHeaderLength = sizeof(struct usb_cdc_ncm_nth16);
+    g_cdcncm_tx_header.nth.wSequence = g_cdcncm_tx_sequence++;
+    g_cdcncm_tx_header.nth.wBlockLength = size;
+    g_cdcncm_tx_header.nth.wNdpIndex = sizeof(struct usb_cdc_ncm_nth16);
+    g_cdcncm_tx_header.ndp.dwSignature = USB_CDC_NCM_NDP16_SIGNATURE_NOCRC;
+    g_cdcncm_tx_header.ndp.wLength = sizeof(struct usb_cdc_ncm_ndp16_header) +
+                                     (count + 1) * sizeof(struct usb_cdc_ncm_ndp16_pointer);
+    
+    g_cdcncm_tx_frame_count = count;
+    g_cdcecm_tx_size = size;
+    g_cdcecm_tx_bytes_written = 0;
+    return true;
+  }
+  
+  return false;
+}
+
+/* Fill the free endpoint buffers with packets of the current NTB,
+ * starting new NTBs as long as there are frames queued. */
+static void cdcecm_start_tx()
+{
+  if (!g_cdcecm_connected)
+    return;
+  
+  while (usb_dblbuf_tx_free(CDCECM_IN_EP) > 0)
+  {
+    if (!g_cdcncm_tx_frame_count && !cdcncm_prepare_tx())
+    {
+      g_cdcecm_tx_waiting_for_frame = true;
+      return;
+    }
+    
+    g_cdcecm_tx_waiting_for_frame = false;
+    
+    size_t len = g_cdcecm_tx_size - g_cdcecm_tx_bytes_written;
+    if (len > USBNET_USB_PACKET_SIZE) len = USBNET_USB_PACKET_SIZE;
+    cdcncm_tx_gather(g_usb_tx_scratch, g_cdcecm_tx_bytes_written, len);
+    usb_dblbuf_write(CDCECM_IN_EP, g_usb_tx_scratch, len);
+    g_cdcecm_tx_bytes_written += len;
+    
+    if (len < USBNET_USB_PACKET_SIZE)
+    {
+      /* The data is in the packet memory, buffers can be released now */
+      for (int i = 0; i < g_cdcncm_tx_frame_count; i++)
+      {
+        tx_frame_done(g_cdcncm_tx_frames[i]);
+        g_cdcncm_tx_frames[i] = NULL;
+      }
+      
+      g_cdcncm_tx_frame_count = 0;
+    }
   }
 }
 
 static void cdcecm_tx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+  cdcecm_start_tx();
+}
+
+#else
+
+static void cdcecm_continue_rx()
+{
+  rx_receive(CDCECM_OUT_EP, NULL, NULL);
+}
+
+static void cdcecm_rx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+  cdcecm_continue_rx();
+}
+
+static size_t g_cdcecm_tx_bytes_written;
+static bool g_cdcecm_tx_waiting_for_frame = true;
+static buffer_t *g_cdcecm_current_tx_buffer;
+
+static size_t cdcecm_tx_in_flight()
+{
+  return g_cdcecm_current_tx_buffer ? 1 : 0;
+}
+
+static void cdcecm_reset_tx()
 {
   if (g_cdcecm_current_tx_buffer)
   {
-    size_t max_len = g_cdcecm_current_tx_buffer->data_size - g_cdcecm_tx_bytes_written;
-    if (max_len > USBNET_USB_PACKET_SIZE) max_len = USBNET_USB_PACKET_SIZE;
-    size_t len = usbd_ep_write_packet(usbd_dev, ep,
-      &g_cdcecm_current_tx_buffer->data[g_cdcecm_tx_bytes_written], max_len);
+    tx_frame_done(g_cdcecm_current_tx_buffer);
+    g_cdcecm_current_tx_buffer = NULL;
+  }
+  
+  g_cdcecm_tx_bytes_written = 0;
+  g_cdcecm_tx_waiting_for_frame = true;
+}
+
+/* Fill the free endpoint buffers with packets of the current frame,
+ * continuing with the next frame as long as there are frames queued. */
+static void cdcecm_start_tx()
+{
+  if (!g_cdcecm_connected)
+    return;
+  
+  while (usb_dblbuf_tx_free(CDCECM_IN_EP) > 0)
+  {
+    if (!g_cdcecm_current_tx_buffer)
+    {
+      g_cdcecm_current_tx_buffer = tx_dequeue();
+      g_cdcecm_tx_bytes_written = 0;
+      
+      if (!g_cdcecm_current_tx_buffer)
+      {
+        g_cdcecm_tx_waiting_for_frame = true;
+        return;
+      }
+    }
+    
+    g_cdcecm_tx_waiting_for_frame = false;
+    
+    size_t len = buffer_frame_size(g_cdcecm_current_tx_buffer) - g_cdcecm_tx_bytes_written;
+    if (len > USBNET_USB_PACKET_SIZE) len = USBNET_USB_PACKET_SIZE;
+    const uint8_t *data = buffer_gather(g_cdcecm_current_tx_buffer, g_cdcecm_tx_bytes_written,
+                                        len, g_usb_tx_scratch);
+    usb_dblbuf_write(CDCECM_IN_EP, data, len);
     g_cdcecm_tx_bytes_written += len;
 
     if (len < USBNET_USB_PACKET_SIZE)
     {
-      /* Buffer can be released now */
-      buffer_release(g_cdcecm_current_tx_buffer);
+      /* The data is in the packet memory, buffer can be released now */
+      tx_frame_done(g_cdcecm_current_tx_buffer);
       g_cdcecm_current_tx_buffer = NULL;
     }
   }
-  else
-  {
-    /* Last packet of frame completed transmission */
-    cdcecm_start_tx();
-  }
 }
 
+static void cdcecm_tx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+  cdcecm_start_tx();
+}
+
+#endif
+
 /*******************
  * RNDIS callbacks *
  *******************/
 
-static buffer_t *g_rndis_responses;
+static bufferqueue_t g_rndis_responses;
 static uint32_t g_rndis_packet_filter;
 static uint32_t g_rndis_host_rx_count;
 static uint32_t g_rndis_host_tx_count;
+static uint32_t g_rndis_host_max_transfer;
 
 static const uint32_t g_rndis_supported_oids[] = {
   RNDIS_OID_GEN_SUPPORTED_LIST,         /* Returns this list */
@@ -407,14 +989,14 @@ static const struct {
   const void *Data;
 } g_rndis_oid_values[] = {
   {RNDIS_OID_GEN_SUPPORTED_LIST, sizeof(g_rndis_supported_oids), g_rndis_supported_oids},
-  {RNDIS_OID_GEN_MAXIMUM_FRAME_SIZE,    4, &(const uint32_t){1600}},
+  {RNDIS_OID_GEN_MAXIMUM_FRAME_SIZE,    4, &(const uint32_t){USBNET_MAX_FRAME_SIZE - 14}},
   {RNDIS_OID_GEN_LINK_SPEED,            4, &(const uint32_t){100000}},
   {RNDIS_OID_GEN_TRANSMIT_BLOCK_SIZE,   4, &(const uint32_t){USBNET_BUFFER_SIZE}},
   {RNDIS_OID_GEN_RECEIVE_BLOCK_SIZE,    4, &(const uint32_t){USBNET_BUFFER_SIZE}},
   {RNDIS_OID_GEN_VENDOR_ID,             4, &(const uint32_t){0x00FFFFFF}},
   {RNDIS_OID_GEN_VENDOR_DESCRIPTION,    5, "DAQ4"},
   {RNDIS_OID_GEN_CURRENT_PACKET_FILTER, 4, &g_rndis_packet_filter},
-  {RNDIS_OID_GEN_MAXIMUM_TOTAL_SIZE,    4, &(const uint32_t){2048}},
+  {RNDIS_OID_GEN_MAXIMUM_TOTAL_SIZE,    4, &(const uint32_t){USBNET_MAX_FRAME_SIZE}},
   {RNDIS_OID_GEN_MAC_OPTIONS,           4,
       &(const uint32_t){RNDIS_MAC_OPTION_RECEIVE_SERIALIZED | RNDIS_MAC_OPTION_FULL_DUPLEX}},
   {RNDIS_OID_GEN_XMIT_OK,               4, &g_rndis_host_tx_count},
@@ -428,8 +1010,12 @@ static const struct {
 
 static buffer_t *rndis_prepare_response(size_t size, struct rndis_command_header *request_hdr)
 {
-  buffer_t *respbuf = buffer_allocate(size);
-  assert(respbuf);
+  buffer_t *respbuf = buffer_allocate(size, BUFFER_SITE_RNDIS_RESPONSE);
+  if (!respbuf)
+  {
+    /* The host will time out and retry the command */
+    return NULL;
+  }
 
   respbuf->data_size = size;
   memset(respbuf->data, 0, size);
@@ -443,31 +1029,114 @@ static buffer_t *rndis_prepare_response(size_t size, struct rndis_command_header
   return respbuf;
 }
 
-static void rndis_send_response(buffer_t *response)
+static void rndis_notify_response()
 {
-  bufferlist_append(&g_rndis_responses, response);
-
   struct rndis_notification notif = {RNDIS_NOTIFICATION_RESPONSE_AVAILABLE, 0};
   usbd_ep_write_packet(g_usbd_dev, RNDIS_IRQ_EP, &notif, sizeof(notif));
 }
 
+/* The host reads one response for each notification, so the next one is
+ * sent only after the previous response has been read. */
+static void rndis_send_response(buffer_t *response)
+{
+  if (!response)
+    return;
+  
+  bufferqueue_push(&g_rndis_responses, response);
+  
+  if (bufferqueue_size(&g_rndis_responses) == 1)
+  {
+    rndis_notify_response();
+  }
+}
+
+/* Check that a command has the fields that are read from it, and that
+ * the information buffer of a set message is within the message. The
+ * host gets a completion with the error status otherwise. */
+static bool rndis_check_command(uint8_t *buf, uint16_t len)
+{
+  struct rndis_command_header *request_hdr = (void*)buf;
+  size_t min_length = sizeof(*request_hdr);
+  size_t cmplt_length = sizeof(struct rndis_response_header);
+  uint32_t status = RNDIS_STATUS_INVALID_LENGTH;
+  
+  if (request_hdr->MessageType == RNDIS_MSG_INIT)
+  {
+    min_length = sizeof(struct rndis_initialize_msg);
+    cmplt_length = sizeof(struct rndis_initialize_cmplt);
+  }
+  else if (request_hdr->MessageType == RNDIS_MSG_QUERY)
+  {
+    min_length = sizeof(struct rndis_query_msg);
+    cmplt_length = sizeof(struct rndis_query_cmplt);
+  }
+  else if (request_hdr->MessageType == RNDIS_MSG_SET)
+  {
+    min_length = sizeof(struct rndis_set_msg);
+  }
+  
+  bool valid = (len >= min_length);
+  if (valid && request_hdr->MessageType == RNDIS_MSG_SET)
+  {
+    /* The offset counts from RequestID. Checked in subtracted form like
+     * the packet messages, as the fields come from the host. */
+    const struct rndis_set_msg *req = (const void*)buf;
+    status = RNDIS_STATUS_INVALID_DATA;
+    valid = req->InformationBufferOffset >= sizeof(*req) - 8 &&
+            req->InformationBufferOffset <= len - 8u &&
+            req->InformationBufferLength <= len - 8u - req->InformationBufferOffset;
+  }
+  
+  if (valid)
+  {
+    return true;
+  }
+  
+  warn("RNDIS invalid command %08x, length %d", (unsigned)request_hdr->MessageType, (int)len);
+  buffer_t *respbuf = rndis_prepare_response(cmplt_length, request_hdr);
+  if (respbuf)
+  {
+    ((struct rndis_response_header*)respbuf->data)->Status = status;
+    rndis_send_response(respbuf);
+  }
+  
+  return false;
+}
+
 static void rndis_send_command(uint8_t *buf, uint16_t len)
 {
-  return;
   struct rndis_command_header *request_hdr = (void*)buf;
+  
+  if (len < sizeof(*request_hdr))
+  {
+    /* Without a RequestID there is nothing to answer */
+    warn("RNDIS command of %d bytes", (int)len);
+    return;
+  }
+  
+  if (!rndis_check_command(buf, len))
+  {
+    return;
+  }
 
 //   dbg("RNDIS request %02x", (unsigned)request_hdr->MessageType);
   if (request_hdr->MessageType == RNDIS_MSG_INIT)
   {
+    struct rndis_initialize_msg *req = (void*)buf;
+    g_rndis_host_max_transfer = req->MaxTransferSize;
+    
     buffer_t *respbuf = rndis_prepare_response(sizeof(struct rndis_initialize_cmplt), request_hdr);
+    if (!respbuf)
+      return;
+    
     struct rndis_initialize_cmplt *resp = (void*)respbuf->data;
 
     resp->MajorVersion = RNDIS_MAJOR_VERSION;
     resp->MinorVersion = RNDIS_MINOR_VERSION;
     resp->DeviceFlags = RNDIS_DF_CONNECTIONLESS;
     resp->Medium = RNDIS_MEDIUM_802_3;
-    resp->MaxPacketsPerTransfer = 1;
-    resp->MaxTransferSize = 36 + USBNET_BUFFER_SIZE;
+    resp->MaxPacketsPerTransfer = USBNET_MAX_TRANSFER_FRAMES;
+    resp->MaxTransferSize = USBNET_RX_TRANSFER_MAX;
     resp->PacketAlignmentFactor = 2;
     
     rndis_send_response(respbuf);
@@ -480,6 +1149,9 @@ static void rndis_send_command(uint8_t *buf, uint16_t len)
   {
     size_t max_reply_size = sizeof(struct rndis_query_cmplt) + sizeof(g_rndis_supported_oids);
     buffer_t *respbuf = rndis_prepare_response(max_reply_size, request_hdr);
+    if (!respbuf)
+      return;
+    
     struct rndis_query_msg *req = (void*)buf;
     struct rndis_query_cmplt *resp = (void*)respbuf->data;
 
@@ -518,26 +1190,39 @@ static void rndis_send_command(uint8_t *buf, uint16_t len)
         (unsigned)req->hdr.RequestID, (unsigned)req->ObjectID,
         (int)resp->InformationBufferLength, (unsigned)resp->Buffer[0]);
     
-    respbuf->data_size += resp->InformationBufferLength;
-    resp->hdr.MessageLength += resp->InformationBufferLength;
+    respbuf->data_size = sizeof(struct rndis_query_cmplt) + resp->InformationBufferLength;
+    resp->hdr.MessageLength = respbuf->data_size;
     
     rndis_send_response(respbuf);
   }
   else if (request_hdr->MessageType == RNDIS_MSG_SET)
   {
     buffer_t *respbuf = rndis_prepare_response(sizeof(struct rndis_response_header), request_hdr);
+    if (!respbuf)
+      return;
+    
     struct rndis_set_msg *req = (void*)buf;
     struct rndis_response_header *resp = (void*)respbuf->data;
+    
+    /* The value may be at any offset, so it is copied out */
+    uint32_t value = 0;
+    memcpy(&value, buf + 8 + req->InformationBufferOffset,
+           (req->InformationBufferLength < 4) ? req->InformationBufferLength : 4);
 
     dbg("RNDIS SET RID=%08x OID=%08x LEN=%d DAT=%08x", 
         (unsigned)req->hdr.RequestID, (unsigned)req->ObjectID,
-        (int)req->InformationBufferLength, (unsigned)req->Buffer[0]);
+        (int)req->InformationBufferLength, (unsigned)value);
 
-    if (req->ObjectID == RNDIS_OID_GEN_CURRENT_PACKET_FILTER)
+    if (req->ObjectID == RNDIS_OID_GEN_CURRENT_PACKET_FILTER && req->InformationBufferLength < 4)
+    {
+      warn("RNDIS packet filter of %d bytes", (int)req->InformationBufferLength);
+      resp->Status = RNDIS_STATUS_INVALID_LENGTH;
+    }
+    else if (req->ObjectID == RNDIS_OID_GEN_CURRENT_PACKET_FILTER)
     {
-      g_rndis_packet_filter = req->Buffer[0];
+      g_rndis_packet_filter = value;
       
-      if (req->Buffer[0] == 0)
+      if (value == 0)
       {
         g_rndis_connected = false;
       }
@@ -562,9 +1247,12 @@ static void rndis_send_command(uint8_t *buf, uint16_t len)
   else if (request_hdr->MessageType == RNDIS_MSG_RESET)
   {
     buffer_t *respbuf = rndis_prepare_response(sizeof(struct rndis_reset_cmplt), request_hdr);
+    g_rndis_connected = false;
+    if (!respbuf)
+      return;
+    
     struct rndis_reset_cmplt *resp = (void*)respbuf->data;
     resp->AddressingReset = 0;
-    g_rndis_connected = false;
     rndis_send_response(respbuf);
   }
   else if (request_hdr->MessageType == RNDIS_MSG_KEEPALIVE)
@@ -576,10 +1264,11 @@ static void rndis_send_command(uint8_t *buf, uint16_t len)
 
 static void rndis_get_response(uint8_t **buf, uint16_t *len)
 {
-  if (g_rndis_responses)
+  buffer_t *response = bufferqueue_peek(&g_rndis_responses);
+  if (response)
   {
-    *len = g_rndis_responses->data_size;
-    *buf = g_rndis_responses->data;
+    *len = response->data_size;
+    *buf = response->data;
   }
   else
   {
@@ -589,9 +1278,15 @@ static void rndis_get_response(uint8_t **buf, uint16_t *len)
 
 static void rndis_release_response(usbd_device *usbd_dev, struct usb_setup_data *req)
 {
-  if (g_rndis_responses)
+  buffer_t *response = bufferqueue_pop(&g_rndis_responses);
+  if (response)
   {
-    buffer_release(bufferlist_popfront(&g_rndis_responses));
+    buffer_release(response);
+  }
+  
+  if (bufferqueue_size(&g_rndis_responses) > 0)
+  {
+    rndis_notify_response();
   }
 }
 
@@ -616,132 +1311,223 @@ static int rndis_ctrl_callback(usbd_device *usbd_dev, struct usb_setup_data *req
   return USBD_REQ_NEXT_CALLBACK;
 }
 
-static size_t g_rndis_rx_frame_size;
-
-static void rndis_continue_rx()
-{
-  size_t size = g_rndis_rx_frame_size ? g_rndis_rx_frame_size : USBNET_USB_PACKET_SIZE;
-  bool status = rx_alloc_buffer(size);
-  usbd_ep_nak_set(g_usbd_dev, RNDIS_OUT_EP, !status);
-}
-
-static void rndis_rx_callback(usbd_device *usbd_dev, uint8_t ep)
+/* Find the frames in a received transfer of one or more packet messages.
+ * Hosts may terminate the transfer with a single extra byte, which is
+ * ignored here. */
+static size_t rndis_parse_transfer(const buffer_t *transfer, rx_frame_t *frames)
 {
-  assert(g_rx_buffer);
+  size_t min_header = offsetof(struct rndis_packet_msg, Padding);
+  size_t pos = 0;
+  size_t count = 0;
   
-  // Set NAK bit until we know whether there is space available for next packet.
-  usbd_ep_nak_set(usbd_dev, ep, true);
-  
-  if (!g_rndis_rx_frame_size)
+  /* Lengths are checked in subtracted form, as they come from the host
+   * and pos + MessageLength could wrap around. */
+  while (transfer->data_size - pos >= min_header && count < USBNET_MAX_TRANSFER_FRAMES)
   {
-    /* Start of new transfer */
-    size_t len = usbd_ep_read_packet(usbd_dev, ep, g_rx_buffer->data,
-                                     USBNET_USB_PACKET_SIZE);
+    const struct rndis_packet_msg *hdr = (const void*)&transfer->data[pos];
     
-    if (len < 16)
+    if (hdr->MessageType != RNDIS_MSG_PACKET || hdr->MessageLength < min_header ||
+        hdr->MessageLength > transfer->data_size - pos)
     {
-      /* Ignore zero-length-packet termination */
+      dbg("RNDIS unknown packet %08x", (unsigned)hdr->MessageType);
+      break;
     }
-    else
+    
+    size_t msg_end = pos + hdr->MessageLength;
+    
+    if (hdr->DataOffset < min_header - 8 || hdr->DataOffset > hdr->MessageLength - 8 ||
+        hdr->DataLength > msg_end - (pos + 8 + hdr->DataOffset) ||
+        hdr->DataLength > UINT16_MAX)
     {
-      struct rndis_packet_msg *hdr = (void*)g_rx_buffer->data;
-      if (hdr->MessageType == RNDIS_MSG_PACKET)
-      {
-        g_rndis_rx_frame_size = hdr->DataLength;
-        
-        /* Remove the rndis header from buffer */
-        size_t offset = hdr->DataOffset + 8;
-        g_rx_buffer->data_size = len - offset;
-        memcpy(g_rx_buffer->data, &g_rx_buffer->data[offset], g_rx_buffer->data_size);
-      }
-      else
-      {
-        dbg("RNDIS unknown packet %08x", (unsigned)hdr->MessageType);
-      }
+      warn("RNDIS invalid packet offset");
     }
-  }
-  else if (g_rx_buffer->data_size < g_rndis_rx_frame_size)
-  {
-    size_t max_len = g_rndis_rx_frame_size - g_rx_buffer->data_size;
-    if (max_len > USBNET_USB_PACKET_SIZE) max_len = USBNET_USB_PACKET_SIZE;
-    assert(g_rx_discard || g_rx_buffer->max_size >= g_rx_buffer->data_size + max_len);
-    size_t len = usbd_ep_read_packet(usbd_dev, ep, rx_buffer_ptr(),
-                                     max_len);
-    g_rx_buffer->data_size += len;
-    
-    if (g_rx_buffer->data_size >= g_rndis_rx_frame_size)
+    else
     {
-      g_rx_buffer->data_size = g_rndis_rx_frame_size;
-      g_rndis_rx_frame_size = 0;
+      frames[count].offset = pos + 8 + hdr->DataOffset;
+      frames[count].length = hdr->DataLength;
+      count++;
       g_rndis_host_tx_count++;
-      rx_done();
     }
+    
+    pos = msg_end;
   }
   
+  return count;
+}
+
+static void rndis_continue_rx()
+{
+  rx_receive(RNDIS_OUT_EP, rndis_parse_transfer, NULL);
+}
+
+static void rndis_rx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
   rndis_continue_rx();
 }
 
-static size_t g_rndis_tx_frame_size;
+/* Several packet messages are sent in one transfer, up to the
+ * MaxTransferSize the host gave in its initialize message. Like with NCM,
+ * the transfer is generated on the fly: each message is a 64-byte header
+ * followed by the frame and padding up to a multiple of 8 bytes. */
+#define RNDIS_TX_ALIGN 8
+
+static buffer_t *g_rndis_tx_frames[USBNET_MAX_TRANSFER_FRAMES];
+static uint16_t g_rndis_tx_offsets[USBNET_MAX_TRANSFER_FRAMES + 1];
+static uint8_t g_rndis_tx_frame_count;
+static size_t g_rndis_tx_size;
 static size_t g_rndis_tx_bytes_written;
 static bool g_rndis_tx_waiting_for_frame = true;
-static buffer_t *g_rndis_current_tx_buffer;
 
-static void rndis_start_tx()
+static size_t rndis_tx_in_flight()
 {
-  if (!g_rndis_connected)
+  return g_rndis_tx_frame_count;
+}
+
+static void rndis_reset_tx()
+{
+  for (int i = 0; i < g_rndis_tx_frame_count; i++)
   {
-    return;
+    tx_frame_done(g_rndis_tx_frames[i]);
+    g_rndis_tx_frames[i] = NULL;
   }
   
-  assert(!g_rndis_current_tx_buffer);
-  buffer_t *buffer = bufferlist_popfront(&g_usbnet_transmit_queue);
+  g_rndis_tx_frame_count = 0;
+  g_rndis_tx_size = 0;
+  g_rndis_tx_bytes_written = 0;
+  g_rndis_tx_waiting_for_frame = true;
+}
 
-  if (buffer)
+/* Copy len bytes of the IN transfer starting at pos to dst. */
+static void rndis_tx_gather(uint8_t *dst, size_t pos, size_t len)
+{
+  uint8_t *end = dst + len;
+  int i = 0;
+  
+  while (dst < end)
   {
-    g_rndis_tx_waiting_for_frame = false;
-    g_rndis_current_tx_buffer = buffer;
-    g_rndis_tx_frame_size = buffer->data_size;
-    g_rndis_tx_bytes_written = 0;
-
-    /* This is sized to be exactly 64 bytes */
-    struct rndis_packet_msg hdr = {};
-    hdr.MessageType = RNDIS_MSG_PACKET;
-    hdr.MessageLength = sizeof(hdr) + buffer->data_size;
-    hdr.DataOffset = sizeof(hdr) - 8;
-    hdr.DataLength = buffer->data_size;
+    size_t n = end - dst;
+    
+    if (pos >= g_rndis_tx_offsets[i + 1])
+    {
+      i++;
+      continue;
+    }
+    
+    size_t msg_pos = pos - g_rndis_tx_offsets[i];
+    size_t frame_size = buffer_frame_size(g_rndis_tx_frames[i]);
+    
+    if (msg_pos < sizeof(struct rndis_packet_msg))
+    {
+      struct rndis_packet_msg hdr = {};
+      hdr.MessageType = RNDIS_MSG_PACKET;
+      hdr.MessageLength = g_rndis_tx_offsets[i + 1] - g_rndis_tx_offsets[i];
+      hdr.DataOffset = sizeof(hdr) - 8;
+      hdr.DataLength = frame_size;
+      
+      if (n > sizeof(hdr) - msg_pos) n = sizeof(hdr) - msg_pos;
+      memcpy(dst, (uint8_t*)&hdr + msg_pos, n);
+    }
+    else if (msg_pos < sizeof(struct rndis_packet_msg) + frame_size)
+    {
+      size_t offset = msg_pos - sizeof(struct rndis_packet_msg);
+      if (n > frame_size - offset) n = frame_size - offset;
+      const uint8_t *data = buffer_gather(g_rndis_tx_frames[i], offset, n, dst);
+      if (data != dst) memcpy(dst, data, n);
+    }
+    else
+    {
+      /* Alignment padding */
+      if (n > g_rndis_tx_offsets[i + 1] - pos) n = g_rndis_tx_offsets[i + 1] - pos;
+      memset(dst, 0, n);
+    }
+    
+    dst += n;
+    pos += n;
+  }
+}
 
-    size_t len = usbd_ep_write_packet(g_usbd_dev, RNDIS_IN_EP, &hdr, USBNET_USB_PACKET_SIZE);
-    assert(len);
+/* Start a new transfer with as many of the queued frames as fit in it.
+ * Returns false if there was nothing to send. */
+static bool rndis_prepare_tx()
+{
+  assert(g_rndis_tx_frame_count == 0);
+  
+  size_t size = 0;
+  int count = 0;
+  
+  while (count < USBNET_MAX_TRANSFER_FRAMES)
+  {
+    buffer_t *buffer = tx_peek();
+    if (!buffer)
+      break;
+    
+    size_t msg_size = sizeof(struct rndis_packet_msg) + buffer_frame_size(buffer);
+    msg_size = (msg_size + RNDIS_TX_ALIGN - 1) & ~(RNDIS_TX_ALIGN - 1);
+    if (count > 0 && size + msg_size > g_rndis_host_max_transfer)
+      break;
+    
+    tx_dequeue();
+    g_rndis_tx_frames[count] = buffer;
+    g_rndis_tx_offsets[count] = size;
+    size += msg_size;
+    count++;
   }
-  else
+  
+  if (count > 0)
   {
-    g_rndis_tx_waiting_for_frame = true;
+    g_rndis_tx_offsets[count] = size;
+    g_rndis_tx_frame_count = count;
+    g_rndis_tx_size = size;
+    g_rndis_tx_bytes_written = 0;
+    return true;
   }
+  
+  return false;
 }
 
-static void rndis_tx_callback(usbd_device *usbd_dev, uint8_t ep)
+/* Fill the free endpoint buffers with packets of the current transfer,
+ * starting new transfers as long as there are frames queued. */
+static void rndis_start_tx()
 {
-  if (g_rndis_tx_bytes_written < g_rndis_tx_frame_size)
+  if (!g_rndis_connected)
+  {
+    return;
+  }
+  
+  while (usb_dblbuf_tx_free(RNDIS_IN_EP) > 0)
   {
-    size_t max_len = g_rndis_tx_frame_size - g_rndis_tx_bytes_written;
-    if (max_len > USBNET_USB_PACKET_SIZE) max_len = USBNET_USB_PACKET_SIZE;
-    size_t len = usbd_ep_write_packet(usbd_dev, ep,
-      g_rndis_current_tx_buffer->data + g_rndis_tx_bytes_written, max_len);
+    if (!g_rndis_tx_frame_count && !rndis_prepare_tx())
+    {
+      g_rndis_tx_waiting_for_frame = true;
+      return;
+    }
+    
+    g_rndis_tx_waiting_for_frame = false;
+    
+    size_t len = g_rndis_tx_size - g_rndis_tx_bytes_written;
+    if (len > USBNET_USB_PACKET_SIZE) len = USBNET_USB_PACKET_SIZE;
+    rndis_tx_gather(g_usb_tx_scratch, g_rndis_tx_bytes_written, len);
+    usb_dblbuf_write(RNDIS_IN_EP, g_usb_tx_scratch, len);
     g_rndis_tx_bytes_written += len;
-
-    if (g_rndis_tx_bytes_written >= g_rndis_tx_frame_size)
+    
+    if (len < USBNET_USB_PACKET_SIZE)
     {
-      /* Buffer can be released now */
-      buffer_release(g_rndis_current_tx_buffer);
-      g_rndis_current_tx_buffer = NULL;
-      g_rndis_host_rx_count++;
+      /* The data is in the packet memory, buffers can be released now */
+      for (int i = 0; i < g_rndis_tx_frame_count; i++)
+      {
+        tx_frame_done(g_rndis_tx_frames[i]);
+        g_rndis_tx_frames[i] = NULL;
+        g_rndis_host_rx_count++;
+      }
+      
+      g_rndis_tx_frame_count = 0;
     }
   }
-  else
-  {
-    /* Last packet of frame completed transmission */
-    rndis_start_tx();
-  }
+}
+
+static void rndis_tx_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+  rndis_start_tx();
 }
 
 /**************
@@ -754,10 +1540,16 @@ bool usbnet_is_connected()
   return g_cdcecm_connected || g_rndis_connected;
 }
 
-void usbnet_transmit(buffer_t *buffer)
+void usbnet_transmit(buffer_t *buffer, usbnet_prio_t prio)
 {
   CM_ATOMIC_CONTEXT();
-  bufferlist_append(&g_usbnet_transmit_queue, buffer);
+  capture_frame(buffer);
+  bufferqueue_push(&g_usbnet_transmit_queue[prio], buffer);
+  
+  if (tx_queue_size() > g_usbnet_transmit_peak)
+  {
+    g_usbnet_transmit_peak = tx_queue_size();
+  }
 
   if (g_cdcecm_tx_waiting_for_frame && g_cdcecm_connected)
   {
@@ -766,25 +1558,67 @@ void usbnet_transmit(buffer_t *buffer)
 
   if (g_rndis_tx_waiting_for_frame && g_rndis_connected)
   {
-//     rndis_start_tx();
+    rndis_start_tx();
   }
 }
 
 size_t usbnet_get_tx_queue_size()
 {
   CM_ATOMIC_CONTEXT();
-  size_t being_transmitted = (g_cdcecm_tx_waiting_for_frame ? 0 : 1);
-  return bufferlist_size(g_usbnet_transmit_queue) + being_transmitted;
+  return tx_queue_size() + cdcecm_tx_in_flight() + rndis_tx_in_flight();
+}
+
+size_t usbnet_get_tx_credit()
+{
+  size_t queued = usbnet_get_tx_queue_size();
+  return (queued < USBNET_TX_QUEUE_TARGET) ? USBNET_TX_QUEUE_TARGET - queued : 0;
+}
+
+void usbnet_register_tx_callback(usbnet_tx_callback_t callback)
+{
+  g_usbnet_tx_callback = callback;
 }
 
 buffer_t *usbnet_receive()
 {
   CM_ATOMIC_CONTEXT();
-  return bufferlist_popfront(&g_usbnet_received);
+  buffer_t *buffer = bufferqueue_pop(&g_usbnet_received);
+  if (buffer)
+  {
+    capture_frame(buffer);
+  }
+  
+  return buffer;
+}
+
+void usbnet_get_stats(usbnet_stats_t *stats)
+{
+  CM_ATOMIC_CONTEXT();
+  stats->tx_queue = tx_queue_size();
+  stats->tx_queue_peak = g_usbnet_transmit_peak;
+  stats->rx_queue = bufferqueue_size(&g_usbnet_received);
+  stats->rx_queue_peak = g_usbnet_received.peak;
+  stats->rx_queue_limit = g_rx_queue_limit;
+  stats->rx_nak_count = g_rx_nak_count;
+  stats->rx_nak_time = g_rx_nak_time;
 }
 
 void usbnet_poll()
 {
+  if (g_usbnet_tx_completed && usbnet_get_tx_credit() > 0)
+  {
+    g_usbnet_tx_completed = false;
+    
+    if (g_usbnet_tx_callback)
+    {
+      g_usbnet_tx_callback();
+    }
+  }
+  
+  /* The endpoint callbacks run in the USB interrupt */
+  CM_ATOMIC_CONTEXT();
+  rx_adapt_queue_limit();
+  
   if (g_rx_waiting_for_buffer)
   {
     if (g_cdcecm_connected)
@@ -10,7 +10,49 @@
 #define USBNET_SMALLBUF_SIZE 128
 #define USBNET_SMALLBUF_COUNT 2
 #define USBNET_USB_PACKET_SIZE 64
-#define USBNET_MAX_RX_QUEUE 1
+
+/* Number of received frames that can wait for tcpip before the OUT
+ * endpoint starts NAKing. The limit adapts between these: it grows while
+ * there are spare buffers and shrinks when transmit runs out of them. */
+#ifndef USBNET_MAX_RX_QUEUE
+#define USBNET_MAX_RX_QUEUE 3
+#endif
+#define USBNET_MIN_RX_QUEUE 1
+
+/* Use CDC NCM instead of CDC ECM for the CDC function. NCM packs several
+ * frames into one USB transfer (NTB), which saves USB frame slots when
+ * there are many small frames such as ACKs. */
+#ifndef USBNET_CDC_NCM
+#define USBNET_CDC_NCM 1
+#endif
+
+/* Maximum number of frames in one NCM NTB or RNDIS transfer, in both
+ * directions */
+#define USBNET_MAX_TRANSFER_FRAMES 4
+
+/* Largest IN NTB we generate, can be lowered by the host */
+#define USBNET_NCM_NTB_IN_MAX 2048
+
+/* Received buffers start with headroom for a slice header and alignment,
+ * so that frames are placed with the IPv6 header on a 4-byte boundary. */
+#define USBNET_RX_HEADROOM (sizeof(buffer_t) + 3)
+
+/* Largest OUT transfer the host may send to us */
+#define USBNET_RX_TRANSFER_MAX (USBNET_BUFFER_SIZE - USBNET_RX_HEADROOM)
+
+/* OUT transfers are received into a single buffer, so the NCM or RNDIS
+ * headers have to fit in it along with the frame. */
+#define USBNET_OUT_OVERHEAD 48
+
+/* Largest frame the host may send to us */
+#define USBNET_MAX_FRAME_SIZE (USBNET_RX_TRANSFER_MAX - USBNET_OUT_OVERHEAD)
+
+/* Buffer quotas: big buffers guaranteed for receiving, small buffers
+ * guaranteed for ACKs and other control frames, and the maximum number
+ * of buffers outgoing data can take. */
+#define USBNET_RX_RESERVE 1
+#define USBNET_CTRL_RESERVE 1
+#define USBNET_TX_LIMIT 3
 
 /* Module initialization */
 usbd_device *usbnet_init(const usbd_driver *driver, uint32_t serialnumber);
@@ -20,10 +62,27 @@ usbd_device *usbnet_init(const usbd_driver *driver, uint32_t serialnumber);
  */
 bool usbnet_is_connected();
 
-/* Schedule a buffer for transmission.
+/* Transmit priorities. Control frames (ACKs, neighbor adverts and other
+ * small frames) are always sent before bulk data, except that after
+ * USBNET_MAX_CONTROL_BURST consecutive control frames one waiting bulk
+ * frame gets its turn.
+ */
+typedef enum {
+  USBNET_PRIO_CONTROL = 0,
+  USBNET_PRIO_BULK,
+  USBNET_PRIO_COUNT
+} usbnet_prio_t;
+
+#define USBNET_MAX_CONTROL_BURST 4
+
+/* Schedule a buffer for transmission with the given priority.
+ * Takes over one reference to the buffer, which is released after the
+ * frame has been sent. Callers that want to keep the frame, e.g. for
+ * retransmission, should buffer_retain() it first. The same buffer must
+ * not be queued again before the earlier transmission has completed.
  * Safe to call from IRQs.
  */
-void usbnet_transmit(buffer_t *buffer);
+void usbnet_transmit(buffer_t *buffer, usbnet_prio_t prio);
 
 /* Query current TX buffer size (number of queued frames).
  * 0 = line idle, 1 = one frame currently transmitting, 2+ = queued frames
@@ -31,11 +90,45 @@ void usbnet_transmit(buffer_t *buffer);
  */
 size_t usbnet_get_tx_queue_size();
 
+/* Number of frames producers should keep queued. This keeps the USB
+ * pipe busy without holding more buffers than needed. */
+#define USBNET_TX_QUEUE_TARGET 2
+
+/* Query number of frames that can be queued now without exceeding
+ * USBNET_TX_QUEUE_TARGET. Streaming producers should send only while
+ * this is non-zero.
+ * Safe to call from IRQs.
+ */
+size_t usbnet_get_tx_credit();
+
+/* Register a callback that is called from usbnet_poll() when a frame has
+ * completed transmission and there is transmit credit available.
+ */
+typedef void (*usbnet_tx_callback_t)();
+void usbnet_register_tx_callback(usbnet_tx_callback_t callback);
+
 /* Return a received buffer, or NULL.
  * Safe to call from IRQs.
  */
 buffer_t *usbnet_receive();
 
+/* Queue statistics. The NAK counters tell how often and for how long
+ * received packets waited in the endpoint because there was no buffer. */
+typedef struct {
+  uint8_t tx_queue;
+  uint8_t tx_queue_peak;
+  uint8_t rx_queue;
+  uint8_t rx_queue_peak;
+  uint8_t rx_queue_limit;
+  uint16_t rx_nak_count;
+  uint32_t rx_nak_time; /* Microseconds */
+} __attribute__((packed)) usbnet_stats_t;
+
+/* Take a snapshot of usbnet statistics.
+ * Safe to call from IRQs.
+ */
+void usbnet_get_stats(usbnet_stats_t *stats);
+
 /* Called by main thread for periodic processing. */
 void usbnet_poll();
 
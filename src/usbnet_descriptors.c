@@ -1,6 +1,15 @@
 #include "usbnet_descriptors.h"
+#include "usbnet.h"
 #include "cdcecm_std.h"
 
+#if USBNET_CDC_NCM
+#define CDC_SUBCLASS USB_CDC_SUBCLASS_NCM
+#define CDC_DATA_PROTOCOL USB_CDC_NCM_DATA_PROTOCOL_NTB
+#else
+#define CDC_SUBCLASS USB_CDC_SUBCLASS_ECM
+#define CDC_DATA_PROTOCOL 0
+#endif
+
 static const struct usb_endpoint_descriptor rndis_irq_endp[] = {{
         .bLength = USB_DT_ENDPOINT_SIZE,
         .bDescriptorType = USB_DT_ENDPOINT,
@@ -55,6 +64,9 @@ static const struct {
         struct usb_cdc_header_descriptor header;
         struct usb_cdc_union_descriptor cdc_union;
         struct usb_cdc_enfd_descriptor enfd;
+#if USBNET_CDC_NCM
+        struct usb_cdc_ncm_descriptor ncm;
+#endif
 } __attribute__((packed)) cdcecm_functional_descriptors = {
         .header = {
                 .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
@@ -75,10 +87,19 @@ static const struct {
             .bDescriptorSubtype = USB_CDC_TYPE_ENFD,
             .iMACAddress = 4, // In usb_strings table below
             .bmEthernetStatistics = 0,
-            .wMaxSegmentSize = 768,
+            .wMaxSegmentSize = USBNET_MAX_FRAME_SIZE,
             .wNumberMCFilters = 0,
             .bNumberPowerFilters = 0
         },
+#if USBNET_CDC_NCM
+        .ncm = {
+            .bFunctionLength = sizeof(struct usb_cdc_ncm_descriptor),
+            .bDescriptorType = CS_INTERFACE,
+            .bDescriptorSubtype = USB_CDC_TYPE_NCM,
+            .bcdNcmVersion = USB_CDC_NCM_VERSION,
+            .bmNetworkCapabilities = 0
+        },
+#endif
 };
 
 
@@ -128,7 +149,7 @@ static const struct usb_iface_assoc_descriptor cdcecm_assoc = {
         .bFirstInterface = CDCECM_INTERFACE,
         .bInterfaceCount = 2,
         .bFunctionClass = USB_CLASS_CDC,
-        .bFunctionSubClass = USB_CDC_SUBCLASS_ECM,
+        .bFunctionSubClass = CDC_SUBCLASS,
         .bFunctionProtocol = 0x00,
         .iFunction = 0,
 };
@@ -140,7 +161,7 @@ static const struct usb_interface_descriptor cdcecm_irq_iface[] = {{
         .bAlternateSetting = 0,
         .bNumEndpoints = 1,
         .bInterfaceClass = USB_CLASS_CDC,
-        .bInterfaceSubClass = USB_CDC_SUBCLASS_ECM,
+        .bInterfaceSubClass = CDC_SUBCLASS,
         .bInterfaceProtocol = 0,
         .iInterface = 0,
 
@@ -170,7 +191,7 @@ static const struct usb_interface_descriptor cdcecm_data_iface[] = {
         .bNumEndpoints = 2,
         .bInterfaceClass = USB_CLASS_DATA,
         .bInterfaceSubClass = 0,
-        .bInterfaceProtocol = 0,
+        .bInterfaceProtocol = CDC_DATA_PROTOCOL,
         .iInterface = 0,
 
         .endpoint = cdcecm_data_endp,